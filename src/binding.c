@@ -0,0 +1,201 @@
+//==============================================================================
+// Input Bindings
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stm32f3xx_hal.h>
+
+#include "binding.h"
+#include "can.h"
+#include "ccm.h"
+#include "config.h"
+#include "gpio.h"
+#include "rgb_strip.h"
+#include "trace.h"
+
+
+#ifdef BINDINGS
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+typedef struct
+{
+	bool pending;
+	uint8_t action;
+	uint8_t red;
+	uint8_t green;
+	uint8_t blue;
+	uint32_t timestamp;		// cycle counter of the input edge
+} strip_action_t;
+
+
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static uint8_t opposite(uint8_t action);
+
+
+//------------------------------------------------------------------------------
+// Private Variables
+//------------------------------------------------------------------------------
+
+static binding_t bindings[BINDING_MAX] CCM_BSS;
+
+#ifdef RGB_STRIP
+static volatile strip_action_t strip_actions[RGB_NUM_STRIPS];
+#endif // RGB_STRIP
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Set a binding, a disabled trigger removes it
+void binding_set(uint8_t index, const binding_t *binding)
+{
+	if(index >= BINDING_MAX) return;
+	if(binding->trigger >= BINDING_NUM_TRIGGERS || binding->action >= BINDING_NUM_ACTIONS) return;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	bindings[index] = *binding;
+	__set_PRIMASK(primask);
+}
+
+// Get a binding, false if the index is out of range
+bool binding_get(uint8_t index, binding_t *binding)
+{
+	if(index >= BINDING_MAX) return false;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	*binding = bindings[index];
+	__set_PRIMASK(primask);
+
+	return true;
+}
+
+// Run bindings for changed inputs -- called from the EXTI ISR
+CCM_FUNC void binding_process(uint8_t states, uint8_t changed, uint32_t timestamp)
+{
+	uint8_t out_states = gpio_read_outputs();
+	uint8_t out_mask = 0;
+
+	for(size_t i = 0; i < BINDING_MAX; i++)
+	{
+		binding_t *binding = &bindings[i];
+		if(binding->trigger == BINDING_DISABLED || binding->input < 1 || binding->input > GPIO_NUM_INPUTS) continue;
+
+		uint8_t bit = 1 << (binding->input - 1);
+		if(!(changed & bit)) continue;
+
+		bool rising = states & bit;
+		uint8_t action = binding->action;
+		if(binding->trigger == BINDING_RISING_EDGE && !rising) continue;
+		if(binding->trigger == BINDING_FALLING_EDGE && rising) continue;
+		if(binding->trigger == BINDING_STATE && !rising) action = opposite(action);
+
+		switch(action)
+		{
+			case BINDING_OUTPUT_OFF:
+			case BINDING_OUTPUT_ON:
+			case BINDING_OUTPUT_TOGGLE:
+			{
+				if(binding->target < 1 || binding->target > GPIO_NUM_OUTPUTS) break;
+
+				uint8_t out_bit = 1 << (binding->target - 1);
+				out_mask |= out_bit;
+
+				if(action == BINDING_OUTPUT_ON) out_states |= out_bit;
+				else if(action == BINDING_OUTPUT_OFF) out_states &= ~out_bit;
+				else out_states ^= out_bit;
+				break;
+			}
+
+#ifdef RGB_STRIP
+
+			case BINDING_STRIP_OFF:
+			case BINDING_STRIP_COLOR:
+			case BINDING_STRIP_RAINBOW:
+			{
+				if(binding->target >= RGB_NUM_STRIPS) break;
+
+				// the last action before the main loop picks it up wins
+				volatile strip_action_t *strip = &strip_actions[binding->target];
+				strip->action = action;
+				strip->red = binding->red;
+				strip->green = binding->green;
+				strip->blue = binding->blue;
+				strip->timestamp = timestamp;
+				strip->pending = true;
+				break;
+			}
+
+#endif // RGB_STRIP
+
+			default:
+				break;
+		}
+	}
+
+	// outputs owned by a truth table or PWM are left alone
+	out_mask &= ~gpio_reserved_outputs();
+	if(!out_mask) return;
+
+	gpio_update_outputs(out_states, out_mask);
+	trace_record(CAN_CMD_BINDING, TRACE_GPIO_WRITE, timestamp);
+}
+
+// Apply strip actions from bindings, call before rgb_strip_task()
+void binding_task(void)
+{
+#ifdef RGB_STRIP
+
+	for(size_t i = 0; i < RGB_NUM_STRIPS; i++)
+	{
+		if(!strip_actions[i].pending) continue;
+
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		strip_action_t strip = strip_actions[i];
+		strip_actions[i].pending = false;
+		__set_PRIMASK(primask);
+
+		rgb_strip_trace(i, CAN_CMD_BINDING, strip.timestamp);
+		if(strip.action == BINDING_STRIP_OFF) rgb_strip_disable(i);
+		else if(strip.action == BINDING_STRIP_COLOR) rgb_strip_set_color(i, strip.red, strip.green, strip.blue);
+		else if(strip.action == BINDING_STRIP_RAINBOW) rgb_strip_set_rainbow(i);
+	}
+
+#endif // RGB_STRIP
+}
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Return the action a state binding runs when its input goes low
+CCM_FUNC static uint8_t opposite(uint8_t action)
+{
+	switch(action)
+	{
+		case BINDING_OUTPUT_OFF: return BINDING_OUTPUT_ON;
+		case BINDING_OUTPUT_ON: return BINDING_OUTPUT_OFF;
+		case BINDING_OUTPUT_TOGGLE: return BINDING_OUTPUT_TOGGLE;
+		case BINDING_STRIP_COLOR: return BINDING_STRIP_OFF;
+		case BINDING_STRIP_RAINBOW: return BINDING_STRIP_OFF;
+		default: return BINDING_NONE;
+	}
+}
+
+#endif // BINDINGS
@@ -0,0 +1,82 @@
+//==============================================================================
+// Input Bindings
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_BINDING_H
+#define ATLC_BINDING_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	A binding runs an action when a debounced input changes, without a round
+	trip to the CAN master. Output actions are written from the input EXTI
+	interrupt. Strip actions are handed to the main loop, since a strip frame
+	can't be restarted from an ISR.
+
+	A state binding runs its action when the input goes high and the
+	opposite action when it goes low.
+*/
+
+typedef enum
+{
+	BINDING_DISABLED = 0,
+	BINDING_RISING_EDGE = 1,
+	BINDING_FALLING_EDGE = 2,
+	BINDING_ANY_CHANGE = 3,
+	BINDING_STATE = 4,
+	BINDING_NUM_TRIGGERS
+} binding_trigger_t;
+
+typedef enum
+{
+	BINDING_NONE = 0,
+	BINDING_OUTPUT_OFF = 1,
+	BINDING_OUTPUT_ON = 2,
+	BINDING_OUTPUT_TOGGLE = 3,
+	BINDING_STRIP_OFF = 4,
+	BINDING_STRIP_COLOR = 5,
+	BINDING_STRIP_RAINBOW = 6,
+	BINDING_NUM_ACTIONS
+} binding_action_t;
+
+typedef struct
+{
+	uint8_t input;			// input pin, numbered from 1
+	uint8_t trigger;
+	uint8_t action;
+	uint8_t target;			// output pin from 1, or strip from 0
+	uint8_t red;
+	uint8_t green;
+	uint8_t blue;
+} binding_t;
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+#ifdef BINDINGS
+
+void binding_set(uint8_t index, const binding_t *binding);
+bool binding_get(uint8_t index, binding_t *binding);
+void binding_process(uint8_t states, uint8_t changed, uint32_t timestamp);
+void binding_task(void);
+
+#endif // BINDINGS
+
+
+#endif // ATLC_BINDING_H
@@ -0,0 +1,124 @@
+//==============================================================================
+// Bootloader
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stm32f3xx_hal.h>
+
+#include "ccm.h"
+#include "slot.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	Picks a firmware slot from the boot records and starts it, see
+	src/slot.h. Updates are received by the firmware, so this stays small
+	and runs on the 8 MHz HSI without touching any peripheral but flash.
+	Reset flags are left for the firmware to read.
+*/
+
+
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static uint8_t choose_slot(void);
+static void jump(uint8_t slot);
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+int main(void)
+{
+	// the CRC tables are in CCM
+	ccm_init();
+
+	// flash timeouts need the tick
+	HAL_Init();
+
+	uint8_t slot = choose_slot();
+
+	// nothing to run, wait for the debugger
+	if(!slot_bootable(slot)) while(1);
+
+	HAL_DeInit();
+	jump(slot);
+}
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Pick the slot to boot, a trial slot is only tried once
+static uint8_t choose_slot(void)
+{
+	boot_record_t record;
+	if(!slot_read_record(&record))
+	{
+		// never updated, the debugger flashed slot A
+		return slot_bootable(SLOT_A) ? SLOT_A : SLOT_B;
+	}
+
+	if(record.trial < SLOT_NUM_SLOTS)
+	{
+		bool trial_ok = record.tries == 0
+			&& slot_bootable(record.trial)
+			&& slot_crc(record.trial, record.trial_size) == record.trial_crc;
+
+		if(trial_ok)
+		{
+			// count the try first, a trial that never confirms falls back on the next reset
+			record.tries++;
+			if(slot_write_record(&record)) return record.trial;
+		}
+		else
+		{
+			// the trial reset before it was confirmed, or its image is damaged
+			record.trial = SLOT_NONE;
+			record.tries = 0;
+			slot_write_record(&record);
+		}
+	}
+
+	if(slot_bootable(record.confirmed)) return record.confirmed;
+	return record.confirmed == SLOT_A ? SLOT_B : SLOT_A;
+}
+
+// Start the image in a slot
+static void jump(uint8_t slot)
+{
+	const volatile uint32_t *vectors = (const volatile uint32_t *)slot_address(slot);
+	uint32_t stack = vectors[0];
+	void (*reset)(void) = (void (*)(void))vectors[1];
+
+	// hand over with SysTick stopped and nothing pending
+	SysTick->CTRL = 0;
+	SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+
+	SCB->VTOR = (uint32_t)vectors;
+	__set_MSP(stack);
+	reset();
+}
+
+
+//------------------------------------------------------------------------------
+// ISRs
+//------------------------------------------------------------------------------
+
+// SysTick ISR
+void SysTick_Handler(void)
+{
+	HAL_IncTick();
+}
@@ -13,9 +13,15 @@
 #include <stm32f3xx_hal.h>
 
 #include "can.h"
+#include "ccm.h"
+#include "clock.h"
 #include "config.h"
 #include "debug.h"
 #include "gpio.h"
+#include "profile.h"
+#include "status.h"
+#include "store.h"
+#include "update.h"
 
 
 //------------------------------------------------------------------------------
@@ -32,15 +38,85 @@
 
 #define CAN_BUF_SIZE	16
 
+#define TX_TIMEOUT			5		// ms to wait for a free tx mailbox
+
+/*
+	Bus-off recovery is started from can_task() rather than automatically,
+	so a node on a broken bus backs off instead of joining every 1.4 ms.
+	The delay doubles with each bus-off and goes back to BUS_OFF_DELAY once
+	the bus has stayed up for BUS_OFF_DELAY_MAX.
+*/
+
+#define BUS_OFF_DELAY		100		// ms
+#define BUS_OFF_DELAY_MAX	6400	// ms
+
+/*
+	Control commands (GPIO reads and writes and truth tables, command
+	numbers 0-3) are received in FIFO1 and their own ring, so a burst of
+	strip traffic in FIFO0 can't hold them up. can_receive() takes the
+	control ring first.
+
+	Filter banks, each matches the low 8 bits of extended ids:
+	0...: our node id, broadcast and group ids, control commands to FIFO1
+	NUM_ADDRESSES...: the same ids, every command to FIFO0
+
+	When filters of the same mode and scale both match, the lower bank
+	wins, so control commands always land in FIFO1. Unused group banks are
+	disabled.
+*/
+
+#define ADDRESS_NODE		0
+#define ADDRESS_BROADCAST	1
+#define ADDRESS_GROUPS		2
+#define NUM_ADDRESSES		(ADDRESS_GROUPS + CAN_MAX_GROUPS)
+
+#define CONTROL_CMD_MASK	0x3CUL		// command bits matched, 0-3 pass with or without CAN_RELIABLE_FLAG
+
+#if NUM_ADDRESSES * 2 > 14
+#error "bxCAN has 14 filter banks, CAN_MAX_GROUPS is at most 5"
+#endif
+
+typedef struct
+{
+	can_msg_t msgs[CAN_BUF_SIZE];
+	size_t write_pos;
+	size_t read_pos;
+} msg_ring_t;
+
+
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static void set_filters(uint8_t address, uint8_t id, bool enable);
+static bool pop_message(volatile msg_ring_t *ring, can_msg_t *msg);
+static void queue_message(volatile msg_ring_t *ring, const CAN_RxHeaderTypeDef *header, const uint8_t *payload, uint32_t timestamp);
+static void collect_tx_status(void);
+static void recover_bus_off(void);
+static void put_counter(uint8_t *payload, uint32_t value);
+static void count(volatile uint32_t *counter, uint32_t n);
+
 
 //------------------------------------------------------------------------------
 // Private Variables
 //------------------------------------------------------------------------------
 
 static CAN_HandleTypeDef hcan;
-static volatile can_msg_t buffer[CAN_BUF_SIZE];
-static volatile size_t buf_write_pos;
-static volatile size_t buf_read_pos;
+static uint8_t can_id = CAN_ID;
+static uint8_t groups[CAN_MAX_GROUPS];
+static uint8_t num_groups;
+static volatile msg_ring_t rx_ring CCM_BSS;
+static volatile msg_ring_t control_ring CCM_BSS;
+
+static volatile can_stats_t stats;
+static volatile bool bus_off;
+static volatile uint32_t bus_off_time;		// tick of the last bus-off
+static uint32_t bus_off_delay = BUS_OFF_DELAY;
+static uint32_t recover_time;				// tick of the last recovery
+
+static uint8_t heartbeat_id = CAN_HEARTBEAT_ID;
+static uint16_t heartbeat_interval = CAN_HEARTBEAT_INTERVAL;
+static uint32_t heartbeat_time;
 
 
 //------------------------------------------------------------------------------
@@ -56,6 +132,19 @@ void can_init(void)
 		Determine bit timings with a calculator such as http://www.bittiming.can-wiki.info/
 	*/
 
+#ifdef CONFIG_STORE
+
+	// a stored node id overrides CAN_ID
+	store_get(STORE_KEY_CAN_ID, &can_id, 1);
+
+	uint8_t heartbeat[3];
+	if(store_get(STORE_KEY_HEARTBEAT, heartbeat, sizeof(heartbeat)) == sizeof(heartbeat))
+	{
+		can_set_heartbeat(heartbeat[0], (heartbeat[1] << 8) | heartbeat[2]);
+	}
+
+#endif // CONFIG_STORE
+
 	// configure gpio pins
 	GPIO_InitTypeDef gpio_config = {0};
 	gpio_config.Pin = CAN_PINS;
@@ -73,28 +162,40 @@ void can_init(void)
 	hcan.Init.TimeSeg1 = CAN_BS1_15TQ;
 	hcan.Init.TimeSeg2 = CAN_BS2_2TQ;
 	hcan.Init.TimeTriggeredMode = DISABLE;
-	hcan.Init.AutoBusOff = ENABLE;
+	hcan.Init.AutoBusOff = DISABLE;
 	hcan.Init.AutoWakeUp = DISABLE;
 	hcan.Init.AutoRetransmission = DISABLE;
 	hcan.Init.ReceiveFifoLocked = DISABLE;
 	hcan.Init.TransmitFifoPriority = DISABLE;
 	debug_assert(HAL_CAN_Init(&hcan) == HAL_OK, "Failed to configure CAN");
 
-	// configure interrupts
+	// configure interrupts, the control lane preempts FIFO0 so it's taken first when both are pending
 	__HAL_CAN_ENABLE_IT(&hcan, CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_RX_FIFO0_FULL | CAN_IT_RX_FIFO0_OVERRUN);
-	HAL_NVIC_SetPriority(USB_LP_CAN_RX0_IRQn, 0, 1);
+	__HAL_CAN_ENABLE_IT(&hcan, CAN_IT_RX_FIFO1_MSG_PENDING | CAN_IT_RX_FIFO1_FULL | CAN_IT_RX_FIFO1_OVERRUN);
+	HAL_NVIC_SetPriority(USB_LP_CAN_RX0_IRQn, 1, 0);
+	HAL_NVIC_SetPriority(CAN_RX1_IRQn, 0, 0);
 	HAL_NVIC_EnableIRQ(USB_LP_CAN_RX0_IRQn);
+	HAL_NVIC_EnableIRQ(CAN_RX1_IRQn);
 
-	// filter all msgs except extended-id with our can id
-	CAN_FilterTypeDef filter_config = {0};
-	filter_config.FilterIdLow = (CAN_ID << 3) | (1 << 2);
-	filter_config.FilterMaskIdLow = (0xFF << 3) | (1 << 2);
-	filter_config.FilterFIFOAssignment = CAN_FILTER_FIFO0;
-	filter_config.FilterBank = 0;
-	filter_config.FilterMode = CAN_FILTERMODE_IDMASK;
-	filter_config.FilterScale = CAN_FILTERSCALE_32BIT;
-	filter_config.FilterActivation = CAN_FILTER_ENABLE;
-	debug_assert(HAL_CAN_ConfigFilter(&hcan, &filter_config) == HAL_OK, "Failed to configure CAN filter");
+	// error counting, these interrupt on every error frame so they run last
+	__HAL_CAN_ENABLE_IT(&hcan, CAN_IT_ERROR_WARNING | CAN_IT_ERROR_PASSIVE | CAN_IT_BUSOFF | CAN_IT_LAST_ERROR_CODE | CAN_IT_ERROR);
+	HAL_NVIC_SetPriority(CAN_SCE_IRQn, 3, 1);
+	HAL_NVIC_EnableIRQ(CAN_SCE_IRQn);
+
+	// filter all msgs except extended-id with our can id, broadcast or group ids
+	set_filters(ADDRESS_NODE, can_id, can_id != CAN_ID_NONE);
+	set_filters(ADDRESS_BROADCAST, CAN_BROADCAST_ID, true);
+
+	uint8_t ids[CAN_MAX_GROUPS] = {0};
+	uint8_t count = 0;
+
+#ifdef CONFIG_STORE
+
+	count = store_get(STORE_KEY_GROUPS, ids, sizeof(ids));
+
+#endif // CONFIG_STORE
+
+	can_set_groups(ids, count);
 
 	// start receiving messages
 	debug_assert(HAL_CAN_Start(&hcan) == HAL_OK, "Failed to start CAN");
@@ -104,64 +205,389 @@ void can_init(void)
 void can_deinit(void)
 {
 	HAL_NVIC_DisableIRQ(USB_LP_CAN_RX0_IRQn);
+	HAL_NVIC_DisableIRQ(CAN_RX1_IRQn);
+	HAL_NVIC_DisableIRQ(CAN_SCE_IRQn);
 	HAL_CAN_Stop(&hcan);
 	HAL_GPIO_DeInit(CAN_PORT, CAN_PINS);
 }
 
+// Return our node id
+uint8_t can_get_id(void)
+{
+	return can_id;
+}
+
+// Change our node id, CAN_ID_NONE stops receiving on one
+void can_set_id(uint8_t id)
+{
+	can_id = id;
+	set_filters(ADDRESS_NODE, id, id != CAN_ID_NONE);
+}
+
+// Set the group ids we receive commands on, the rest of the group filters are disabled
+void can_set_groups(const uint8_t *ids, uint8_t count)
+{
+	// reception pauses for a moment while the filters are written
+	if(count > CAN_MAX_GROUPS) count = CAN_MAX_GROUPS;
+
+	for(uint8_t i = 0; i < CAN_MAX_GROUPS; i++)
+	{
+		if(i < count) groups[i] = ids[i];
+		set_filters(ADDRESS_GROUPS + i, groups[i], i < count);
+	}
+
+	num_groups = count;
+}
+
+// Check if an id is the broadcast id or one of our groups rather than our node id
+bool can_is_group(uint8_t id)
+{
+	if(id == can_id) return false;
+	if(id == CAN_BROADCAST_ID) return true;
+
+	for(uint8_t i = 0; i < num_groups; i++)
+	{
+		if(groups[i] == id) return true;
+	}
+
+	return false;
+}
+
 // Send a CAN message
 void can_send(uint8_t id, can_cmd_t cmd, uint8_t *payload, uint8_t len)
+{
+	can_send_tagged(id, cmd, 0, payload, len);
+}
+
+// Send a CAN message with a tag in id bits 27:14, frames from different nodes with the same id then arbitrate
+void can_send_tagged(uint8_t id, can_cmd_t cmd, uint16_t tag, uint8_t *payload, uint8_t len)
 {
 	CAN_TxHeaderTypeDef msg_header = {0};
-	msg_header.ExtId = cmd << 8 | id;
+	msg_header.ExtId = ((uint32_t)(tag & CAN_TAG_MASK) << CAN_TAG_POS) | cmd << 8 | id;
 	msg_header.IDE = CAN_ID_EXT;
 	msg_header.DLC = len;
 
+	collect_tx_status();
+
+	// nothing gets out until the bus is recovered
+	if(bus_off)
+	{
+		count(&stats.tx_dropped, 1);
+		return;
+	}
+
 	// wait for a tx to become free
-	while(HAL_CAN_GetTxMailboxesFreeLevel(&hcan) == 0);
+	uint32_t start = HAL_GetTick();
+	while(HAL_CAN_GetTxMailboxesFreeLevel(&hcan) == 0)
+	{
+		if(HAL_GetTick() - start >= TX_TIMEOUT)
+		{
+			count(&stats.tx_dropped, 1);
+			return;
+		}
+	}
 
 	// send it
 	uint32_t mailbox;
 	if(HAL_CAN_AddTxMessage(&hcan, &msg_header, payload, &mailbox) != HAL_OK)
 	{
-		debug_printf("Error sending CAN message");
+		count(&stats.tx_dropped, 1);
+		log_error("Error sending CAN message");
 		return;
 	}
 
+	stats.tx_frames++;
+
 	// blink status LED on activity
-	HAL_GPIO_WritePin(STATUS_PORT, STATUS_PIN, GPIO_PIN_RESET);
-	HAL_Delay(STATUS_BLINK_TIME);
-	HAL_GPIO_WritePin(STATUS_PORT, STATUS_PIN, GPIO_PIN_SET);
+	status_activity();
 }
 
-// Receive a CAN message
+// Wait for sent messages to leave the tx mailboxes, up to timeout ms
+void can_flush(uint32_t timeout)
+{
+	uint32_t start = HAL_GetTick();
+	while(HAL_CAN_GetTxMailboxesFreeLevel(&hcan) < 3 && HAL_GetTick() - start < timeout);
+}
+
+// Receive a CAN message, control commands first
 bool can_receive(can_msg_t *msg)
 {
-	HAL_NVIC_DisableIRQ(USB_LP_CAN_RX0_IRQn);
+	if(!pop_message(&control_ring, msg) && !pop_message(&rx_ring, msg)) return false;
+
+	msg->source = MSG_SOURCE_CAN;
+
+	// blink status LED on activity
+	status_activity();
+
+	return true;
+}
+
+// Receive a control command, leaving other messages queued
+bool can_receive_control(can_msg_t *msg)
+{
+	if(!pop_message(&control_ring, msg)) return false;
+
+	msg->source = MSG_SOURCE_CAN;
+	status_activity();
+
+	return true;
+}
+
+
+// Recover from bus-off and send heartbeats, call from the main loop
+void can_task(void)
+{
+	collect_tx_status();
+
+	uint32_t now = HAL_GetTick();
+	if(bus_off)
+	{
+		if(now - bus_off_time >= bus_off_delay) recover_bus_off();
+		return;
+	}
+
+	// the bus has been fine for a while, forget earlier bus-offs
+	if(bus_off_delay > BUS_OFF_DELAY && now - recover_time >= BUS_OFF_DELAY_MAX) bus_off_delay = BUS_OFF_DELAY;
+
+	if(heartbeat_interval && now - heartbeat_time >= heartbeat_interval)
+	{
+		heartbeat_time = now;
+
+		uint8_t payload[8];
+		uint8_t len = can_read_stats_page(CAN_STATS_PAGE_STATE, payload);
+		can_send(heartbeat_id, CAN_CMD_BUS_STATS, payload, len);
+	}
+}
+
+// Send bus state to an id every interval ms, 0 stops it
+void can_set_heartbeat(uint8_t id, uint16_t interval)
+{
+	heartbeat_id = id;
+	heartbeat_interval = interval;
+	heartbeat_time = HAL_GetTick();
+}
+
+// Copy the bus counters
+void can_get_stats(can_stats_t *copy)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	*copy = *(const can_stats_t *)&stats;
+	__set_PRIMASK(primask);
+}
+
+// Fill a Bus Stats reply page, returns its length or 0 for an unknown page
+uint8_t can_read_stats_page(uint8_t page, uint8_t *payload)
+{
+	can_stats_t copy;
+	can_get_stats(&copy);
 
-	if(buf_read_pos == buf_write_pos)
+	switch(page)
 	{
-		HAL_NVIC_EnableIRQ(USB_LP_CAN_RX0_IRQn);
-		return false;
+		case CAN_STATS_PAGE_STATE:
+		{
+			uint32_t esr = hcan.Instance->ESR;
+			uint8_t state = 0;
+			if(esr & CAN_ESR_EWGF) state |= CAN_STATE_WARNING;
+			if(esr & CAN_ESR_EPVF) state |= CAN_STATE_PASSIVE;
+			if(bus_off) state |= CAN_STATE_BUS_OFF;
+
+			payload[0] = (esr >> CAN_ESR_TEC_Pos) & 0xFF;
+			payload[1] = (esr >> CAN_ESR_REC_Pos) & 0xFF;
+			payload[2] = copy.last_error;
+			payload[3] = state;
+			put_counter(&payload[4], copy.bus_offs);
+			put_counter(&payload[6], copy.tx_dropped);
+			return 8;
+		}
+
+		case CAN_STATS_PAGE_RECEIVE:
+			put_counter(&payload[0], copy.rx_overruns[0]);
+			put_counter(&payload[2], copy.rx_overruns[1]);
+			put_counter(&payload[4], copy.fifo_full);
+			put_counter(&payload[6], copy.ring_drops);
+			return 8;
+
+		case CAN_STATS_PAGE_ERRORS:
+			put_counter(&payload[0], copy.stuff_errors);
+			put_counter(&payload[2], copy.form_errors);
+			put_counter(&payload[4], copy.ack_errors);
+			put_counter(&payload[6], copy.crc_errors);
+			return 8;
+
+		case CAN_STATS_PAGE_TRANSMIT:
+			put_counter(&payload[0], copy.bit_recessive_errors);
+			put_counter(&payload[2], copy.bit_dominant_errors);
+			put_counter(&payload[4], copy.tx_arbitration_lost);
+			put_counter(&payload[6], copy.tx_errors);
+			return 8;
+
+		case CAN_STATS_PAGE_TRAFFIC:
+			payload[0] = copy.rx_frames >> 24;
+			payload[1] = (copy.rx_frames >> 16) & 0xFF;
+			payload[2] = (copy.rx_frames >> 8) & 0xFF;
+			payload[3] = copy.rx_frames & 0xFF;
+			payload[4] = copy.tx_frames >> 24;
+			payload[5] = (copy.tx_frames >> 16) & 0xFF;
+			payload[6] = (copy.tx_frames >> 8) & 0xFF;
+			payload[7] = copy.tx_frames & 0xFF;
+			return 8;
+
+		default:
+			return 0;
 	}
+}
+
+// Clear the bus counters
+void can_reset_stats(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	memset((void *)&stats, 0, sizeof(stats));
+	__set_PRIMASK(primask);
+}
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Set the filter banks of an address to match extended ids with an 8-bit node id
+static void set_filters(uint8_t address, uint8_t id, bool enable)
+{
+	CAN_FilterTypeDef filter_config = {0};
+	filter_config.FilterMode = CAN_FILTERMODE_IDMASK;
+	filter_config.FilterScale = CAN_FILTERSCALE_32BIT;
+	filter_config.FilterActivation = enable ? CAN_FILTER_ENABLE : CAN_FILTER_DISABLE;
+
+	// control commands, the command number is in bits 31:11 of the filter
+	uint32_t mask = (CONTROL_CMD_MASK << 11) | (0xFF << 3) | (1 << 2);
+	filter_config.FilterIdLow = (id << 3) | (1 << 2);
+	filter_config.FilterMaskIdHigh = mask >> 16;
+	filter_config.FilterMaskIdLow = mask & 0xFFFF;
+	filter_config.FilterFIFOAssignment = CAN_FILTER_FIFO1;
+	filter_config.FilterBank = address;
+	debug_assert(HAL_CAN_ConfigFilter(&hcan, &filter_config) == HAL_OK, "Failed to configure CAN filter");
+
+	// everything else
+	filter_config.FilterMaskIdHigh = 0;
+	filter_config.FilterMaskIdLow = (0xFF << 3) | (1 << 2);
+	filter_config.FilterFIFOAssignment = CAN_FILTER_FIFO0;
+	filter_config.FilterBank = NUM_ADDRESSES + address;
+	debug_assert(HAL_CAN_ConfigFilter(&hcan, &filter_config) == HAL_OK, "Failed to configure CAN filter");
+}
 
-	// copy message from buffer
-	msg->cmd = buffer[buf_read_pos].cmd;
-	msg->id = buffer[buf_read_pos].id;
-	for(size_t i = 0; i < buffer[buf_read_pos].len; i++) msg->payload[i] = buffer[buf_read_pos].payload[i];
-	msg->len = buffer[buf_read_pos].len;
+// Take the oldest message from a ring
+static bool pop_message(volatile msg_ring_t *ring, can_msg_t *msg)
+{
+	HAL_NVIC_DisableIRQ(USB_LP_CAN_RX0_IRQn);
+	HAL_NVIC_DisableIRQ(CAN_RX1_IRQn);
 
-	// increment read position
-	buf_read_pos++;
-	if(buf_read_pos >= CAN_BUF_SIZE) buf_read_pos = 0;
+	bool found = ring->read_pos != ring->write_pos;
+	if(found)
+	{
+		// copy message from buffer
+		volatile can_msg_t *entry = &ring->msgs[ring->read_pos];
+		msg->cmd = entry->cmd;
+		msg->id = entry->id;
+		for(size_t i = 0; i < entry->len; i++) msg->payload[i] = entry->payload[i];
+		msg->len = entry->len;
+		msg->timestamp = entry->timestamp;
+		msg->reliable = entry->reliable;
+		msg->sender = entry->sender;
+		msg->seq = entry->seq;
+
+		// increment read position
+		ring->read_pos++;
+		if(ring->read_pos >= CAN_BUF_SIZE) ring->read_pos = 0;
+	}
 
 	HAL_NVIC_EnableIRQ(USB_LP_CAN_RX0_IRQn);
+	HAL_NVIC_EnableIRQ(CAN_RX1_IRQn);
 
-	// blink status LED on activity
-	HAL_GPIO_WritePin(STATUS_PORT, STATUS_PIN, GPIO_PIN_RESET);
-	HAL_Delay(STATUS_BLINK_TIME);
-	HAL_GPIO_WritePin(STATUS_PORT, STATUS_PIN, GPIO_PIN_SET);
+	return found;
+}
 
-	return true;
+// Add a received message to a ring, dropping the oldest when full
+CCM_FUNC static void queue_message(volatile msg_ring_t *ring, const CAN_RxHeaderTypeDef *header, const uint8_t *payload, uint32_t timestamp)
+{
+	volatile can_msg_t *entry = &ring->msgs[ring->write_pos];
+	entry->id = header->ExtId & 0xFF;
+	entry->cmd = (header->ExtId >> 8) & CAN_CMD_MASK;
+	entry->reliable = header->ExtId & CAN_RELIABLE_FLAG;
+	if(entry->reliable)
+	{
+		entry->sender = (header->ExtId >> CAN_RELIABLE_SENDER_POS) & 0xFF;
+		entry->seq = (header->ExtId >> CAN_RELIABLE_SEQ_POS) & CAN_RELIABLE_SEQ_MASK;
+	}
+	for(size_t i = 0; i < header->DLC; i++) entry->payload[i] = payload[i];
+	entry->len = header->DLC;
+	entry->timestamp = timestamp;
+
+	// increment write position
+	ring->write_pos++;
+	if(ring->write_pos >= CAN_BUF_SIZE) ring->write_pos = 0;
+
+	// bump read position if buffer is full
+	if(ring->read_pos == ring->write_pos)
+	{
+		count(&stats.ring_drops, 1);
+		ring->read_pos++;
+		if(ring->read_pos >= CAN_BUF_SIZE) ring->read_pos = 0;
+	}
+}
+
+
+// Count frames the tx mailboxes gave up on and clear finished requests
+static void collect_tx_status(void)
+{
+	uint32_t tsr = hcan.Instance->TSR;
+
+	// each mailbox has a byte of status bits
+	for(size_t i = 0; i < 3; i++)
+	{
+		uint32_t status = tsr >> (8 * i);
+		if(!(status & CAN_TSR_RQCP0)) continue;
+
+		// without retransmission a lost arbitration or error frame drops the frame
+		if(status & CAN_TSR_ALST0) stats.tx_arbitration_lost++;
+		else if(status & CAN_TSR_TERR0) stats.tx_errors++;
+
+		hcan.Instance->TSR = CAN_TSR_RQCP0 << (8 * i);
+	}
+}
+
+// Leave bus-off, the bxCAN rejoins after 128 x 11 recessive bits
+static void recover_bus_off(void)
+{
+	log_warn("CAN bus-off, recovering after %lu ms", bus_off_delay);
+
+	// entering and leaving init mode starts the recovery
+	hcan.Instance->MCR |= CAN_MCR_INRQ;
+	uint32_t start = HAL_GetTick();
+	while(!(hcan.Instance->MSR & CAN_MSR_INAK) && HAL_GetTick() - start < 2);
+	hcan.Instance->MCR &= ~CAN_MCR_INRQ;
+
+	recover_time = HAL_GetTick();
+	if(bus_off_delay * 2 <= BUS_OFF_DELAY_MAX) bus_off_delay *= 2;
+	bus_off = false;
+}
+
+// Write a counter as 16 bits MSB first, saturating
+static void put_counter(uint8_t *payload, uint32_t value)
+{
+	if(value > 0xFFFF) value = 0xFFFF;
+	payload[0] = value >> 8;
+	payload[1] = value & 0xFF;
+}
+
+// Add to a counter that code at another priority also adds to, the increment isn't atomic
+static void count(volatile uint32_t *counter, uint32_t n)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	*counter += n;
+	__set_PRIMASK(primask);
 }
 
 
@@ -170,8 +596,11 @@ bool can_receive(can_msg_t *msg)
 //------------------------------------------------------------------------------
 
 // CAN FIFO0 receive ISR
-void USB_LP_CAN_RX0_IRQHandler(void)
+CCM_FUNC void USB_LP_CAN_RX0_IRQHandler(void)
 {
+	PROFILE_START(PROFILE_CAN_RX_ISR);
+
+	uint32_t timestamp = clock_cycles();
 	CAN_RxHeaderTypeDef msg_header;
 	uint8_t msg_payload[8];
 
@@ -179,21 +608,20 @@ void USB_LP_CAN_RX0_IRQHandler(void)
 	{
 		if(HAL_CAN_GetRxMessage(&hcan, CAN_RX_FIFO0, &msg_header, msg_payload) == HAL_OK)
 		{
-			buffer[buf_write_pos].cmd = msg_header.ExtId >> 8;
-			buffer[buf_write_pos].id = msg_header.ExtId & 0xFF;
-			for(size_t i = 0; i < msg_header.DLC; i++) buffer[buf_write_pos].payload[i] = msg_payload[i];
-			buffer[buf_write_pos].len = msg_header.DLC;
-
-			// increment write position
-			buf_write_pos++;
-			if(buf_write_pos >= CAN_BUF_SIZE) buf_write_pos = 0;
-
-			// bump read position if buffer is full
-			if(buf_read_pos == buf_write_pos)
-			{
-				buf_read_pos++;
-				if(buf_read_pos >= CAN_BUF_SIZE) buf_read_pos = 0;
-			}
+			// the FIFO1 ISR preempts this one and counts into the same field
+			count(&stats.rx_frames, 1);
+
+#ifdef UPDATE
+
+			// image data skips the buffer, the main loop takes one message per tick
+			if(((msg_header.ExtId >> 8) & CAN_CMD_MASK) != CAN_CMD_UPDATE_DATA) queue_message(&rx_ring, &msg_header, msg_payload, timestamp);
+			else if((msg_header.ExtId & 0xFF) == can_id) update_receive(msg_payload, msg_header.DLC);
+
+#else
+
+			queue_message(&rx_ring, &msg_header, msg_payload, timestamp);
+
+#endif // UPDATE
 		}
 		else
 		{
@@ -202,4 +630,81 @@ void USB_LP_CAN_RX0_IRQHandler(void)
 	}
 
 	HAL_CAN_IRQHandler(&hcan);
+
+	PROFILE_STOP(PROFILE_CAN_RX_ISR);
+}
+
+// CAN FIFO1 receive ISR, control commands
+CCM_FUNC void CAN_RX1_IRQHandler(void)
+{
+	PROFILE_START(PROFILE_CAN_RX1_ISR);
+
+	uint32_t timestamp = clock_cycles();
+	CAN_RxHeaderTypeDef msg_header;
+	uint8_t msg_payload[8];
+
+	if(HAL_CAN_GetRxFifoFillLevel(&hcan, CAN_RX_FIFO1) > 0)
+	{
+		if(HAL_CAN_GetRxMessage(&hcan, CAN_RX_FIFO1, &msg_header, msg_payload) == HAL_OK)
+		{
+			stats.rx_frames++;
+			queue_message(&control_ring, &msg_header, msg_payload, timestamp);
+		}
+	}
+
+	HAL_CAN_IRQHandler(&hcan);
+
+	PROFILE_STOP(PROFILE_CAN_RX1_ISR);
+}
+
+// CAN status change and error ISR
+void CAN_SCE_IRQHandler(void)
+{
+	HAL_CAN_IRQHandler(&hcan);
+}
+
+// A receive FIFO filled up, the next frame overruns it
+void HAL_CAN_RxFifo0FullCallback(CAN_HandleTypeDef *handle)
+{
+	stats.fifo_full++;
+}
+
+void HAL_CAN_RxFifo1FullCallback(CAN_HandleTypeDef *handle)
+{
+	stats.fifo_full++;
+}
+
+// Count errors reported by HAL_CAN_IRQHandler()
+void HAL_CAN_ErrorCallback(CAN_HandleTypeDef *handle)
+{
+	uint32_t error = handle->ErrorCode;
+
+	if(error & HAL_CAN_ERROR_STF) stats.stuff_errors++;
+	if(error & HAL_CAN_ERROR_FOR) stats.form_errors++;
+	if(error & HAL_CAN_ERROR_ACK) stats.ack_errors++;
+	if(error & HAL_CAN_ERROR_BR) stats.bit_recessive_errors++;
+	if(error & HAL_CAN_ERROR_BD) stats.bit_dominant_errors++;
+	if(error & HAL_CAN_ERROR_CRC) stats.crc_errors++;
+
+	// the HAL clears the last error code, keep it as the bxCAN numbers it, 1 stuff to 6 CRC
+	for(uint8_t code = 1; code <= 6; code++)
+	{
+		if(error & (HAL_CAN_ERROR_STF << (code - 1))) stats.last_error = code;
+	}
+
+	if(error & HAL_CAN_ERROR_RX_FOV0) stats.rx_overruns[0]++;
+	if(error & HAL_CAN_ERROR_RX_FOV1) stats.rx_overruns[1]++;
+
+	if((error & HAL_CAN_ERROR_BOF) && !bus_off)
+	{
+		// queued frames would go out whenever the bus comes back, drop them now
+		stats.bus_offs++;
+		count(&stats.tx_dropped, 3 - HAL_CAN_GetTxMailboxesFreeLevel(handle));
+		HAL_CAN_AbortTxRequest(handle, CAN_TX_MAILBOX0 | CAN_TX_MAILBOX1 | CAN_TX_MAILBOX2);
+
+		bus_off_time = HAL_GetTick();
+		bus_off = true;
+	}
+
+	HAL_CAN_ResetError(handle);
 }
@@ -27,16 +27,93 @@ typedef enum {
 	CAN_CMD_TRUTH_TABLE = 3,
 	CAN_CMD_PIN_INTERRUPT = 4,
 	CAN_CMD_RGB_STRIP_1 = 5,
-	CAN_CMD_RGB_STRIP_2 = 6
+	CAN_CMD_RGB_STRIP_2 = 6,
+	CAN_CMD_PROFILE_STATS = 7,
+	CAN_CMD_RGB_STRIP_STATS = 8,
+	CAN_CMD_TRACE = 9,
+	CAN_CMD_LOGIC_CELL = 10,
+	CAN_CMD_INPUT_DEBOUNCE = 11,
+	CAN_CMD_LOGIC_STATS = 12,
+	CAN_CMD_CAPTURE = 13,
+	CAN_CMD_PWM = 14,
+	CAN_CMD_BINDING = 15,
+	CAN_CMD_BOOT_INFO = 16,
+	CAN_CMD_CONFIG_READ = 17,
+	CAN_CMD_CONFIG_WRITE = 18,
+	CAN_CMD_SCENE = 19,
+	CAN_CMD_UPDATE = 20,
+	CAN_CMD_UPDATE_DATA = 21,
+	CAN_CMD_BUS_STATS = 22,
+	CAN_CMD_ACK = 23,
+	CAN_CMD_DISCOVERY = 24,
+	CAN_CMD_RGB_PALETTE = 25,
+	CAN_CMD_RGB_PIXELS = 26,
+	CAN_CMD_SEGMENT = 27
 } can_cmd_t;
 
+// Commands are extended id bits 13:8, bits 27:14 are free for tags
+#define CAN_CMD_MASK			0x3F
+#define CAN_TAG_POS				14
+#define CAN_TAG_MASK			0x3FFF
+
+// Reliable command extended id, see reliable.h
+#define CAN_RELIABLE_FLAG		(1UL << 28)
+#define CAN_RELIABLE_SENDER_POS	20		// bits 27:20
+#define CAN_RELIABLE_SEQ_POS	14		// bits 19:14
+#define CAN_RELIABLE_SEQ_MASK	0x3F
+
+// Node id of a controller waiting to be assigned one
+#define CAN_ID_NONE				0x00
+
+typedef enum {
+	MSG_SOURCE_CAN = 0,
+	MSG_SOURCE_UART = 1
+} msg_source_t;
+
 typedef struct {
 	can_cmd_t cmd;
 	uint8_t id;
 	uint8_t payload[8];
 	uint8_t len;
+	uint32_t timestamp;	// cycle counter when received
+	msg_source_t source;	// where replies go
+	bool reliable;			// sent with a sequence number
+	uint8_t sender;			// reliable sender id
+	uint8_t seq;			// reliable sequence number
 } can_msg_t;
 
+typedef struct {
+	uint32_t rx_frames;			// taken from the FIFOs
+	uint32_t tx_frames;			// queued in a mailbox
+	uint32_t bus_offs;
+	uint32_t tx_dropped;		// no free mailbox in time, or bus-off
+	uint32_t tx_arbitration_lost;
+	uint32_t tx_errors;
+	uint32_t rx_overruns[2];	// frames lost to a full FIFO0, FIFO1
+	uint32_t fifo_full;			// times a FIFO filled up
+	uint32_t ring_drops;		// messages pushed out of a full ring before the main loop took them
+	uint32_t stuff_errors;
+	uint32_t form_errors;
+	uint32_t ack_errors;
+	uint32_t bit_recessive_errors;
+	uint32_t bit_dominant_errors;
+	uint32_t crc_errors;
+	uint8_t last_error;			// CAN_ESR LEC code of the last error
+} can_stats_t;
+
+// Bus Stats pages
+#define CAN_STATS_PAGE_STATE	0
+#define CAN_STATS_PAGE_RECEIVE	1
+#define CAN_STATS_PAGE_ERRORS	2
+#define CAN_STATS_PAGE_TRANSMIT	3
+#define CAN_STATS_PAGE_TRAFFIC	4
+#define CAN_STATS_RESET			0xFF
+
+// Bus state flags
+#define CAN_STATE_WARNING		(1 << 0)	// an error counter is over 96
+#define CAN_STATE_PASSIVE		(1 << 1)	// an error counter is over 127
+#define CAN_STATE_BUS_OFF		(1 << 2)	// waiting to recover
+
 
 //------------------------------------------------------------------------------
 // Public Functions
@@ -44,8 +121,20 @@ typedef struct {
 
 void can_init(void);
 void can_deinit(void);
+uint8_t can_get_id(void);
+void can_set_id(uint8_t id);
+void can_set_groups(const uint8_t *ids, uint8_t count);
+bool can_is_group(uint8_t id);
 void can_send(uint8_t id, can_cmd_t cmd, uint8_t *payload, uint8_t len);
+void can_send_tagged(uint8_t id, can_cmd_t cmd, uint16_t tag, uint8_t *payload, uint8_t len);
+void can_flush(uint32_t timeout);
 bool can_receive(can_msg_t *msg);
+bool can_receive_control(can_msg_t *msg);
+void can_task(void);
+void can_set_heartbeat(uint8_t id, uint16_t interval);
+void can_get_stats(can_stats_t *stats);
+uint8_t can_read_stats_page(uint8_t page, uint8_t *payload);
+void can_reset_stats(void);
 
 
 #endif  // ATLC_CAN_H
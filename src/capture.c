@@ -0,0 +1,249 @@
+//==============================================================================
+// Input Capture Log
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stm32f3xx_hal.h>
+
+#include "can.h"
+#include "capture.h"
+#include "ccm.h"
+#include "command.h"
+#include "config.h"
+#include "debug.h"
+#include "gpio.h"
+
+
+#ifdef CAPTURE
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+#define CAPTURE_DMA_SIZE	256		// samples, interrupts every half buffer
+#define US_PER_SAMPLE		(1000000 / CAPTURE_RATE)
+#define MAX_DELTA			0xFFFFFF	// us, 24-bit delta between changes in a batch
+
+#if 1000000 % CAPTURE_RATE != 0
+#error "CAPTURE_RATE must divide 1 MHz"
+#endif
+
+
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static void log_change(uint32_t sample, uint8_t states);
+static void process_samples(const volatile uint16_t *samples, size_t count);
+
+
+//------------------------------------------------------------------------------
+// Private Variables
+//------------------------------------------------------------------------------
+
+static DMA_HandleTypeDef hdma;
+static TIM_HandleTypeDef htim;
+
+static volatile uint16_t dma_buffer[CAPTURE_DMA_SIZE];	// SRAM, DMA can't reach CCM
+static uint16_t port_pins;
+static volatile bool running;
+
+static capture_entry_t log_buffer[CAPTURE_LOG_SIZE] CCM_BSS;
+static size_t log_write_pos CCM_BSS;
+static size_t log_count CCM_BSS;
+static uint16_t lost CCM_BSS;
+static uint32_t sample_count CCM_BSS;
+static uint16_t last_pins CCM_BSS;
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Initialize sample timer and DMA
+void capture_init(void)
+{
+	// only inputs on IN_PORT are sampled
+	const gpio_pin_t inputs[GPIO_NUM_INPUTS] = GPIO_INPUT_MAP;
+	for(size_t i = 0; i < GPIO_NUM_INPUTS; i++)
+	{
+		if(inputs[i].port == IN_PORT) port_pins |= inputs[i].pin;
+	}
+
+	// APB1 timer clock is twice PCLK1
+	htim.Instance = TIM2;
+	htim.Init.Prescaler = 0;
+	htim.Init.CounterMode = TIM_COUNTERMODE_UP;
+	htim.Init.Period = 2 * HAL_RCC_GetPCLK1Freq() / CAPTURE_RATE - 1;
+	htim.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+	htim.Init.RepetitionCounter = 0;
+	htim.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
+	debug_assert(HAL_TIM_Base_Init(&htim) == HAL_OK, "Failed to configure capture timer");
+
+	hdma.Instance = DMA1_Channel2;
+	hdma.Init.Direction = DMA_PERIPH_TO_MEMORY;
+	hdma.Init.PeriphInc = DMA_PINC_DISABLE;
+	hdma.Init.MemInc = DMA_MINC_ENABLE;
+	hdma.Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+	hdma.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+	hdma.Init.Mode = DMA_CIRCULAR;
+	hdma.Init.Priority = DMA_PRIORITY_LOW;
+	debug_assert(HAL_DMA_Init(&hdma) == HAL_OK, "Failed to configure capture DMA");
+
+	__HAL_LINKDMA(&htim, hdma[TIM_DMA_ID_UPDATE], hdma);
+
+	// below the RGB strips and inputs, half a buffer of samples to catch up
+	HAL_NVIC_SetPriority(DMA1_Channel2_IRQn, 2, 0);
+	HAL_NVIC_EnableIRQ(DMA1_Channel2_IRQn);
+}
+
+// Clear the log and start sampling
+void capture_start(void)
+{
+	capture_stop();
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	log_write_pos = 0;
+	log_count = 0;
+	lost = 0;
+	sample_count = 0;
+
+	// first entry holds the starting states
+	last_pins = IN_PORT->IDR & port_pins;
+	log_change(0, gpio_port_inputs(IN_PORT, last_pins));
+
+	__set_PRIMASK(primask);
+
+	HAL_DMA_Start_IT(&hdma, (uint32_t)&IN_PORT->IDR, (uint32_t)dma_buffer, CAPTURE_DMA_SIZE);
+	__HAL_TIM_ENABLE_DMA(&htim, TIM_DMA_UPDATE);
+	HAL_TIM_Base_Start(&htim);
+	running = true;
+}
+
+// Stop sampling, the log is kept until the next start
+void capture_stop(void)
+{
+	if(!running) return;
+
+	HAL_TIM_Base_Stop(&htim);
+	__HAL_TIM_DISABLE_DMA(&htim, TIM_DMA_UPDATE);
+	HAL_DMA_Abort(&hdma);
+	running = false;
+}
+
+// Reply with up to CAPTURE_BATCH_SIZE logged changes, oldest first
+void capture_read(const can_msg_t *msg)
+{
+	capture_entry_t batch[CAPTURE_BATCH_SIZE];
+	size_t count = 0;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	// a batch ends early if the next change is too far out for a 24-bit delta
+	size_t read_pos = (log_write_pos + CAPTURE_LOG_SIZE - log_count) % CAPTURE_LOG_SIZE;
+	while(count < CAPTURE_BATCH_SIZE && count < log_count)
+	{
+		capture_entry_t *entry = &log_buffer[(read_pos + count) % CAPTURE_LOG_SIZE];
+		if(count > 0 && entry->sample - batch[count - 1].sample > MAX_DELTA / US_PER_SAMPLE) break;
+
+		batch[count++] = *entry;
+	}
+
+	log_count -= count;
+	uint16_t batch_lost = lost;
+	lost = 0;
+
+	__set_PRIMASK(primask);
+
+	// header frame, then two changes per data frame
+	uint32_t timestamp = count ? batch[0].sample * US_PER_SAMPLE : 0;
+	uint8_t header[] = {
+		count, running,
+		batch_lost >> 8, batch_lost & 0xFF,
+		timestamp >> 24, (timestamp >> 16) & 0xFF, (timestamp >> 8) & 0xFF, timestamp & 0xFF
+	};
+	command_reply(msg, CAN_CMD_CAPTURE, header, sizeof(header));
+
+	for(size_t i = 0; i < count; i += 2)
+	{
+		uint8_t payload[8];
+		uint8_t len = 0;
+
+		for(size_t j = i; j < count && j < i + 2; j++)
+		{
+			uint32_t delta = j ? (batch[j].sample - batch[j - 1].sample) * US_PER_SAMPLE : 0;
+			payload[len++] = batch[j].states;
+			payload[len++] = delta >> 16;
+			payload[len++] = (delta >> 8) & 0xFF;
+			payload[len++] = delta & 0xFF;
+		}
+
+		command_reply(msg, CAN_CMD_CAPTURE, payload, len);
+	}
+}
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Add a change to the log, overwriting the oldest one when full
+CCM_FUNC static void log_change(uint32_t sample, uint8_t states)
+{
+	log_buffer[log_write_pos].sample = sample;
+	log_buffer[log_write_pos].states = states;
+
+	log_write_pos++;
+	if(log_write_pos >= CAPTURE_LOG_SIZE) log_write_pos = 0;
+
+	if(log_count < CAPTURE_LOG_SIZE) log_count++;
+	else if(lost < 0xFFFF) lost++;
+}
+
+// Log samples that differ from the one before
+CCM_FUNC static void process_samples(const volatile uint16_t *samples, size_t count)
+{
+	for(size_t i = 0; i < count; i++)
+	{
+		uint16_t pins = samples[i] & port_pins;
+		if(pins == last_pins) continue;
+
+		last_pins = pins;
+		log_change(sample_count + i, gpio_port_inputs(IN_PORT, pins));
+	}
+
+	sample_count += count;
+}
+
+
+//------------------------------------------------------------------------------
+// ISRs
+//------------------------------------------------------------------------------
+
+// Capture DMA Half Complete / Transfer Complete ISR
+CCM_FUNC void DMA1_Channel2_IRQHandler(void)
+{
+	if(__HAL_DMA_GET_FLAG(&hdma, DMA_FLAG_HT2))
+	{
+		// first half filled
+		process_samples(&dma_buffer[0], CAPTURE_DMA_SIZE / 2);
+	}
+	else if(__HAL_DMA_GET_FLAG(&hdma, DMA_FLAG_TC2))
+	{
+		// second half filled
+		process_samples(&dma_buffer[CAPTURE_DMA_SIZE / 2], CAPTURE_DMA_SIZE / 2);
+	}
+
+	HAL_DMA_IRQHandler(&hdma);
+}
+
+#endif // CAPTURE
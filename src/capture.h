@@ -0,0 +1,62 @@
+//==============================================================================
+// Input Capture Log
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_CAPTURE_H
+#define ATLC_CAPTURE_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "can.h"
+#include "config.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	TIM2 update events trigger DMA1 channel 2 to copy IN_PORT->IDR into a
+	circular buffer at CAPTURE_RATE. The DMA half/transfer complete ISR
+	compares each sample with the last one and logs only changes of the
+	mapped inputs on IN_PORT, with the sample time, until the host reads
+	them out.
+*/
+
+// Capture command ops
+#define CAPTURE_OP_STOP		0
+#define CAPTURE_OP_START	1
+#define CAPTURE_OP_READ		2
+
+// Changes per read, two per data frame
+#define CAPTURE_BATCH_SIZE	16
+
+typedef struct
+{
+	uint32_t sample;	// samples since capture start
+	uint8_t states;		// input states from this sample on
+} capture_entry_t;
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+#ifdef CAPTURE
+
+void capture_init(void);
+void capture_start(void);
+void capture_stop(void);
+void capture_read(const can_msg_t *msg);
+
+#endif // CAPTURE
+
+
+#endif // ATLC_CAPTURE_H
@@ -0,0 +1,46 @@
+//==============================================================================
+// CCM SRAM Placement
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stm32f3xx_hal.h>
+
+#include "ccm.h"
+#include "config.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+// section boundaries from the linker script
+extern uint32_t _siccmram;
+extern uint32_t _sccmram;
+extern uint32_t _eccmram;
+extern uint32_t _sccmbss;
+extern uint32_t _eccmbss;
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Copy code and data into CCM SRAM -- must run before any CCM function is called
+void ccm_init(void)
+{
+	uint32_t *src = &_siccmram;
+	uint32_t *dst = &_sccmram;
+
+	// copy code and initialized data from flash
+	while(dst < &_eccmram) *dst++ = *src++;
+
+	// clear zero-initialized data
+	dst = &_sccmbss;
+	while(dst < &_eccmbss) *dst++ = 0;
+}
+
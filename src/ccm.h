@@ -0,0 +1,59 @@
+//==============================================================================
+// CCM SRAM Placement
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_CCM_H
+#define ATLC_CCM_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdint.h>
+
+#include "config.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	CCM_FUNC	run a function from CCM SRAM
+	CCM_DATA	place initialized data in CCM SRAM
+	CCM_BSS		place zero-initialized data in CCM SRAM
+
+	CCM SRAM cannot be reached by DMA, never place DMA buffers in it. Calls
+	between CCM and flash are out of BL range and go through linker veneers.
+
+	Only the placed code itself runs without flash wait states. The vector
+	table stays in flash, and placed ISRs still call HAL handlers that run
+	from flash (HAL_CAN_IRQHandler, HAL_DMA_IRQHandler, ...), so they wait
+	for flash like any other code while it is being written or erased.
+*/
+
+#ifdef CCM_RAM
+
+#define CCM_FUNC	__attribute__((section(".ccmram.text")))
+#define CCM_DATA	__attribute__((section(".ccmram.data")))
+#define CCM_BSS		__attribute__((section(".ccmbss")))
+
+#else
+
+#define CCM_FUNC
+#define CCM_DATA
+#define CCM_BSS
+
+#endif // CCM_RAM
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+void ccm_init(void);
+
+
+#endif // ATLC_CCM_H
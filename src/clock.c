@@ -10,7 +10,19 @@
 #include <stm32f3xx_hal.h>
 
 #include "clock.h"
+#include "config.h"
 #include "debug.h"
+#include "gpio.h"
+#include "logic.h"
+#include "status.h"
+
+
+//------------------------------------------------------------------------------
+// Private Variables
+//------------------------------------------------------------------------------
+
+static uint32_t boot_time;		// us from HAL_Init() to the main loop
+static uint8_t reset_flags;		// RCC_CSR reset flags from the last reset
 
 
 //------------------------------------------------------------------------------
@@ -29,6 +41,10 @@ void clock_init(void)
 		APB1/APB2 Timer clocks are 72 MHz
 	*/
 
+	// keep why we reset, then clear it for next time
+	reset_flags = RCC->CSR >> 24;
+	__HAL_RCC_CLEAR_RESET_FLAGS();
+
 	__HAL_RCC_SYSCFG_CLK_ENABLE();
   	__HAL_RCC_PWR_CLK_ENABLE();
 
@@ -54,7 +70,7 @@ void clock_init(void)
 
 	RCC_PeriphCLKInitTypeDef peripheral_config = {0};
 	peripheral_config.PeriphClockSelection = RCC_PERIPHCLK_UART4;
-	peripheral_config.Uart4ClockSelection = RCC_UART4CLKSOURCE_PCLK1;
+	peripheral_config.Uart4ClockSelection = RCC_UART4CLKSOURCE_SYSCLK;		// 72 MHz for baud rates past 2M
 	debug_assert(HAL_RCCEx_PeriphCLKConfig(&peripheral_config) == HAL_OK, "Failed to config peripheral clocks");
 
 	// enable peripheral clocks
@@ -64,6 +80,9 @@ void clock_init(void)
 	__HAL_RCC_GPIOD_CLK_ENABLE();
 	__HAL_RCC_GPIOF_CLK_ENABLE();
 	__HAL_RCC_DMA1_CLK_ENABLE();
+	__HAL_RCC_DMA2_CLK_ENABLE();
+	__HAL_RCC_TIM1_CLK_ENABLE();
+	__HAL_RCC_TIM2_CLK_ENABLE();
 	__HAL_RCC_TIM16_CLK_ENABLE();
 	__HAL_RCC_TIM17_CLK_ENABLE();
 	__HAL_RCC_UART4_CLK_ENABLE();
@@ -71,6 +90,51 @@ void clock_init(void)
 
 	// set SysTick interrupt priority
 	HAL_NVIC_SetPriority(SysTick_IRQn, 1, 2);
+
+	// start DWT cycle counter
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+// Return microseconds since boot, wraps every ~71 minutes
+uint32_t clock_micros(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	uint32_t ms = HAL_GetTick();
+	uint32_t val = SysTick->VAL;
+
+	// SysTick wrapped but its interrupt has not run yet
+	if(SCB->ICSR & SCB_ICSR_PENDSTSET_Msk)
+	{
+		ms++;
+		val = SysTick->VAL;
+	}
+
+	__set_PRIMASK(primask);
+
+	uint32_t load = SysTick->LOAD + 1;
+	return ms * 1000 + (load - 1 - val) * 1000 / load;
+}
+
+// Record boot time, call when the main loop starts serving commands
+void clock_mark_ready(void)
+{
+	boot_time = clock_micros();
+}
+
+// Return microseconds from HAL_Init() to clock_mark_ready()
+uint32_t clock_get_boot_time(void)
+{
+	return boot_time;
+}
+
+// Return the RCC_CSR reset flags (bits 31:24) of the last reset
+uint8_t clock_get_reset_flags(void)
+{
+	return reset_flags;
 }
 
 
@@ -78,8 +142,16 @@ void clock_init(void)
 // ISRs
 //------------------------------------------------------------------------------
 
-// ISR for system ticks -- used by HAL_Delay()
+// ISR for system ticks -- used by HAL_Delay(), debounce, logic timers and the status LED
 void SysTick_Handler(void)
 {
 	HAL_IncTick();
+	gpio_tick();
+	status_tick();
+
+#ifdef LOGIC
+
+	logic_tick();
+
+#endif // LOGIC
 }
@@ -7,11 +7,39 @@
 #define ATLC_CLOCK_H
 
 
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stm32f3xx_hal.h>
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+// Free-running SYSCLK cycle counter, wraps every ~59 s at 72 MHz
+#define clock_cycles() (DWT->CYCCNT)
+
+// Reset flags, RCC_CSR bits 31:24 shifted down
+#define RESET_FLAG_PIN		(1 << 2)	// NRST pin
+#define RESET_FLAG_POR		(1 << 3)	// power on or brown-out
+#define RESET_FLAG_SOFTWARE	(1 << 4)
+#define RESET_FLAG_IWDG		(1 << 5)
+#define RESET_FLAG_WWDG		(1 << 6)
+#define RESET_FLAG_LOW_POWER	(1 << 7)
+
+
 //------------------------------------------------------------------------------
 // Public Functions
 //------------------------------------------------------------------------------
 
 void clock_init(void);
+uint32_t clock_micros(void);
+void clock_mark_ready(void);
+uint32_t clock_get_boot_time(void);
+uint8_t clock_get_reset_flags(void);
 
 
 #endif	// ATLC_CLOCK_H
@@ -0,0 +1,76 @@
+//==============================================================================
+// COBS Framing
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cobs.h"
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Encode a packet, out must hold COBS_MAX_SIZE(len) bytes, returns the encoded length
+size_t cobs_encode(const uint8_t *data, size_t len, uint8_t *out)
+{
+	size_t code_pos = 0;
+	size_t out_pos = 1;
+	uint8_t code = 1;
+
+	for(size_t i = 0; i < len; i++)
+	{
+		if(data[i] != 0)
+		{
+			out[out_pos++] = data[i];
+			code++;
+		}
+
+		// a zero or a full block ends the block
+		if(data[i] == 0 || code == 0xFF)
+		{
+			out[code_pos] = code;
+			code_pos = out_pos++;
+			code = 1;
+
+			// a full block at the very end needs no trailing empty block
+			if(data[i] != 0 && i == len - 1)
+			{
+				return code_pos;
+			}
+		}
+	}
+
+	out[code_pos] = code;
+	return out_pos;
+}
+
+// Decode a frame without its delimiter, out may be data, returns the packet length or 0 if malformed
+size_t cobs_decode(const uint8_t *data, size_t len, uint8_t *out)
+{
+	size_t in_pos = 0;
+	size_t out_pos = 0;
+
+	while(in_pos < len)
+	{
+		uint8_t code = data[in_pos++];
+		if(code == 0 || in_pos + code - 1 > len) return 0;
+
+		for(uint8_t i = 1; i < code; i++)
+		{
+			if(data[in_pos] == 0) return 0;
+			out[out_pos++] = data[in_pos++];
+		}
+
+		// each block but a full one or the last ends in a zero
+		if(code != 0xFF && in_pos < len) out[out_pos++] = 0;
+	}
+
+	return out_pos;
+}
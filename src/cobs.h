@@ -0,0 +1,40 @@
+//==============================================================================
+// COBS Framing
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_COBS_H
+#define ATLC_COBS_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	Consistent Overhead Byte Stuffing removes every zero from a packet, so a
+	zero byte can delimit frames on a byte stream. Encoding adds one byte,
+	plus one more for each 254 bytes of packet.
+*/
+
+// Largest encoding of a len byte packet
+#define COBS_MAX_SIZE(len)	((len) + (len) / 254 + 1)
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+size_t cobs_encode(const uint8_t *data, size_t len, uint8_t *out);
+size_t cobs_decode(const uint8_t *data, size_t len, uint8_t *out);
+
+
+#endif // ATLC_COBS_H
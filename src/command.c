@@ -0,0 +1,615 @@
+//==============================================================================
+// Command Dispatch
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stm32f3xx_hal.h>
+
+#include "binding.h"
+#include "can.h"
+#include "capture.h"
+#include "clock.h"
+#include "command.h"
+#include "config.h"
+#include "discovery.h"
+#include "gpio.h"
+#include "logic.h"
+#include "profile.h"
+#include "pwm.h"
+#include "reliable.h"
+#include "rgb_strip.h"
+#include "scene.h"
+#include "segment.h"
+#include "store.h"
+#include "trace.h"
+#include "uart.h"
+#include "update.h"
+
+
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static void save_outputs(void);
+
+#ifdef RGB_STRIP
+static void save_strip(uint8_t strip);
+#endif // RGB_STRIP
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Run a command received over CAN or UART
+void command_dispatch(const can_msg_t *msg)
+{
+#ifdef RELIABLE
+
+	// repeats, syncs and commands after a lost one stop here
+	if(msg->reliable && !reliable_accept(msg)) return;
+
+#endif // RELIABLE
+
+	// Read Pins command
+	if(msg->cmd == CAN_CMD_READ_PINS && msg->len == 1)
+	{
+		uint8_t payload[] = {gpio_read_inputs(), gpio_read_outputs()};
+		command_reply(msg, CAN_CMD_READ_PINS, payload, sizeof(payload));
+	}
+
+	// Write Pins command
+	else if(msg->cmd == CAN_CMD_WRITE_PINS && msg->len == 1)
+	{
+		gpio_write_outputs(msg->payload[0]);
+		trace_record(msg->cmd, TRACE_GPIO_WRITE, msg->timestamp);
+		save_outputs();
+	}
+
+	// Write Pin command
+	else if(msg->cmd == CAN_CMD_WRITE_PIN && msg->len == 2)
+	{
+		gpio_write_output(msg->payload[0], msg->payload[1]);
+		trace_record(msg->cmd, TRACE_GPIO_WRITE, msg->timestamp);
+		save_outputs();
+	}
+
+	// Input Debounce command
+	else if(msg->cmd == CAN_CMD_INPUT_DEBOUNCE && msg->len == 2)
+	{
+		gpio_set_debounce(msg->payload[0], msg->payload[1]);
+	}
+
+	// Bus Stats command
+	else if(msg->cmd == CAN_CMD_BUS_STATS && msg->len == 2)
+	{
+		if(msg->payload[1] == CAN_STATS_RESET) can_reset_stats();
+		else
+		{
+			uint8_t payload[8];
+			uint8_t len = can_read_stats_page(msg->payload[1], payload);
+			if(len) command_reply(msg, CAN_CMD_BUS_STATS, payload, len);
+		}
+	}
+
+	// Boot Info command
+	else if(msg->cmd == CAN_CMD_BOOT_INFO && msg->len == 1)
+	{
+		uint32_t boot_time = clock_get_boot_time();
+		uint8_t payload[] = {
+			boot_time >> 24, (boot_time >> 16) & 0xFF, (boot_time >> 8) & 0xFF, boot_time & 0xFF,
+			clock_get_reset_flags()
+		};
+		command_reply(msg, CAN_CMD_BOOT_INFO, payload, sizeof(payload));
+	}
+
+
+#ifdef CONFIG_STORE
+
+	// Config Read command, optional offset into the value
+	else if(msg->cmd == CAN_CMD_CONFIG_READ && (msg->len == 2 || msg->len == 3))
+	{
+		uint8_t value[STORE_VALUE_MAX];
+		uint8_t len = store_get(msg->payload[1], value, sizeof(value));
+		uint8_t offset = msg->len == 3 ? msg->payload[2] : 0;
+
+		uint8_t payload[8] = {msg->payload[1], len};
+		uint8_t count = 0;
+		for(; count < 6 && offset + count < len; count++) payload[2 + count] = value[offset + count];
+		command_reply(msg, CAN_CMD_CONFIG_READ, payload, 2 + count);
+	}
+
+	// Config Write command
+	else if(msg->cmd == CAN_CMD_CONFIG_WRITE && msg->len >= 1)
+	{
+		if(msg->payload[0] == STORE_KEY_RESET)
+		{
+			store_flush();
+			uart_flush();
+			NVIC_SystemReset();
+		}
+
+		store_set(msg->payload[0], &msg->payload[1], msg->len - 1);
+
+		// group filters and the heartbeat change right away
+		if(msg->payload[0] == STORE_KEY_GROUPS) can_set_groups(&msg->payload[1], msg->len - 1);
+		else if(msg->payload[0] == STORE_KEY_HEARTBEAT)
+		{
+			uint16_t interval = msg->len == 4 ? (msg->payload[2] << 8) | msg->payload[3] : 0;
+			can_set_heartbeat(msg->payload[1], interval);
+		}
+	}
+
+#endif // CONFIG_STORE
+
+
+#ifdef SCENES
+
+	// Scene command
+	else if(msg->cmd == CAN_CMD_SCENE && msg->len >= 2)
+	{
+		if(msg->payload[0] == SCENE_OP_RECALL && scene_recall(msg->payload[1], msg->timestamp))
+		{
+			save_outputs();
+
+#ifdef RGB_STRIP
+
+			for(uint8_t i = 0; i < RGB_NUM_STRIPS; i++) save_strip(i);
+
+#endif // RGB_STRIP
+		}
+		else if(msg->payload[0] == SCENE_OP_SAVE)
+		{
+			scene_save(msg->payload[1], msg->len >= 3 ? msg->payload[2] : 0xFF);
+		}
+		else if(msg->payload[0] == SCENE_OP_DELETE)
+		{
+			scene_delete(msg->payload[1]);
+		}
+	}
+
+#endif // SCENES
+
+
+#ifdef UPDATE
+
+	// Update command, not for groups since the host needs replies
+	else if(msg->cmd == CAN_CMD_UPDATE && msg->len >= 2 && !can_is_group(msg->id))
+	{
+		update_command(msg);
+	}
+
+	// Update Data command, only over UART, CAN data is taken by the receive ISR
+	else if(msg->cmd == CAN_CMD_UPDATE_DATA && !can_is_group(msg->id))
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		update_receive(msg->payload, msg->len);
+		__set_PRIMASK(primask);
+	}
+
+#endif // UPDATE
+
+
+#ifdef DISCOVERY
+
+	// Discovery command
+	else if(msg->cmd == CAN_CMD_DISCOVERY && msg->len >= 2)
+	{
+		discovery_command(msg);
+	}
+
+#endif // DISCOVERY
+
+
+#ifdef LOGIC
+
+	// Truth Table command
+	else if(msg->cmd == CAN_CMD_TRUTH_TABLE && msg->len == 4)
+	{
+		logic_set_truth_table(msg->payload[0], msg->payload[1], (msg->payload[2] << 8) | msg->payload[3]);
+	}
+
+	// Logic Cell command
+	else if(msg->cmd == CAN_CMD_LOGIC_CELL && msg->len == 4)
+	{
+		logic_set_cell(msg->payload[0], msg->payload[1], (msg->payload[2] << 8) | msg->payload[3]);
+	}
+
+	// Logic Stats command
+	else if(msg->cmd == CAN_CMD_LOGIC_STATS && msg->len == 2)
+	{
+		if(msg->payload[1] == LOGIC_STATS_RESET) logic_reset_stats();
+		else
+		{
+			logic_stats_t stats;
+			logic_get_stats(&stats);
+
+			uint8_t payload[] = {
+				stats.events >> 24, (stats.events >> 16) & 0xFF, (stats.events >> 8) & 0xFF, stats.events & 0xFF,
+				stats.max_latency >> 24, (stats.max_latency >> 16) & 0xFF, (stats.max_latency >> 8) & 0xFF, stats.max_latency & 0xFF
+			};
+			command_reply(msg, CAN_CMD_LOGIC_STATS, payload, sizeof(payload));
+		}
+	}
+
+#endif // LOGIC
+
+
+#ifdef PIN_INTERRUPT
+
+	// Pin Interrupt command
+	else if(msg->cmd == CAN_CMD_PIN_INTERRUPT && msg->len == 3)
+	{
+		gpio_set_interrupt(msg->payload[0], msg->payload[1], msg->payload[2]);
+	}
+
+#endif // PIN_INTERRUPT
+
+
+#ifdef RGB_STRIP
+
+	// RGB Strip 1 command
+	else if(msg->cmd == CAN_CMD_RGB_STRIP_1 && msg->len == 4)
+	{
+		rgb_strip_trace(0, msg->cmd, msg->timestamp);
+		if(msg->payload[0] == 0) rgb_strip_disable(0);
+		else if(msg->payload[0] == 1) rgb_strip_set_color(0, msg->payload[1], msg->payload[2], msg->payload[3]);
+		else if(msg->payload[0] == 2) rgb_strip_set_rainbow(0);
+		save_strip(0);
+	}
+
+	// RGB Strip 2 command
+	else if(msg->cmd == CAN_CMD_RGB_STRIP_2 && msg->len == 4)
+	{
+		rgb_strip_trace(1, msg->cmd, msg->timestamp);
+		if(msg->payload[0] == 0) rgb_strip_disable(1);
+		else if(msg->payload[0] == 1) rgb_strip_set_color(1, msg->payload[1], msg->payload[2], msg->payload[3]);
+		else if(msg->payload[0] == 2) rgb_strip_set_rainbow(1);
+		save_strip(1);
+	}
+
+	// RGB Strip Stats command
+	else if(msg->cmd == CAN_CMD_RGB_STRIP_STATS && msg->len == 2)
+	{
+		rgb_strip_stats_t stats = {0};
+		rgb_strip_get_stats(msg->payload[1], &stats);
+
+		// counters saturate at 16 bits
+		if(stats.underruns > 0xFFFF) stats.underruns = 0xFFFF;
+		if(stats.retries > 0xFFFF) stats.retries = 0xFFFF;
+
+		uint8_t payload[] = {
+			stats.frames >> 24, (stats.frames >> 16) & 0xFF, (stats.frames >> 8) & 0xFF, stats.frames & 0xFF,
+			stats.underruns >> 8, stats.underruns & 0xFF,
+			stats.retries >> 8, stats.retries & 0xFF
+		};
+		command_reply(msg, CAN_CMD_RGB_STRIP_STATS, payload, sizeof(payload));
+	}
+
+#ifdef PALETTE
+
+	// RGB Palette command, selects the index depth or writes palette entries
+	else if(msg->cmd == CAN_CMD_RGB_PALETTE && msg->len >= 2)
+	{
+		uint8_t strip = msg->payload[0] & ~RGB_STRIP_SHOW;
+		bool show = msg->payload[0] & RGB_STRIP_SHOW;
+
+		if(msg->len == 2)
+		{
+			rgb_strip_trace(strip, msg->cmd, msg->timestamp);
+			if(rgb_strip_set_depth(strip, msg->payload[1])) save_strip(strip);
+		}
+		else
+		{
+			if(show)
+			{
+				rgb_strip_trace(strip, msg->cmd, msg->timestamp);
+			}
+			rgb_strip_set_palette(strip, msg->payload[1], &msg->payload[2], (msg->len - 2) / 3, show);
+		}
+	}
+
+	// RGB Pixels command
+	else if(msg->cmd == CAN_CMD_RGB_PIXELS && msg->len >= 3)
+	{
+		uint8_t strip = msg->payload[0] & ~(RGB_STRIP_SHOW | RGB_PIXELS_ENCODING);
+		uint8_t encoding = msg->payload[0] & RGB_PIXELS_ENCODING;
+		bool show = msg->payload[0] & RGB_STRIP_SHOW;
+
+		if(show)
+		{
+			rgb_strip_trace(strip, msg->cmd, msg->timestamp);
+		}
+
+		if(encoding == RGB_PIXELS_PACKED) rgb_strip_set_pixels(strip, msg->payload[1], &msg->payload[2], msg->len - 2, show);
+		else if(encoding == RGB_PIXELS_RLE) rgb_strip_set_runs(strip, msg->payload[1], &msg->payload[2], msg->len - 2, false, show);
+		else if(encoding == RGB_PIXELS_XOR) rgb_strip_set_runs(strip, msg->payload[1], &msg->payload[2], msg->len - 2, true, show);
+	}
+
+#endif // PALETTE
+
+#ifdef SEGMENTS
+
+	// Segment command, set
+	else if(msg->cmd == CAN_CMD_SEGMENT && msg->len == 8)
+	{
+		segment_t segment = {
+			.start = msg->payload[1],
+			.length = msg->payload[2],
+			.flags = msg->payload[3],
+			.effect = msg->payload[4],
+			.a = msg->payload[5],
+			.b = msg->payload[6],
+			.speed = msg->payload[7]
+		};
+		segment_set(msg->payload[0], &segment);
+	}
+
+	// Segment command, read
+	else if(msg->cmd == CAN_CMD_SEGMENT && msg->len == 2)
+	{
+		segment_t segment;
+		if(segment_get(msg->payload[1], &segment))
+		{
+			uint8_t payload[] = {
+				msg->payload[1], segment.start, segment.length, segment.flags,
+				segment.effect, segment.a, segment.b, segment.speed
+			};
+			command_reply(msg, CAN_CMD_SEGMENT, payload, sizeof(payload));
+		}
+	}
+
+#endif // SEGMENTS
+
+#endif // RGB_STRIP
+
+
+#ifdef CAPTURE
+
+	// Capture command
+	else if(msg->cmd == CAN_CMD_CAPTURE && msg->len == 2)
+	{
+		if(msg->payload[1] == CAPTURE_OP_STOP) capture_stop();
+		else if(msg->payload[1] == CAPTURE_OP_START) capture_start();
+		else if(msg->payload[1] == CAPTURE_OP_READ) capture_read(msg);
+	}
+
+#endif // CAPTURE
+
+
+#ifdef PWM
+
+	// PWM command
+	else if(msg->cmd == CAN_CMD_PWM && msg->len == 6)
+	{
+		pwm_set(msg->payload[0], msg->payload[1], (msg->payload[2] << 8) | msg->payload[3], (msg->payload[4] << 8) | msg->payload[5]);
+	}
+
+#endif // PWM
+
+
+#ifdef BINDINGS
+
+	// Binding command, set
+	else if(msg->cmd == CAN_CMD_BINDING && msg->len == 8)
+	{
+		binding_t binding = {
+			.input = msg->payload[1],
+			.trigger = msg->payload[2],
+			.action = msg->payload[3],
+			.target = msg->payload[4],
+			.red = msg->payload[5],
+			.green = msg->payload[6],
+			.blue = msg->payload[7]
+		};
+		binding_set(msg->payload[0], &binding);
+	}
+
+	// Binding command, read
+	else if(msg->cmd == CAN_CMD_BINDING && msg->len == 2)
+	{
+		binding_t binding;
+		if(binding_get(msg->payload[1], &binding))
+		{
+			uint8_t payload[] = {
+				msg->payload[1], binding.input, binding.trigger, binding.action,
+				binding.target, binding.red, binding.green, binding.blue
+			};
+			command_reply(msg, CAN_CMD_BINDING, payload, sizeof(payload));
+		}
+	}
+
+#endif // BINDINGS
+
+
+#ifdef PROFILE
+
+	// Profile Stats command
+	else if(msg->cmd == CAN_CMD_PROFILE_STATS && msg->len == 3)
+	{
+		if(msg->payload[2] == PROFILE_PAGE_RESET) profile_reset();
+		else if(msg->payload[2] == PROFILE_PAGE_DUMP) profile_dump();
+		else
+		{
+			uint8_t payload[8];
+			uint8_t len = profile_read_page(msg->payload[1], msg->payload[2], payload);
+			if(len) command_reply(msg, CAN_CMD_PROFILE_STATS, payload, len);
+		}
+	}
+
+#endif // PROFILE
+
+
+#ifdef TRACE
+
+	// Trace command
+	else if(msg->cmd == CAN_CMD_TRACE && msg->len == 2)
+	{
+		trace_entry_t entry;
+
+		if(msg->payload[1] == TRACE_INDEX_CLEAR) trace_clear();
+		else if(msg->payload[1] == TRACE_INDEX_DUMP) trace_dump();
+		else if(trace_read(msg->payload[1], &entry))
+		{
+			uint8_t payload[] = {
+				entry.cmd, entry.event, 0, 0,
+				entry.latency >> 24, (entry.latency >> 16) & 0xFF, (entry.latency >> 8) & 0xFF, entry.latency & 0xFF
+			};
+			command_reply(msg, CAN_CMD_TRACE, payload, sizeof(payload));
+		}
+	}
+
+#endif // TRACE
+}
+
+// Reply to the sender of a command, on the transport it came in on
+void command_reply(const can_msg_t *msg, can_cmd_t cmd, uint8_t *payload, uint8_t len)
+{
+	// every node in a group would answer at once
+	if(can_is_group(msg->id)) return;
+
+#ifdef UART_COMMANDS
+
+	if(msg->source == MSG_SOURCE_UART)
+	{
+		uart_send_command(msg->payload[0], cmd, payload, len);
+		return;
+	}
+
+#endif // UART_COMMANDS
+
+	can_send(msg->payload[0], cmd, payload, len);
+}
+
+#ifdef UART_COMMANDS
+
+// Take the next message off a payload longer than CAN carries, false if the command can't be split
+// payload and len are left holding the rest behind a moved on header, its last message shows or completes it
+bool command_split(can_msg_t *msg, uint8_t *payload, uint8_t *len)
+{
+	if(*len <= 8) return false;
+
+	for(size_t i = 0; i < 8; i++) msg->payload[i] = payload[i];
+	msg->len = 8;
+
+	bool split = false;
+
+#ifdef UPDATE
+
+	// Update Data command, one frame per message, frame numbers carry into the block
+	if(msg->cmd == CAN_CMD_UPDATE_DATA)
+	{
+		_Static_assert(UPDATE_FRAME_DATA == 6 && UPDATE_BLOCK_FRAMES == 256, "Update Data is split 6 bytes a frame");
+
+		payload[1]++;
+		if(payload[1] == 0) payload[0]++;
+		split = true;
+	}
+
+#endif // UPDATE
+
+
+#ifdef PALETTE
+
+	// RGB Pixels command, the show flag stays with the last message
+	if(msg->cmd == CAN_CMD_RGB_PIXELS)
+	{
+		uint8_t strip = payload[0] & ~(RGB_STRIP_SHOW | RGB_PIXELS_ENCODING);
+		uint16_t led = payload[1];
+
+		if((payload[0] & RGB_PIXELS_ENCODING) == RGB_PIXELS_PACKED)
+		{
+			uint8_t depth = rgb_strip_get_depth(strip);
+			if(!depth) return false;
+			led += 6 * 8 / depth;
+		}
+		else
+		{
+			for(size_t i = 2; i < 8; i += 2) led += payload[i];
+		}
+
+		msg->payload[0] &= ~RGB_STRIP_SHOW;
+		payload[1] = led > 0xFF ? 0xFF : led;
+		split = true;
+	}
+
+#endif // PALETTE
+
+	if(!split) return false;
+
+	*len -= 6;
+	for(size_t i = 2; i < *len; i++) payload[i] = payload[i + 6];
+	return true;
+}
+
+#endif // UART_COMMANDS
+
+#ifdef CONFIG_STORE
+
+// Replay the last saved output and strip commands
+void command_restore(void)
+{
+	if(!(store_features() & STORE_FEATURE_RESTORE)) return;
+
+	can_msg_t msg = {0};
+	msg.len = store_get(STORE_KEY_OUTPUTS, msg.payload, 1);
+	if(msg.len)
+	{
+		msg.cmd = CAN_CMD_WRITE_PINS;
+		command_dispatch(&msg);
+	}
+
+#ifdef RGB_STRIP
+
+	for(uint8_t strip = 0; strip < RGB_NUM_STRIPS; strip++)
+	{
+		msg.len = store_get(STORE_KEY_STRIP_STATE + strip, msg.payload, 4);
+		if(msg.len != 4) continue;
+
+		msg.cmd = strip ? CAN_CMD_RGB_STRIP_2 : CAN_CMD_RGB_STRIP_1;
+		command_dispatch(&msg);
+	}
+
+#endif // RGB_STRIP
+}
+
+#endif // CONFIG_STORE
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Save output states to restore at boot
+static void save_outputs(void)
+{
+#ifdef CONFIG_STORE
+
+	uint8_t states = gpio_read_outputs();
+	store_set_later(STORE_KEY_OUTPUTS, &states, 1);
+
+#endif // CONFIG_STORE
+}
+
+#ifdef RGB_STRIP
+
+// Save a strip's mode and color to restore at boot
+static void save_strip(uint8_t strip)
+{
+#ifdef CONFIG_STORE
+
+	rgb_strip_setting_t setting;
+	rgb_strip_get(strip, &setting);
+	store_set_later(STORE_KEY_STRIP_STATE + strip, (const uint8_t *)&setting, sizeof(setting));
+
+#endif // CONFIG_STORE
+}
+
+#endif // RGB_STRIP
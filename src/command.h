@@ -0,0 +1,36 @@
+//==============================================================================
+// Command Dispatch
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_COMMAND_H
+#define ATLC_COMMAND_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdint.h>
+
+#include "can.h"
+#include "config.h"
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+void command_dispatch(const can_msg_t *msg);
+void command_reply(const can_msg_t *msg, can_cmd_t cmd, uint8_t *payload, uint8_t len);
+
+#ifdef UART_COMMANDS
+bool command_split(can_msg_t *msg, uint8_t *payload, uint8_t *len);
+#endif // UART_COMMANDS
+
+#ifdef CONFIG_STORE
+void command_restore(void);
+#endif // CONFIG_STORE
+
+
+#endif // ATLC_COMMAND_H
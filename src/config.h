@@ -14,19 +14,85 @@
 // Our 8-bit CAN node id
 #define CAN_ID					0xA3
 
+// Commands to these ids reach many nodes and are never replied to
+#define CAN_BROADCAST_ID		0xFF	// every node
+#define CAN_MAX_GROUPS			4		// group ids set in the config store, up to 5
+
+// Bus Stats heartbeat, the config store can override both
+#define CAN_HEARTBEAT_ID		0x01	// where heartbeats are sent
+#define CAN_HEARTBEAT_INTERVAL	0		// ms, 0 disables
+
 // Status LED blink period
 #define STATUS_BLINK_TIME		50	// ms
 
 // Features
 #define DEBUG
-//#define TRUTH_TABLE
-//#define PIN_INTERRUPT
+#define CCM_RAM				// run hot ISRs and lookup tables from CCM SRAM
+//#define FAST_BOOT			// serve CAN right away, startup blink runs in the background
+//#define LOG_TOKENS		// send log messages as tokens for tools/log_decode.py
+//#define PROFILE			// DWT cycle counter profiling probes
+//#define TRACE				// CAN command latency tracing
+//#define LOGIC				// EXTI-driven truth tables and timer cells
+//#define PIN_INTERRUPT		// CAN events on input edges
+//#define CAPTURE			// DMA sampled input change log
+//#define PWM				// timer PWM dimming and fade ramps on outputs 2-4
+//#define BINDINGS			// local input to output/strip actions
+//#define UART_COMMANDS		// CAN command set over COBS framed UART
+//#define CONFIG_STORE		// settings and last state in flash
+//#define SCENES			// output and strip presets in the config store, needs CONFIG_STORE
+//#define UPDATE			// firmware update over CAN into the other slot, build led-controller-a
+//#define RELIABLE			// sequence numbered commands with batched acks
+//#define DISCOVERY			// UID announce and node id assignment
+//#define PALETTE			// palette indexed strip framebuffers
+//#define SEGMENTS			// effect zones on a canvas across the strips, needs PALETTE
 #define RGB_STRIP
 
+// UART settings
+#define UART_BAUD_RATE			921600
+#define UART_TX_BUF_SIZE		2048	// bytes queued for DMA, power of 2
+#define LOG_LEVEL				LOG_INFO	// LOG_NONE, LOG_ERROR, LOG_WARN, LOG_INFO or LOG_DEBUG
+
 // RGB Strip settings
-#define RGB_WS2812B
+#define RGB_CHIP				RGB_CHIP_WS2812B	// default, the config store can override it
 #define RGB_NUM_STRIPS			2
-#define RGB_NUM_LEDS			36
+#define RGB_NUM_LEDS			36		// default and maximum LEDs per strip
+#define RGB_UNDERRUN_RETRIES	1		// resends of a frame after a late DMA refill, 0 disables
+#define RGB_PALETTE_BITS		8		// largest palette index, 2, 4 or 8 bits per LED
+
+// Segment settings
+#define SEGMENT_MAX				8
+#define SEGMENT_TICK			10		// ms per effect step at speed 1
+
+// Profiling settings
+#define PROFILE_DUMP_INTERVAL	0		// ms, 0 disables periodic UART dumps
+
+// Tracing settings
+#define TRACE_BUF_SIZE			32
+
+// Config store settings
+#define STORE_SAVE_DELAY		2000	// ms without changes before state is written to flash
+#define SCENE_MAX				8		// scene slots, config store keys 8-15
+
+// Reliable command settings
+#define RELIABLE_STREAMS		8		// sender and lane sequences tracked
+#define RELIABLE_ACK_DELAY		5		// ms an ack waits for more commands
+#define RELIABLE_ACK_BATCH		16		// commands that trigger an ack right away
+
+// Update settings
+#define UPDATE_WINDOW			4		// blocks in flight, 1.5K of SRAM each
+
+// Input settings
+#define GPIO_DEBOUNCE_TIME		5		// ms, default lockout after an accepted input edge
+#define PIN_COALESCE_TIME		10		// ms, edges within this time of the first are sent as one event
+#define BINDING_MAX				8
+
+// Capture settings
+#define CAPTURE_RATE			100000	// Hz, must divide 1 MHz
+#define CAPTURE_LOG_SIZE		256		// changes kept until read
+
+// PWM settings
+#define PWM_RESOLUTION			15		// bits, 8-15
+#define PWM_FREQUENCY			1000	// Hz, rounded up to what the resolution allows
 
 
 #endif	// ATLC_CONFIG_H
@@ -0,0 +1,59 @@
+//==============================================================================
+// CRC Functions
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ccm.h"
+#include "crc.h"
+
+
+//------------------------------------------------------------------------------
+// Private Variables
+//------------------------------------------------------------------------------
+
+// CRC of each 4-bit value, two lookups per byte
+static const uint16_t crc16_table[16] CCM_DATA = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+static const uint32_t crc32_table[16] CCM_DATA = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Continue a CRC-16 over more data, start with CRC16_INIT
+CCM_FUNC uint16_t crc16_update(uint16_t crc, const uint8_t *data, size_t len)
+{
+	for(size_t i = 0; i < len; i++)
+	{
+		crc = (crc << 4) ^ crc16_table[(crc >> 12) ^ (data[i] >> 4)];
+		crc = (crc << 4) ^ crc16_table[(crc >> 12) ^ (data[i] & 0x0F)];
+	}
+
+	return crc;
+}
+
+// Continue a CRC-32 over more data, start with CRC32_INIT and xor the result with CRC32_XOROUT
+CCM_FUNC uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+	for(size_t i = 0; i < len; i++)
+	{
+		crc = (crc >> 4) ^ crc32_table[(crc ^ data[i]) & 0x0F];
+		crc = (crc >> 4) ^ crc32_table[(crc ^ (data[i] >> 4)) & 0x0F];
+	}
+
+	return crc;
+}
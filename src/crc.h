@@ -0,0 +1,47 @@
+//==============================================================================
+// CRC Functions
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_CRC_H
+#define ATLC_CRC_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xFFFF, no
+	reflection or final xor. The CRC of "123456789" is 0x29B1.
+*/
+
+#define CRC16_INIT		0xFFFF
+
+/*
+	CRC-32 as used by zlib and Ethernet: reflected polynomial 0xEDB88320,
+	initial value and final xor 0xFFFFFFFF. The CRC of "123456789" is
+	0xCBF43926.
+*/
+
+#define CRC32_INIT		0xFFFFFFFF
+#define CRC32_XOROUT	0xFFFFFFFF
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+uint16_t crc16_update(uint16_t crc, const uint8_t *data, size_t len);
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len);
+
+
+#endif // ATLC_CRC_H
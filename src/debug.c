@@ -7,12 +7,16 @@
 // Includes
 //------------------------------------------------------------------------------
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stm32f3xx_hal.h>
 
 #include "can.h"
 #include "config.h"
 #include "debug.h"
 #include "gpio.h"
+#include "status.h"
+#include "uart.h"
 
 
 //------------------------------------------------------------------------------
@@ -24,6 +28,10 @@ void error_state(void)
 {
 	// deinitialize peripherals
 	can_deinit();
+	status_stop();
+
+	// get the abort message out, the tx interrupt may be masked by our caller
+	uart_flush();
 
 	while(1)
 	{
@@ -33,3 +41,29 @@ void error_state(void)
 		HAL_Delay(STATUS_BLINK_TIME * 4);
 	}
 }
+
+#ifdef LOG_TOKENS
+
+// Send a tokenized log message as a UART_FRAME_LOG frame
+void log_token(uint32_t token, const uint32_t *args, size_t count)
+{
+	// token and arguments as LEB128 varints, small values take one byte
+	uint8_t packet[(LOG_MAX_ARGS + 1) * 5];
+	size_t len = 0;
+
+	if(count > LOG_MAX_ARGS) count = LOG_MAX_ARGS;
+	for(size_t i = 0; i <= count; i++)
+	{
+		uint32_t value = i ? args[i - 1] : token;
+		while(value >= 0x80)
+		{
+			packet[len++] = (value & 0x7F) | 0x80;
+			value >>= 7;
+		}
+		packet[len++] = value;
+	}
+
+	uart_send_frame(UART_FRAME_LOG, packet, len);
+}
+
+#endif // LOG_TOKENS
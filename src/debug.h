@@ -11,6 +11,8 @@
 // Includes
 //------------------------------------------------------------------------------
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "config.h"
@@ -20,22 +22,85 @@
 // Definitions
 //------------------------------------------------------------------------------
 
-#ifdef DEBUG
-
-#define debug_printf(fmt, ...) printf("%s:%d: "fmt"\r\n", __FILE__, __LINE__, ##__VA_ARGS__)
+// Log levels, messages above LOG_LEVEL are compiled out
+#define LOG_NONE	0
+#define LOG_ERROR	1
+#define LOG_WARN	2
+#define LOG_INFO	3
+#define LOG_DEBUG	4
+
+/*
+	With LOG_TOKENS, a log site keeps its level, file, line and format string
+	in the .logstr section, which the linker keeps in the ELF but out of
+	flash. The device only sends the string's offset in .logstr and the raw
+	arguments, and tools/log_decode.py formats them on the host. Arguments
+	are sent as 32-bit integers, so only integer arguments are allowed: a
+	pointer, string or floating point argument is a compile error.
+
+	The log macros can be used from ISRs, uart_write() queues each message
+	with interrupts disabled.
+*/
+
+#define LOG_MAX_ARGS	8
+
+#if defined(DEBUG) && defined(LOG_TOKENS)
+
+#define log_printf(level, fmt, ...) do { \
+	static const char log_entry[] __attribute__((section(".logstr"), used)) = level "\x1F" __FILE__ "\x1F" TO_STR_EXPANDED(__LINE__) "\x1F" fmt; \
+	_Pragma("GCC diagnostic push") \
+	_Pragma("GCC diagnostic error \"-Wint-conversion\"") \
+	_Pragma("GCC diagnostic error \"-Wfloat-conversion\"") \
+	const uint32_t log_args[] = {0, ##__VA_ARGS__}; \
+	_Pragma("GCC diagnostic pop") \
+	log_token((uintptr_t)log_entry, &log_args[1], sizeof(log_args) / sizeof(log_args[0]) - 1); \
+} while(0)
+#define debug_assert(condition, fmt, ...) if(!(condition)) { log_printf("E", fmt" -- aborting!", ##__VA_ARGS__); error_state(); }
+#define debug_abort(fmt, ...) log_printf("E", fmt" -- aborting!", ##__VA_ARGS__); error_state()
+
+#elif defined(DEBUG)
+
+#define log_printf(level, fmt, ...) printf(level" %s:%d: "fmt"\r\n", __FILE__, __LINE__, ##__VA_ARGS__)
 #define debug_assert(condition, fmt, ...) if(!(condition)) { printf("%s:%d: "fmt" -- aborting!\r\n", __FILE__, __LINE__, ##__VA_ARGS__); error_state(); }
 #define debug_abort(fmt, ...) printf("%s:%d: "fmt" -- aborting!\r\n", __FILE__, __LINE__, ##__VA_ARGS__); error_state()
 
 #else
 
-#define debug_printf(fmt, ...)
+#undef LOG_LEVEL
+#define LOG_LEVEL LOG_NONE
 #define debug_assert(condition, fmt, ...) if(!(condition)) { error_state(); }
 #define debug_abort(fmt, ...) error_state()
 
 #endif // DEBUG
 
+#if LOG_LEVEL >= LOG_ERROR
+#define log_error(fmt, ...) log_printf("E", fmt, ##__VA_ARGS__)
+#else
+#define log_error(fmt, ...)
+#endif
+
+#if LOG_LEVEL >= LOG_WARN
+#define log_warn(fmt, ...) log_printf("W", fmt, ##__VA_ARGS__)
+#else
+#define log_warn(fmt, ...)
+#endif
+
+#if LOG_LEVEL >= LOG_INFO
+#define log_info(fmt, ...) log_printf("I", fmt, ##__VA_ARGS__)
+#else
+#define log_info(fmt, ...)
+#endif
+
+#if LOG_LEVEL >= LOG_DEBUG
+#define log_debug(fmt, ...) log_printf("D", fmt, ##__VA_ARGS__)
+#else
+#define log_debug(fmt, ...)
+#endif
+
+#define debug_printf(fmt, ...) log_debug(fmt, ##__VA_ARGS__)
+
 
 #define TO_STR(var) #var
+#define TO_STR_EXPANDED(var) TO_STR(var)
 
 
 //------------------------------------------------------------------------------
@@ -44,5 +109,9 @@
 
 void error_state(void);
 
+#ifdef LOG_TOKENS
+void log_token(uint32_t token, const uint32_t *args, size_t count);
+#endif // LOG_TOKENS
+
 
 #endif	// ATLC_DEBUG_H
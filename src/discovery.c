@@ -0,0 +1,156 @@
+//==============================================================================
+// Node Discovery
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stm32f3xx_hal.h>
+
+#include "can.h"
+#include "config.h"
+#include "crc.h"
+#include "debug.h"
+#include "discovery.h"
+#include "store.h"
+
+
+#ifdef DISCOVERY
+
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static void set_id(uint8_t id);
+static void announce_in(uint32_t delay);
+
+
+//------------------------------------------------------------------------------
+// Private Variables
+//------------------------------------------------------------------------------
+
+static uint32_t uid;
+static uint8_t source = DISCOVERY_SOURCE_DEFAULT;
+static bool announce_pending;
+static uint32_t announce_time;
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Work out our UID and announce it, call after can_init()
+void discovery_init(void)
+{
+	uint32_t words[] = {HAL_GetUIDw0(), HAL_GetUIDw1(), HAL_GetUIDw2()};
+	uid = crc32_update(CRC32_INIT, (const uint8_t *)words, sizeof(words)) ^ CRC32_XOROUT;
+
+#ifdef CONFIG_STORE
+
+	// a controller that gave up its id clears the key, CAN_ID_NONE is never an assignment
+	uint8_t id;
+	if(store_get(STORE_KEY_CAN_ID, &id, 1) && id != CAN_ID_NONE) source = DISCOVERY_SOURCE_ASSIGNED;
+
+#endif // CONFIG_STORE
+
+	// controllers powered up together don't all announce at once
+	announce_in(uid & (DISCOVERY_SPREAD - 1));
+}
+
+// Return our 32-bit UID
+uint32_t discovery_get_uid(void)
+{
+	return uid;
+}
+
+// Run a Discovery command
+void discovery_command(const can_msg_t *msg)
+{
+	uint8_t op = msg->payload[1];
+
+	if(op == DISCOVERY_OP_DISCOVER && msg->len == 2)
+	{
+		announce_in(uid & (DISCOVERY_SPREAD - 1));
+	}
+
+	else if(op == DISCOVERY_OP_ASSIGN && msg->len == 7)
+	{
+		uint32_t target = (msg->payload[2] << 24) | (msg->payload[3] << 16) | (msg->payload[4] << 8) | msg->payload[5];
+		uint8_t id = msg->payload[6];
+		if(target != uid || id == CAN_BROADCAST_ID || can_is_group(id)) return;
+
+		log_info("Assigned CAN id 0x%02X", id);
+		source = DISCOVERY_SOURCE_ASSIGNED;
+		set_id(id);
+
+		// confirms the id, and lets a controller already using it see the conflict
+		announce_in(0);
+	}
+
+	else if(op == DISCOVERY_OP_ANNOUNCE && msg->len == 7)
+	{
+		uint8_t id = msg->payload[0];
+		uint32_t other = (msg->payload[2] << 24) | (msg->payload[3] << 16) | (msg->payload[4] << 8) | msg->payload[5];
+		uint8_t other_source = msg->payload[6];
+		if(id == CAN_ID_NONE || id != can_get_id() || other == uid) return;
+
+		log_warn("CAN id 0x%02X is also used by %08lX", id, other);
+
+		// both controllers come to the same answer
+		bool keep = source > other_source || (source == other_source && uid < other);
+		if(!keep)
+		{
+			source = DISCOVERY_SOURCE_DEFAULT;
+			set_id(CAN_ID_NONE);
+		}
+
+		// the other controller gives up the id when it hears us, or the master sees we need one
+		announce_in(0);
+	}
+}
+
+// Send a due announce, call from the main loop
+void discovery_task(void)
+{
+	if(!announce_pending || (int32_t)(HAL_GetTick() - announce_time) < 0) return;
+
+	announce_pending = false;
+
+	uint8_t payload[] = {
+		can_get_id(), DISCOVERY_OP_ANNOUNCE,
+		uid >> 24, (uid >> 16) & 0xFF, (uid >> 8) & 0xFF, uid & 0xFF,
+		source
+	};
+	can_send_tagged(CAN_BROADCAST_ID, CAN_CMD_DISCOVERY, uid & CAN_TAG_MASK, payload, sizeof(payload));
+}
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Take a node id now and keep it across resets, CAN_ID_NONE goes back to CAN_ID at the next reset
+static void set_id(uint8_t id)
+{
+	can_set_id(id);
+
+#ifdef CONFIG_STORE
+
+	// an empty value clears the key, the pointer still has to be valid for the compare
+	store_set(STORE_KEY_CAN_ID, &id, id == CAN_ID_NONE ? 0 : 1);
+
+#endif // CONFIG_STORE
+}
+
+// Announce after delay ms
+static void announce_in(uint32_t delay)
+{
+	announce_time = HAL_GetTick() + delay;
+	announce_pending = true;
+}
+
+#endif // DISCOVERY
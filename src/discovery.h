@@ -0,0 +1,64 @@
+//==============================================================================
+// Node Discovery
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_DISCOVERY_H
+#define ATLC_DISCOVERY_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdint.h>
+
+#include "can.h"
+#include "config.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	Every controller has a 32-bit UID, the CRC-32 of the chip's 96-bit
+	unique id. It announces its UID and node id to the broadcast id at
+	boot and when asked, and a master assigns node ids by UID. An assigned
+	id is saved as the config store node id.
+
+	Announces are tagged with the low bits of the UID, so announces from
+	several controllers arbitrate on the bus instead of colliding, and are
+	spread over DISCOVERY_SPREAD ms. Every controller hears the others'
+	announces. One that sees its own node id with another UID keeps the
+	id if it was assigned and the other's wasn't, or if its UID is lower.
+	Otherwise it drops to CAN_ID_NONE and announces, for the master to
+	give it a new id.
+*/
+
+#define DISCOVERY_OP_ANNOUNCE	0
+#define DISCOVERY_OP_DISCOVER	1
+#define DISCOVERY_OP_ASSIGN		2
+
+#define DISCOVERY_SPREAD		32		// ms, power of 2
+
+// Where a node id came from
+#define DISCOVERY_SOURCE_DEFAULT	0	// CAN_ID
+#define DISCOVERY_SOURCE_ASSIGNED	1	// config store
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+#ifdef DISCOVERY
+
+void discovery_init(void);
+uint32_t discovery_get_uid(void);
+void discovery_command(const can_msg_t *msg);
+void discovery_task(void);
+
+#endif // DISCOVERY
+
+
+#endif // ATLC_DISCOVERY_H
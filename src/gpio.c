@@ -11,24 +11,29 @@
 #include <stdint.h>
 #include <stm32f3xx_hal.h>
 
+#include "binding.h"
+#include "can.h"
+#include "ccm.h"
+#include "clock.h"
 #include "config.h"
 #include "debug.h"
 #include "gpio.h"
+#include "logic.h"
+#include "profile.h"
 
 
 //------------------------------------------------------------------------------
 // Definitions
 //------------------------------------------------------------------------------
 
-#ifdef TRUTH_TABLE
+#define GPIO_MAX_PORTS	5
 
+// All mapped pins on one port
 typedef struct
 {
-	bool enabled;
-	uint16_t table;
-} truth_table_t;
-
-#endif //TRUTH_TABLE
+	GPIO_TypeDef *port;
+	uint16_t pins;
+} gpio_port_group_t;
 
 
 #ifdef PIN_INTERRUPT
@@ -46,25 +51,53 @@ typedef struct
 {
 	pin_interrupt_mode_t mode;
 	uint8_t can_id;
+	bool pending;			// edges waiting to be sent
+	uint16_t edges;			// matching edges in the burst
+	uint32_t timestamp;		// us, first edge of the burst
+	uint32_t start;			// ms, first edge of the burst
 } pin_interrupt_t;
 
 #endif // PIN_INTERRUPT
 
 
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static uint8_t group_pins(const gpio_pin_t *pins, size_t num_pins, gpio_port_group_t *groups, uint8_t *group_index);
+static IRQn_Type exti_irq(uint16_t pin);
+static void lock_out(size_t input, uint32_t now);
+static void input_event(uint8_t changed, uint32_t timestamp);
+static void exti_process(void);
+
+
 //------------------------------------------------------------------------------
 // Private Variables
 //------------------------------------------------------------------------------
 
-#ifdef TRUTH_TABLE
+static const gpio_pin_t inputs[GPIO_NUM_INPUTS] = GPIO_INPUT_MAP;
+static const gpio_pin_t outputs[GPIO_NUM_OUTPUTS] = GPIO_OUTPUT_MAP;
 
-static truth_table_t out_truth_tables[4] = {0};
+static gpio_port_group_t in_groups[GPIO_MAX_PORTS];
+static gpio_port_group_t out_groups[GPIO_MAX_PORTS];
+static uint8_t num_in_groups;
+static uint8_t num_out_groups;
+static uint8_t in_group_index[GPIO_NUM_INPUTS];
+static uint8_t out_group_index[GPIO_NUM_OUTPUTS];
+static uint8_t owned_outputs[GPIO_NUM_OWNERS];
+static uint8_t reserved_outputs;	// outputs any owner holds
 
-#endif // TRUTH_TABLE
+// debounced inputs
+static uint16_t exti_lines CCM_BSS;
+static volatile uint8_t in_states CCM_BSS;
+static uint8_t lockout CCM_BSS;
+static uint32_t lockout_start[GPIO_NUM_INPUTS] CCM_BSS;
+static uint8_t debounce_time[GPIO_NUM_INPUTS] CCM_BSS;
 
 
 #ifdef PIN_INTERRUPT
 
-static pin_interrupt_t in_interrupts[4] = {0};
+static pin_interrupt_t in_interrupts[GPIO_NUM_INPUTS] CCM_BSS;
 
 #endif // PIN_INTERRUPT
 
@@ -86,19 +119,44 @@ void gpio_init(void)
 	gpio_config.Speed = GPIO_SPEED_FREQ_LOW;
 	HAL_GPIO_Init(STATUS_PORT, &gpio_config);
 
+	// group mapped pins by port
+	num_in_groups = group_pins(inputs, GPIO_NUM_INPUTS, in_groups, in_group_index);
+	num_out_groups = group_pins(outputs, GPIO_NUM_OUTPUTS, out_groups, out_group_index);
+
 	// configure outputs
-	HAL_GPIO_WritePin(OUT_PORT, OUT_PINS, GPIO_PIN_RESET);
-	gpio_config.Pin = OUT_PINS;
-	gpio_config.Mode = GPIO_MODE_OUTPUT_PP;
-	gpio_config.Pull = GPIO_NOPULL;
-	gpio_config.Speed = GPIO_SPEED_FREQ_LOW;
-	HAL_GPIO_Init(OUT_PORT, &gpio_config);
+	for(size_t i = 0; i < num_out_groups; i++)
+	{
+		HAL_GPIO_WritePin(out_groups[i].port, out_groups[i].pins, GPIO_PIN_RESET);
+		gpio_config.Pin = out_groups[i].pins;
+		gpio_config.Mode = GPIO_MODE_OUTPUT_PP;
+		gpio_config.Pull = GPIO_NOPULL;
+		gpio_config.Speed = GPIO_SPEED_FREQ_LOW;
+		HAL_GPIO_Init(out_groups[i].port, &gpio_config);
+	}
+
+	// configure inputs, any edge raises an EXTI interrupt
+	for(size_t i = 0; i < num_in_groups; i++)
+	{
+		gpio_config.Pin = in_groups[i].pins;
+		gpio_config.Mode = GPIO_MODE_IT_RISING_FALLING;
+		gpio_config.Pull = GPIO_PULLDOWN;
+		HAL_GPIO_Init(in_groups[i].port, &gpio_config);
+	}
+
+	for(size_t i = 0; i < GPIO_NUM_INPUTS; i++)
+	{
+		debug_assert(!(exti_lines & inputs[i].pin), "Mapped inputs share an EXTI line");
+		exti_lines |= inputs[i].pin;
+		debounce_time[i] = GPIO_DEBOUNCE_TIME;
+	}
+
+	in_states = gpio_read_inputs();
 
-	// configure inputs
-	gpio_config.Pin = IN_PINS;
-	gpio_config.Mode = GPIO_MODE_INPUT;
-	gpio_config.Pull = GPIO_PULLDOWN;
-	HAL_GPIO_Init(IN_PORT, &gpio_config);
+	for(size_t i = 0; i < GPIO_NUM_INPUTS; i++)
+	{
+		HAL_NVIC_SetPriority(exti_irq(inputs[i].pin), GPIO_EXTI_PRIORITY, GPIO_EXTI_SUBPRIORITY);
+		HAL_NVIC_EnableIRQ(exti_irq(inputs[i].pin));
+	}
 
 	// configure unused pins
 	gpio_config.Mode = GPIO_MODE_ANALOG;
@@ -115,81 +173,380 @@ void gpio_init(void)
 	HAL_GPIO_Init(GPIOF, &gpio_config);
 }
 
-// Return a 4-bit value representing input states
+// Return a bitmask of input states, each port's IDR is read once
 uint8_t gpio_read_inputs(void)
 {
-	return HAL_GPIO_ReadPin(IN_PORT, IN1_PIN)
-		| (HAL_GPIO_ReadPin(IN_PORT, IN2_PIN) << 1)
-		| (HAL_GPIO_ReadPin(IN_PORT, IN3_PIN) << 2)
-		| (HAL_GPIO_ReadPin(IN_PORT, IN4_PIN) << 3);
+	uint32_t idr[GPIO_MAX_PORTS];
+	for(size_t i = 0; i < num_in_groups; i++) idr[i] = in_groups[i].port->IDR;
+
+	uint8_t states = 0;
+	for(size_t i = 0; i < GPIO_NUM_INPUTS; i++)
+	{
+		if(idr[in_group_index[i]] & inputs[i].pin) states |= 1 << i;
+	}
+
+	return states;
 }
 
-// Return a 4-bit value representing output states
+// Return a bitmask of the states of inputs on one port from its IDR value
+CCM_FUNC uint8_t gpio_port_inputs(GPIO_TypeDef *port, uint32_t idr)
+{
+	uint8_t states = 0;
+	for(size_t i = 0; i < GPIO_NUM_INPUTS; i++)
+	{
+		if(inputs[i].port == port && (idr & inputs[i].pin)) states |= 1 << i;
+	}
+
+	return states;
+}
+
+// Return a bitmask of output states, each port's ODR is read once
 uint8_t gpio_read_outputs(void)
 {
-	return HAL_GPIO_ReadPin(OUT_PORT, OUT1_PIN)
-		| (HAL_GPIO_ReadPin(OUT_PORT, OUT2_PIN) << 1)
-		| (HAL_GPIO_ReadPin(OUT_PORT, OUT3_PIN) << 2)
-		| (HAL_GPIO_ReadPin(OUT_PORT, OUT4_PIN) << 3);
+	uint32_t odr[GPIO_MAX_PORTS];
+	for(size_t i = 0; i < num_out_groups; i++) odr[i] = out_groups[i].port->ODR;
+
+	uint8_t states = 0;
+	for(size_t i = 0; i < GPIO_NUM_OUTPUTS; i++)
+	{
+		if(odr[out_group_index[i]] & outputs[i].pin) states |= 1 << i;
+	}
+
+	return states;
 }
 
-// Write a 4-bit value to the outputs
+// Write a bitmask to the outputs, reserved outputs are left alone
 void gpio_write_outputs(uint8_t states)
 {
-	HAL_GPIO_WritePin(OUT_PORT, OUT1_PIN, (states & 0x1) ? GPIO_PIN_SET : GPIO_PIN_RESET);
-	HAL_GPIO_WritePin(OUT_PORT, OUT2_PIN, (states & 0x2) ? GPIO_PIN_SET : GPIO_PIN_RESET);
-	HAL_GPIO_WritePin(OUT_PORT, OUT3_PIN, (states & 0x4) ? GPIO_PIN_SET : GPIO_PIN_RESET);
-	HAL_GPIO_WritePin(OUT_PORT, OUT4_PIN, (states & 0x8) ? GPIO_PIN_SET : GPIO_PIN_RESET);
+	gpio_update_outputs(states, ~reserved_outputs);
 }
 
-// Write a value to an output
+// Write a value to an output, pins are numbered from 1
 void gpio_write_output(uint8_t pin, uint8_t state)
 {
-	if(pin == 1) HAL_GPIO_WritePin(OUT_PORT, OUT1_PIN, state ? GPIO_PIN_SET : GPIO_PIN_RESET);
-	else if(pin == 2) HAL_GPIO_WritePin(OUT_PORT, OUT2_PIN, state ? GPIO_PIN_SET : GPIO_PIN_RESET);
-	else if(pin == 3) HAL_GPIO_WritePin(OUT_PORT, OUT3_PIN, state ? GPIO_PIN_SET : GPIO_PIN_RESET);
-	else if(pin == 4) HAL_GPIO_WritePin(OUT_PORT, OUT4_PIN, state ? GPIO_PIN_SET : GPIO_PIN_RESET);
+	if(pin < 1 || pin > GPIO_NUM_OUTPUTS) return;
+	if(reserved_outputs & (1 << (pin - 1))) return;
+
+	outputs[pin - 1].port->BSRR = state ? outputs[pin - 1].pin : (uint32_t)outputs[pin - 1].pin << 16;
 }
 
+// Write the outputs selected by mask with one BSRR store per port
+CCM_FUNC void gpio_update_outputs(uint8_t states, uint8_t mask)
+{
+	uint32_t bsrr[GPIO_MAX_PORTS] = {0};
 
-#ifdef TRUTH_TABLE
+	// low half of BSRR sets pins, high half resets them
+	for(size_t i = 0; i < GPIO_NUM_OUTPUTS; i++)
+	{
+		if(!(mask & (1 << i))) continue;
+		bsrr[out_group_index[i]] |= (states & (1 << i)) ? outputs[i].pin : (uint32_t)outputs[i].pin << 16;
+	}
+
+	for(size_t i = 0; i < num_out_groups; i++)
+	{
+		if(bsrr[i]) out_groups[i].port->BSRR = bsrr[i];
+	}
+}
 
-// Set truth table function for an output
-void gpio_set_truth_table(uint8_t pin, bool enabled, uint16_t table)
+// Reserve outputs driven locally, host writes to them are ignored until no owner holds them
+void gpio_reserve_outputs(gpio_owner_t owner, uint8_t mask, bool reserved)
 {
-	out_truth_tables[pin - 1].enabled = enabled;
-	out_truth_tables[pin - 1].table = table;
+	if(owner >= GPIO_NUM_OWNERS) return;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	if(reserved) owned_outputs[owner] |= mask;
+	else owned_outputs[owner] &= ~mask;
+
+	uint8_t all = 0;
+	for(size_t i = 0; i < GPIO_NUM_OWNERS; i++) all |= owned_outputs[i];
+	reserved_outputs = all;
+
+	__set_PRIMASK(primask);
+}
+
+// Return a bitmask of outputs reserved for local drivers
+uint8_t gpio_reserved_outputs(void)
+{
+	return reserved_outputs;
+}
+
+// Return a bitmask of debounced input states
+uint8_t gpio_debounced_inputs(void)
+{
+	return in_states;
+}
+
+// Set the debounce time of an input in ms, 0 accepts every edge
+void gpio_set_debounce(uint8_t pin, uint8_t time)
+{
+	if(pin < 1 || pin > GPIO_NUM_INPUTS) return;
+
+	debounce_time[pin - 1] = time;
 }
 
-// Update outputs based on truth tables
-void gpio_process_truth_tables(void)
+// End expired debounce lockouts -- called from SysTick
+void gpio_tick(void)
 {
-	uint8_t in_states = gpio_read_inputs();
-	for(int i = 0; i < 4; i++)
+	if(!lockout) return;
+
+	uint32_t now = HAL_GetTick();
+	uint8_t expired = 0;
+
+	for(size_t i = 0; i < GPIO_NUM_INPUTS; i++)
 	{
-		// todo: fixme
-		if(out_truth_tables[i].enabled) HAL_GPIO_WritePin(OUT_PORT, OUT1_PIN, out_truth_tables[i].table & (1 << in_states) ? GPIO_PIN_SET : GPIO_PIN_RESET);
+		if(!(lockout & (1 << i)) || now - lockout_start[i] < debounce_time[i]) continue;
+
+		expired |= 1 << i;
+		EXTI->PR = inputs[i].pin;
+		EXTI->IMR |= inputs[i].pin;
+	}
+
+	if(!expired) return;
+	lockout &= ~expired;
+
+	// edges from here on raise interrupts, catch changes hidden by the lockout
+	uint8_t changed = (gpio_read_inputs() ^ in_states) & expired;
+	if(!changed) return;
+
+	for(size_t i = 0; i < GPIO_NUM_INPUTS; i++)
+	{
+		if(changed & (1 << i)) lock_out(i, now);
 	}
-}
 
-#endif // TRUTH_TABLE
+	in_states ^= changed;
+	input_event(changed, clock_cycles());
+}
 
 
 #ifdef PIN_INTERRUPT
 
-// Set pin interrupt function for an input
+// Set pin interrupt function for an input, pins are numbered from 1
 void gpio_set_interrupt(uint8_t pin, uint8_t mode, uint8_t can_id)
 {
+	if(pin < 1 || pin > GPIO_NUM_INPUTS) return;
 	if(mode >= NUM_MODES) return;
 
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
 	in_interrupts[pin - 1].mode = mode;
 	in_interrupts[pin - 1].can_id = can_id;
+	in_interrupts[pin - 1].pending = false;
+
+	__set_PRIMASK(primask);
 }
 
-// Send can message based on input state
+// Send one CAN message per burst of edges once its coalesce time has passed
 void gpio_process_interrupts(void)
 {
-	// todo: switch polling to pin change interrupt, otherwise we need to track pin state
+	uint32_t now = HAL_GetTick();
+
+	for(size_t i = 0; i < GPIO_NUM_INPUTS; i++)
+	{
+		pin_interrupt_t *interrupt = &in_interrupts[i];
+		if(!interrupt->pending || now - interrupt->start < PIN_COALESCE_TIME) continue;
+
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+
+		uint8_t can_id = interrupt->can_id;
+		uint16_t edges = interrupt->edges;
+		uint32_t timestamp = interrupt->timestamp;
+		uint8_t state = (in_states >> i) & 1;
+		interrupt->pending = false;
+
+		__set_PRIMASK(primask);
+
+		uint8_t payload[] = {
+			i + 1, state,
+			edges >> 8, edges & 0xFF,
+			timestamp >> 24, (timestamp >> 16) & 0xFF, (timestamp >> 8) & 0xFF, timestamp & 0xFF
+		};
+		can_send(can_id, CAN_CMD_PIN_INTERRUPT, payload, sizeof(payload));
+	}
 }
 
 #endif // PIN_INTERRUPT
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Group mapped pins by port, returns number of groups
+static uint8_t group_pins(const gpio_pin_t *pins, size_t num_pins, gpio_port_group_t *groups, uint8_t *group_index)
+{
+	uint8_t num_groups = 0;
+
+	for(size_t i = 0; i < num_pins; i++)
+	{
+		size_t group = 0;
+		while(group < num_groups && groups[group].port != pins[i].port) group++;
+
+		if(group == num_groups)
+		{
+			debug_assert(num_groups < GPIO_MAX_PORTS, "Too many GPIO ports in pin map");
+			groups[group].port = pins[i].port;
+			groups[group].pins = 0;
+			num_groups++;
+		}
+
+		groups[group].pins |= pins[i].pin;
+		group_index[i] = group;
+	}
+
+	return num_groups;
+}
+
+// Return the EXTI interrupt for a pin
+static IRQn_Type exti_irq(uint16_t pin)
+{
+	if(pin & GPIO_PIN_0) return EXTI0_IRQn;
+	if(pin & GPIO_PIN_1) return EXTI1_IRQn;
+	if(pin & GPIO_PIN_2) return EXTI2_TSC_IRQn;
+	if(pin & GPIO_PIN_3) return EXTI3_IRQn;
+	if(pin & GPIO_PIN_4) return EXTI4_IRQn;
+	if(pin & 0x03E0) return EXTI9_5_IRQn;
+	return EXTI15_10_IRQn;
+}
+
+// Ignore edges on an input until its debounce time has passed
+CCM_FUNC static void lock_out(size_t input, uint32_t now)
+{
+	if(!debounce_time[input]) return;
+
+	lockout |= 1 << input;
+	lockout_start[input] = now;
+	EXTI->IMR &= ~inputs[input].pin;
+}
+
+// Pass debounced input changes on
+CCM_FUNC static void input_event(uint8_t changed, uint32_t timestamp)
+{
+	UNUSED(changed);
+
+#ifdef LOGIC
+
+	logic_evaluate(in_states, timestamp);
+
+#endif // LOGIC
+
+
+#ifdef BINDINGS
+
+	binding_process(in_states, changed, timestamp);
+
+#endif // BINDINGS
+
+
+#ifdef PIN_INTERRUPT
+
+	uint32_t micros = clock_micros();
+
+	for(size_t i = 0; i < GPIO_NUM_INPUTS; i++)
+	{
+		pin_interrupt_t *interrupt = &in_interrupts[i];
+		if(!(changed & (1 << i))) continue;
+
+		bool rising = in_states & (1 << i);
+		if(interrupt->mode == INT_DISABLED) continue;
+		if(interrupt->mode == INT_RISING_EDGE && !rising) continue;
+		if(interrupt->mode == INT_FALLING_EDGE && rising) continue;
+
+		// later edges within the coalesce time join the pending burst
+		if(!interrupt->pending)
+		{
+			interrupt->pending = true;
+			interrupt->edges = 0;
+			interrupt->timestamp = micros;
+			interrupt->start = HAL_GetTick();
+		}
+
+		if(interrupt->edges < 0xFFFF) interrupt->edges++;
+	}
+
+#endif // PIN_INTERRUPT
+}
+
+// Accept edges on inputs that are not locked out
+CCM_FUNC static void exti_process(void)
+{
+	PROFILE_START(PROFILE_EXTI_ISR);
+
+	uint32_t timestamp = clock_cycles();
+
+	uint32_t pending = EXTI->PR & exti_lines;
+	EXTI->PR = pending;
+
+	uint32_t now = HAL_GetTick();
+	uint8_t states = gpio_read_inputs();
+	uint8_t changed = 0;
+
+	for(size_t i = 0; i < GPIO_NUM_INPUTS; i++)
+	{
+		if(!(pending & inputs[i].pin) || (lockout & (1 << i))) continue;
+
+		// an edge that bounced back before the read is not a change
+		if(!((states ^ in_states) & (1 << i))) continue;
+
+		changed |= 1 << i;
+		lock_out(i, now);
+	}
+
+	if(changed)
+	{
+		in_states ^= changed;
+		input_event(changed, timestamp);
+	}
+
+	PROFILE_STOP(PROFILE_EXTI_ISR);
+}
+
+
+//------------------------------------------------------------------------------
+// ISRs
+//------------------------------------------------------------------------------
+
+// EXTI line 0 ISR
+CCM_FUNC void EXTI0_IRQHandler(void)
+{
+	exti_process();
+}
+
+// EXTI line 1 ISR
+CCM_FUNC void EXTI1_IRQHandler(void)
+{
+	exti_process();
+}
+
+// EXTI line 2 ISR
+CCM_FUNC void EXTI2_TSC_IRQHandler(void)
+{
+	exti_process();
+}
+
+// EXTI line 3 ISR
+CCM_FUNC void EXTI3_IRQHandler(void)
+{
+	exti_process();
+}
+
+// EXTI line 4 ISR
+CCM_FUNC void EXTI4_IRQHandler(void)
+{
+	exti_process();
+}
+
+// EXTI lines 5-9 ISR
+CCM_FUNC void EXTI9_5_IRQHandler(void)
+{
+	exti_process();
+}
+
+// EXTI lines 10-15 ISR
+CCM_FUNC void EXTI15_10_IRQHandler(void)
+{
+	exti_process();
+}
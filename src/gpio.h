@@ -37,6 +37,15 @@
 	- PA3: Input 4
 
 	All unused pins set to analog to reduce power consumption.
+
+	Inputs and outputs are accessed through the pin maps below, bit n of a pin
+	state byte is entry n of the map. Boards with spare pins can map up to 8
+	inputs and 8 outputs on any ports (remove them from the unused pins).
+	Outputs on the same port are written together with one BSRR store.
+
+	Input edges raise EXTI interrupts, so mapped inputs need distinct pin
+	numbers. An accepted edge locks its input out for the debounce time, any
+	change hidden by the lockout is picked up when it ends.
 */
 
 #define STATUS_PORT		GPIOC
@@ -62,6 +71,34 @@
 #define UNUSED_PORTD	GPIO_PIN_2
 #define UNUSED_PORTF	GPIO_PIN_0 | GPIO_PIN_1
 
+#define GPIO_NUM_INPUTS		4
+#define GPIO_INPUT_MAP		{{IN_PORT, IN1_PIN}, {IN_PORT, IN2_PIN}, {IN_PORT, IN3_PIN}, {IN_PORT, IN4_PIN}}
+
+#define GPIO_NUM_OUTPUTS	4
+#define GPIO_OUTPUT_MAP		{{OUT_PORT, OUT1_PIN}, {OUT_PORT, OUT2_PIN}, {OUT_PORT, OUT3_PIN}, {OUT_PORT, OUT4_PIN}}
+
+#if GPIO_NUM_INPUTS > 8 || GPIO_NUM_OUTPUTS > 8
+#error "Pin states are sent as one byte, at most 8 inputs and 8 outputs can be mapped"
+#endif
+
+typedef struct
+{
+	GPIO_TypeDef *port;
+	uint16_t pin;
+} gpio_pin_t;
+
+// Local drivers that take outputs away from the host, each keeps its own reservations
+typedef enum
+{
+	GPIO_OWNER_LOGIC,
+	GPIO_OWNER_PWM,
+	GPIO_NUM_OWNERS
+} gpio_owner_t;
+
+// EXTI interrupt priority, shared with SysTick so input events and timers never preempt each other
+#define GPIO_EXTI_PRIORITY		1
+#define GPIO_EXTI_SUBPRIORITY	0
+
 
 //------------------------------------------------------------------------------
 // Public Functions
@@ -69,17 +106,16 @@
 
 void gpio_init(void);
 uint8_t gpio_read_inputs(void);
+uint8_t gpio_port_inputs(GPIO_TypeDef *port, uint32_t idr);
 uint8_t gpio_read_outputs(void);
 void gpio_write_outputs(uint8_t states);
 void gpio_write_output(uint8_t pin, uint8_t state);
-
-
-#ifdef TRUTH_TABLE
-
-void gpio_set_truth_table(uint8_t pin, bool enabled, uint16_t table);
-void gpio_process_truth_tables(void);
-
-#endif // TRUTH_TABLE
+void gpio_update_outputs(uint8_t states, uint8_t mask);
+void gpio_reserve_outputs(gpio_owner_t owner, uint8_t mask, bool reserved);
+uint8_t gpio_reserved_outputs(void);
+uint8_t gpio_debounced_inputs(void);
+void gpio_set_debounce(uint8_t pin, uint8_t time);
+void gpio_tick(void);
 
 
 #ifdef PIN_INTERRUPT
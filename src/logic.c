@@ -0,0 +1,224 @@
+//==============================================================================
+// Local Logic Engine
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stm32f3xx_hal.h>
+
+#include "ccm.h"
+#include "clock.h"
+#include "config.h"
+#include "gpio.h"
+#include "logic.h"
+
+
+#ifdef LOGIC
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+typedef struct
+{
+	bool enabled;
+	uint16_t table;
+	logic_cell_t cell;
+	uint16_t time;			// ms
+	bool result;			// last truth table result
+	bool timer;				// cell timer running
+	uint32_t timer_start;
+} logic_output_t;
+
+
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static void reset_output(uint8_t index);
+
+
+//------------------------------------------------------------------------------
+// Private Variables
+//------------------------------------------------------------------------------
+
+static logic_output_t outputs[GPIO_NUM_OUTPUTS] CCM_BSS;
+static uint8_t out_states CCM_BSS;
+static logic_stats_t stats CCM_BSS;
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Set truth table function for an output, pins are numbered from 1
+void logic_set_truth_table(uint8_t pin, bool enabled, uint16_t table)
+{
+	if(pin < 1 || pin > GPIO_NUM_OUTPUTS) return;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	outputs[pin - 1].enabled = enabled;
+	outputs[pin - 1].table = table;
+	gpio_reserve_outputs(GPIO_OWNER_LOGIC, 1 << (pin - 1), enabled);
+	reset_output(pin - 1);
+
+	__set_PRIMASK(primask);
+}
+
+// Set the cell between an output's truth table and pin, time is in ms
+void logic_set_cell(uint8_t pin, uint8_t cell, uint16_t time)
+{
+	if(pin < 1 || pin > GPIO_NUM_OUTPUTS) return;
+	if(cell >= LOGIC_NUM_CELLS) return;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	outputs[pin - 1].cell = cell;
+	outputs[pin - 1].time = time;
+	reset_output(pin - 1);
+
+	__set_PRIMASK(primask);
+}
+
+// Evaluate truth tables for new input states -- called from the EXTI ISR
+CCM_FUNC void logic_evaluate(uint8_t inputs, uint32_t timestamp)
+{
+	uint32_t now = HAL_GetTick();
+	uint8_t mask = 0;
+
+	for(size_t i = 0; i < GPIO_NUM_OUTPUTS; i++)
+	{
+		logic_output_t *out = &outputs[i];
+		if(!out->enabled) continue;
+
+		bool result = (out->table >> (inputs & 0xF)) & 1;
+		bool edge = result != out->result;
+		out->result = result;
+
+		switch(out->cell)
+		{
+			case LOGIC_CELL_DIRECT:
+				mask |= 1 << i;
+				if(result) out_states |= 1 << i;
+				else out_states &= ~(1 << i);
+				break;
+
+			case LOGIC_CELL_DELAY:
+				// restart on every change, the output only follows a stable result
+				if(edge)
+				{
+					out->timer = true;
+					out->timer_start = now;
+				}
+				break;
+
+			case LOGIC_CELL_HOLD:
+				if(result)
+				{
+					mask |= 1 << i;
+					out_states |= 1 << i;
+					out->timer = false;
+				}
+				else if(edge)
+				{
+					out->timer = true;
+					out->timer_start = now;
+				}
+				break;
+
+			case LOGIC_CELL_TOGGLE:
+				if(edge && result)
+				{
+					mask |= 1 << i;
+					out_states ^= 1 << i;
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	if(!mask) return;
+
+	gpio_update_outputs(out_states, mask);
+
+	uint32_t latency = clock_cycles() - timestamp;
+	stats.events++;
+	if(latency > stats.max_latency) stats.max_latency = latency;
+}
+
+// Expire delay and hold timers -- called from SysTick
+void logic_tick(void)
+{
+	uint32_t now = HAL_GetTick();
+	uint8_t mask = 0;
+
+	for(size_t i = 0; i < GPIO_NUM_OUTPUTS; i++)
+	{
+		logic_output_t *out = &outputs[i];
+		if(!out->enabled || !out->timer || now - out->timer_start < out->time) continue;
+
+		// a hold timer only runs while the result is clear
+		out->timer = false;
+		mask |= 1 << i;
+		if(out->result) out_states |= 1 << i;
+		else out_states &= ~(1 << i);
+	}
+
+	if(mask) gpio_update_outputs(out_states, mask);
+}
+
+// Get input to output latency stats
+void logic_get_stats(logic_stats_t *stats_out)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	*stats_out = stats;
+	__set_PRIMASK(primask);
+}
+
+// Reset input to output latency stats
+void logic_reset_stats(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	stats.events = 0;
+	stats.max_latency = 0;
+	__set_PRIMASK(primask);
+}
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Apply an output's truth table to the current inputs without delay -- call with interrupts disabled
+static void reset_output(uint8_t index)
+{
+	logic_output_t *out = &outputs[index];
+
+	out->timer = false;
+	out->result = (out->table >> (gpio_debounced_inputs() & 0xF)) & 1;
+
+	if(!out->enabled) return;
+
+	// toggle cells keep the current pin state until the next rising edge
+	bool state = out->result;
+	if(out->cell == LOGIC_CELL_TOGGLE) state = gpio_read_outputs() & (1 << index);
+
+	if(state) out_states |= 1 << index;
+	else out_states &= ~(1 << index);
+
+	gpio_update_outputs(out_states, 1 << index);
+}
+
+#endif // LOGIC
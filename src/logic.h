@@ -0,0 +1,72 @@
+//==============================================================================
+// Local Logic Engine
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_LOGIC_H
+#define ATLC_LOGIC_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	Each output can follow a 16-bit truth table of inputs 1-4. Tables are
+	evaluated from the input EXTI interrupt, so outputs react to a debounced
+	edge without waiting for the main loop or a CAN master.
+
+	The table result drives the output through a cell:
+	- Direct: output follows the result
+	- Delay: output follows the result once it has been stable for the cell time
+	- Hold: output turns on with the result and stays on for the cell time after it clears
+	- Toggle: output toggles on each rising edge of the result
+*/
+
+typedef enum
+{
+	LOGIC_CELL_DIRECT = 0,
+	LOGIC_CELL_DELAY = 1,
+	LOGIC_CELL_HOLD = 2,
+	LOGIC_CELL_TOGGLE = 3,
+	LOGIC_NUM_CELLS
+} logic_cell_t;
+
+typedef struct
+{
+	uint32_t events;		// input events that drove an output
+	uint32_t max_latency;	// worst-case cycles from EXTI entry to output write
+} logic_stats_t;
+
+// Logic stats command ops
+#define LOGIC_STATS_READ	0
+#define LOGIC_STATS_RESET	0xFF
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+#ifdef LOGIC
+
+void logic_set_truth_table(uint8_t pin, bool enabled, uint16_t table);
+void logic_set_cell(uint8_t pin, uint8_t cell, uint16_t time);
+void logic_evaluate(uint8_t inputs, uint32_t timestamp);
+void logic_tick(void);
+void logic_get_stats(logic_stats_t *stats);
+void logic_reset_stats(void);
+
+#endif // LOGIC
+
+
+#endif // ATLC_LOGIC_H
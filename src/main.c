@@ -7,16 +7,31 @@
 // Includes
 //------------------------------------------------------------------------------
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stm32f3xx_hal.h>
 
+#include "binding.h"
 #include "can.h"
+#include "capture.h"
+#include "ccm.h"
 #include "clock.h"
+#include "command.h"
 #include "config.h"
 #include "debug.h"
+#include "discovery.h"
 #include "gpio.h"
+#include "profile.h"
+#include "pwm.h"
+#include "reliable.h"
 #include "rgb_strip.h"
+#include "segment.h"
+#include "slot.h"
+#include "status.h"
+#include "store.h"
+#include "trace.h"
 #include "uart.h"
+#include "update.h"
 #include "version.h"
 
 
@@ -26,22 +41,52 @@
 
 int main(void)
 {
+	// the bootloader may have started us from a slot, and SystemInit() points VTOR at the start of flash
+	SCB->VTOR = (uint32_t)g_pfnVectors;
+
+	// load CCM code and data before any interrupt can reach it
+	ccm_init();
+
 	HAL_Init();
 
 	// init peripherals
 	clock_init();
 	gpio_init();
 	uart_init();
+
+#ifdef CONFIG_STORE
+
+	// settings are needed by can_init() and rgb_strip_init()
+	store_init();
+
+#endif // CONFIG_STORE
+
 	can_init();
 
+#ifdef DISCOVERY
+
+	discovery_init();
+
+#endif // DISCOVERY
+
 	/*
-		Interrupt priorities:
+		Interrupt priorities, HAL_Init() selects NVIC_PRIORITYGROUP_4 so Sub
+		is ignored and pending interrupts of equal preempt priority are
+		taken in IRQ number order:
 
 								Preempt		Sub
 		DMA1_Channel1_IRQn		0			0
 		DMA1_Channel3_IRQn		0			0
-		USB_LP_CAN_RX0_IRQn		0			1
+		DMA1_Channel2_IRQn		2			0
+		DMA1_Channel5_IRQn		2			1
+		CAN_RX1_IRQn			0			0
+		USB_LP_CAN_RX0_IRQn		1			0
+		EXTIx_IRQn				1			0
 		SysTick_IRQn			1			2
+		DMA2_Channel5_IRQn		3			0
+		DMA2_Channel3_IRQn		3			0
+		UART4_IRQn				3			0
+		CAN_SCE_IRQn			3			1
 	*/
 
 #ifdef RGB_STRIP
@@ -53,6 +98,36 @@ int main(void)
 #endif // RGB_STRIP
 
 
+#ifdef CAPTURE
+
+	capture_init();
+
+#endif // CAPTURE
+
+
+#ifdef PWM
+
+	pwm_init();
+
+#endif // PWM
+
+
+#ifdef CONFIG_STORE
+
+	// bring outputs and strips back to where they were before a reset
+	command_restore();
+
+#endif // CONFIG_STORE
+
+
+#ifdef FAST_BOOT
+
+	// blink while the main loop is already serving commands
+	clock_mark_ready();
+	status_blink(5, STATUS_BLINK_TIME * 2);
+
+#else
+
 	// startup blink
 	for(int i = 0; i < 5; i++) {
 		HAL_GPIO_WritePin(STATUS_PORT, STATUS_PIN, GPIO_PIN_RESET);
@@ -61,85 +136,107 @@ int main(void)
 		HAL_Delay(STATUS_BLINK_TIME * 2);
 	}
 
+	clock_mark_ready();
+
+#endif // FAST_BOOT
+
 	// print firmware string
 	printf("%s\r\nFirmware Version %d.%d.%d\r\n\r\n", FW_NAME, VER_MAJOR, VER_MINOR, VER_PATCH);
+	log_info("Ready in %lu us, reset flags 0x%02X", clock_get_boot_time(), clock_get_reset_flags());
 
 	can_msg_t msg;
 
 	while(1)
 	{
-		if(can_receive(&msg))
+		PROFILE_START(PROFILE_MAIN_LOOP);
+
+		// control commands are all handled every pass, other messages one at a time
+		while(can_receive_control(&msg))
 		{
-			// Read Pins command
-			if(msg.cmd == CAN_CMD_READ_PINS && msg.len == 1)
-			{
-				uint8_t payload[] = {gpio_read_inputs(), gpio_read_outputs()};
-				can_send(msg.payload[0], CAN_CMD_READ_PINS, payload, sizeof(payload));
-			}
+			PROFILE_START(PROFILE_COMMAND);
+			command_dispatch(&msg);
+			PROFILE_STOP(PROFILE_COMMAND);
+		}
 
-			// Write Pins command
-			else if(msg.cmd == CAN_CMD_WRITE_PINS && msg.len == 1)
-			{
-				gpio_write_outputs(msg.payload[0]);
-			}
+		PROFILE_START(PROFILE_CAN_RECEIVE);
+		bool received = can_receive(&msg);
+		PROFILE_STOP(PROFILE_CAN_RECEIVE);
 
-			// Write Pin command
-			else if(msg.cmd == CAN_CMD_WRITE_PIN && msg.len == 2)
-			{
-				gpio_write_output(msg.payload[0], msg.payload[1]);
-			}
+		if(received)
+		{
+			PROFILE_START(PROFILE_COMMAND);
+			command_dispatch(&msg);
+			PROFILE_STOP(PROFILE_COMMAND);
+		}
 
+#ifdef UART_COMMANDS
+
+		if(uart_receive(&msg))
+		{
+			PROFILE_START(PROFILE_COMMAND);
+			command_dispatch(&msg);
+			PROFILE_STOP(PROFILE_COMMAND);
+		}
 
-#ifdef TRUTH_TABLE
+#endif // UART_COMMANDS
 
-			// Truth Table command
-			else if(msg.cmd == CAN_CMD_TRUTH_TABLE && msg.len == 4)
-			{
-				gpio_set_truth_table(msg.payload[0], msg.payload[1], (msg.payload[2] << 8) | msg.payload[3]);
-			}
+		can_task();
 
-#endif // TRUTH_TABLE
+#ifdef RELIABLE
 
+		reliable_task();
+
+#endif // RELIABLE
+
+#ifdef DISCOVERY
+
+		discovery_task();
+
+#endif // DISCOVERY
 
 #ifdef PIN_INTERRUPT
 
-			// Pin Interrupt command
-			else if(msg.cmd == CAN_CMD_PIN_INTERRUPT && msg.len == 3)
-			{
-				gpio_set_pin_interrupt(msg.payload[0], msg.payload[1], msg.payload[2]);
-			}
+		gpio_process_interrupts();
 
 #endif // PIN_INTERRUPT
 
+#ifdef BINDINGS
+
+		binding_task();
+
+#endif // BINDINGS
 
 #ifdef RGB_STRIP
 
-			// RGB Strip 1 command
-			else if(msg.cmd == CAN_CMD_RGB_STRIP_1 && msg.len == 4)
-			{
-				if(msg.payload[0] == 0) rgb_strip_disable(0);
-				else if(msg.payload[0] == 1) rgb_strip_set_color(0, msg.payload[1], msg.payload[2], msg.payload[3]);
-				else if(msg.payload[0] == 2) rgb_strip_set_rainbow(0);
-			}
-
-			// RGB Strip 2 command
-			else if(msg.cmd == CAN_CMD_RGB_STRIP_2 && msg.len == 4)
-			{
-				if(msg.payload[0] == 0) rgb_strip_disable(1);
-				else if(msg.payload[0] == 1) rgb_strip_set_color(1, msg.payload[1], msg.payload[2], msg.payload[3]);
-				else if(msg.payload[0] == 2) rgb_strip_set_rainbow(1);
-			}
+		rgb_strip_task();
 
 #endif // RGB_STRIP
 
+#ifdef SEGMENTS
 
-		}
+		segment_task();
 
-#ifdef RGB_STRIP
+#endif // SEGMENTS
 
-		rgb_strip_task();
+#ifdef CONFIG_STORE
 
-#endif // RGB_STRIP
+		store_task();
+
+#endif // CONFIG_STORE
+
+#ifdef UPDATE
+
+		update_task();
+
+#endif // UPDATE
+
+#ifdef PROFILE
+
+		profile_task();
+
+#endif // PROFILE
+
+		PROFILE_STOP(PROFILE_MAIN_LOOP);
 
 		HAL_Delay(1);
 	}
@@ -0,0 +1,175 @@
+//==============================================================================
+// Cycle Counter Profiling
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stm32f3xx_hal.h>
+
+#include "ccm.h"
+#include "clock.h"
+#include "config.h"
+#include "debug.h"
+#include "profile.h"
+
+
+#ifdef PROFILE
+
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static void put_u32(uint8_t *dst, uint32_t value);
+
+
+//------------------------------------------------------------------------------
+// Private Variables
+//------------------------------------------------------------------------------
+
+static const char *probe_names[PROFILE_NUM_PROBES] = {
+	TO_STR(USB_LP_CAN_RX0_IRQHandler),
+	TO_STR(DMA1_Channel3_IRQHandler),
+	TO_STR(DMA1_Channel1_IRQHandler),
+	TO_STR(load_next_led),
+	TO_STR(rgb_strip_task),
+	TO_STR(can_receive),
+	TO_STR(command),
+	TO_STR(main_loop),
+	TO_STR(exti_process),
+	TO_STR(CAN_RX1_IRQHandler),
+	TO_STR(segment_render)
+};
+
+static volatile profile_stats_t stats[PROFILE_NUM_PROBES] CCM_BSS;
+
+#if PROFILE_DUMP_INTERVAL > 0
+static uint32_t last_dump;
+#endif // PROFILE_DUMP_INTERVAL
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Record one measurement for a probe -- each probe must only be recorded from one context
+CCM_FUNC void profile_record(profile_probe_t probe, uint32_t cycles)
+{
+	if(probe >= PROFILE_NUM_PROBES) return;
+
+	if(stats[probe].count == 0 || cycles < stats[probe].min) stats[probe].min = cycles;
+	if(cycles > stats[probe].max) stats[probe].max = cycles;
+	stats[probe].count++;
+	stats[probe].total += cycles;
+
+	uint32_t bucket = 0;
+	while(bucket < PROFILE_HIST_BUCKETS - 1 && cycles >= (64UL << (2 * bucket))) bucket++;
+	stats[probe].hist[bucket]++;
+}
+
+// Take a consistent copy of a probe's stats
+void profile_get(profile_probe_t probe, profile_stats_t *copy)
+{
+	if(probe >= PROFILE_NUM_PROBES) return;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	memcpy(copy, (const void *)&stats[probe], sizeof(profile_stats_t));
+	__set_PRIMASK(primask);
+}
+
+// Clear all probes
+void profile_reset(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	memset((void *)stats, 0, sizeof(stats));
+	__set_PRIMASK(primask);
+}
+
+// Fill a profile stats reply payload, returns payload length
+uint8_t profile_read_page(uint8_t probe, uint8_t page, uint8_t *payload)
+{
+	if(probe >= PROFILE_NUM_PROBES) return 0;
+
+	profile_stats_t copy;
+	profile_get(probe, &copy);
+
+	if(page == PROFILE_PAGE_COUNT_MEAN)
+	{
+		put_u32(&payload[0], copy.count);
+		put_u32(&payload[4], copy.count ? (uint32_t)(copy.total / copy.count) : 0);
+		return 8;
+	}
+	else if(page == PROFILE_PAGE_MIN_MAX)
+	{
+		put_u32(&payload[0], copy.min);
+		put_u32(&payload[4], copy.max);
+		return 8;
+	}
+	else if(page == PROFILE_PAGE_HIST_LOW || page == PROFILE_PAGE_HIST_HIGH)
+	{
+		// bucket counts saturate at 16 bits
+		for(size_t i = 0; i < 4; i++)
+		{
+			uint32_t count = copy.hist[(page == PROFILE_PAGE_HIST_HIGH ? 4 : 0) + i];
+			if(count > 0xFFFF) count = 0xFFFF;
+			payload[i * 2 + 0] = count >> 8;
+			payload[i * 2 + 1] = count & 0xFF;
+		}
+		return 8;
+	}
+
+	return 0;
+}
+
+// Print all probes over UART
+void profile_dump(void)
+{
+	printf("probe                      count       min       max      mean   <64  <256   <1K   <4K  <16K  <64K <256K  more\r\n");
+
+	for(size_t i = 0; i < PROFILE_NUM_PROBES; i++)
+	{
+		profile_stats_t copy;
+		profile_get(i, &copy);
+
+		printf("%-25s %6lu %9lu %9lu %9lu", probe_names[i], copy.count, copy.min, copy.max,
+			copy.count ? (uint32_t)(copy.total / copy.count) : 0);
+		for(size_t bucket = 0; bucket < PROFILE_HIST_BUCKETS; bucket++) printf(" %5lu", copy.hist[bucket]);
+		printf("\r\n");
+	}
+}
+
+// Periodically dump probes if enabled
+void profile_task(void)
+{
+#if PROFILE_DUMP_INTERVAL > 0
+
+	if(HAL_GetTick() < last_dump + PROFILE_DUMP_INTERVAL) return;
+
+	profile_dump();
+	last_dump = HAL_GetTick();
+
+#endif // PROFILE_DUMP_INTERVAL
+}
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Write a 32-bit value MSB first
+static void put_u32(uint8_t *dst, uint32_t value)
+{
+	dst[0] = value >> 24;
+	dst[1] = (value >> 16) & 0xFF;
+	dst[2] = (value >> 8) & 0xFF;
+	dst[3] = value & 0xFF;
+}
+
+#endif // PROFILE
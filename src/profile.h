@@ -0,0 +1,90 @@
+//==============================================================================
+// Cycle Counter Profiling
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_PROFILE_H
+#define ATLC_PROFILE_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdint.h>
+
+#include "clock.h"
+#include "config.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+typedef enum
+{
+	PROFILE_CAN_RX_ISR = 0,
+	PROFILE_RGB1_DMA_ISR,
+	PROFILE_RGB2_DMA_ISR,
+	PROFILE_LOAD_NEXT_LED,
+	PROFILE_RGB_STRIP_TASK,
+	PROFILE_CAN_RECEIVE,
+	PROFILE_COMMAND,
+	PROFILE_MAIN_LOOP,
+	PROFILE_EXTI_ISR,
+	PROFILE_CAN_RX1_ISR,
+	PROFILE_SEGMENT_RENDER,
+	PROFILE_NUM_PROBES
+} profile_probe_t;
+
+// Histogram buckets are 4x wide each: <64, <256, <1K, <4K, <16K, <64K, <256K, >=256K cycles
+#define PROFILE_HIST_BUCKETS	8
+
+// Profile stats command pages
+#define PROFILE_PAGE_COUNT_MEAN	0
+#define PROFILE_PAGE_MIN_MAX	1
+#define PROFILE_PAGE_HIST_LOW	2
+#define PROFILE_PAGE_HIST_HIGH	3
+#define PROFILE_PAGE_DUMP		0xFE
+#define PROFILE_PAGE_RESET		0xFF
+
+typedef struct
+{
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+	uint32_t hist[PROFILE_HIST_BUCKETS];
+} profile_stats_t;
+
+
+#ifdef PROFILE
+
+#define PROFILE_START(probe) uint32_t profile_start_##probe = clock_cycles()
+#define PROFILE_STOP(probe) profile_record(probe, clock_cycles() - profile_start_##probe)
+
+#else
+
+#define PROFILE_START(probe)
+#define PROFILE_STOP(probe)
+
+#endif // PROFILE
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+#ifdef PROFILE
+
+void profile_record(profile_probe_t probe, uint32_t cycles);
+void profile_get(profile_probe_t probe, profile_stats_t *stats);
+void profile_reset(void);
+uint8_t profile_read_page(uint8_t probe, uint8_t page, uint8_t *payload);
+void profile_dump(void);
+void profile_task(void);
+
+#endif // PROFILE
+
+
+#endif // ATLC_PROFILE_H
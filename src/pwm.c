@@ -0,0 +1,257 @@
+//==============================================================================
+// Output PWM Driver
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stm32f3xx_hal.h>
+
+#include "config.h"
+#include "debug.h"
+#include "gpio.h"
+#include "pwm.h"
+
+
+#ifdef PWM
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+#define PWM_NUM_CHANNELS	3
+#define PWM_PERIOD			((1UL << PWM_RESOLUTION) - 1)
+#define PWM_FULL			(PWM_PERIOD + 1)		// above ARR, so PWM1 mode never drives low
+
+typedef struct
+{
+	uint8_t pin;			// output number
+	uint16_t gpio_pin;
+	uint32_t channel;
+	uint8_t alternate;
+	bool enabled;
+	uint16_t target;		// compare value at the end of a ramp
+} pwm_channel_t;
+
+
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static pwm_channel_t *find_channel(uint8_t pin);
+static void start_ramp(uint16_t time);
+
+
+//------------------------------------------------------------------------------
+// Private Variables
+//------------------------------------------------------------------------------
+
+static TIM_HandleTypeDef htim;
+static DMA_HandleTypeDef hdma;
+
+static pwm_channel_t channels[PWM_NUM_CHANNELS] = {
+	{2, OUT2_PIN, TIM_CHANNEL_1, GPIO_AF6_TIM1, false, 0},
+	{3, OUT3_PIN, TIM_CHANNEL_2, GPIO_AF6_TIM1, false, 0},
+	{4, OUT4_PIN, TIM_CHANNEL_3, GPIO_AF4_TIM1, false, 0}
+};
+
+// CCR1-CCR3 for each step, SRAM since DMA can't reach CCM
+static uint16_t ramp[PWM_RAMP_STEPS][PWM_NUM_CHANNELS];
+
+static uint32_t pwm_frequency;
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Initialize PWM timer and ramp DMA
+void pwm_init(void)
+{
+	// prescale down to the nearest frequency at or above PWM_FREQUENCY
+	uint32_t timer_clock = HAL_RCC_GetPCLK2Freq();
+	uint32_t prescaler = timer_clock / (PWM_FREQUENCY * (PWM_PERIOD + 1));
+	if(prescaler > 0) prescaler--;
+	pwm_frequency = timer_clock / ((prescaler + 1) * (PWM_PERIOD + 1));
+
+	htim.Instance = TIM1;
+	htim.Init.Prescaler = prescaler;
+	htim.Init.CounterMode = TIM_COUNTERMODE_UP;
+	htim.Init.Period = PWM_PERIOD;
+	htim.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+	htim.Init.RepetitionCounter = 0;
+	htim.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
+	debug_assert(HAL_TIM_PWM_Init(&htim) == HAL_OK, "Failed to configure PWM timer");
+
+	// only the N outputs are enabled, they follow OCxREF without inversion
+	TIM_OC_InitTypeDef oc_config = {0};
+	oc_config.OCMode = TIM_OCMODE_PWM1;
+	oc_config.Pulse = 0;
+	oc_config.OCPolarity = TIM_OCPOLARITY_HIGH;
+	oc_config.OCNPolarity = TIM_OCNPOLARITY_HIGH;
+	oc_config.OCFastMode = TIM_OCFAST_DISABLE;
+	oc_config.OCIdleState = TIM_OCIDLESTATE_RESET;
+	oc_config.OCNIdleState = TIM_OCNIDLESTATE_RESET;
+
+	for(size_t i = 0; i < PWM_NUM_CHANNELS; i++)
+	{
+		debug_assert(HAL_TIM_PWM_ConfigChannel(&htim, &oc_config, channels[i].channel) == HAL_OK, "Failed to configure PWM channel %d", i + 1);
+	}
+
+	TIM_BreakDeadTimeConfigTypeDef btd_config = {0};
+	btd_config.OffStateRunMode = TIM_OSSR_DISABLE;
+	btd_config.OffStateIDLEMode = TIM_OSSI_DISABLE;
+	btd_config.LockLevel = TIM_LOCKLEVEL_OFF;
+	btd_config.DeadTime = 0;
+	btd_config.BreakState = TIM_BREAK_DISABLE;
+	btd_config.BreakPolarity = TIM_BREAKPOLARITY_HIGH;
+	btd_config.BreakFilter = 0;
+	btd_config.AutomaticOutput = TIM_AUTOMATICOUTPUT_DISABLE;
+	debug_assert(HAL_TIMEx_ConfigBreakDeadTime(&htim, &btd_config) == HAL_OK, "Failed to configure PWM break");
+
+	hdma.Instance = DMA1_Channel5;
+	hdma.Init.Direction = DMA_MEMORY_TO_PERIPH;
+	hdma.Init.PeriphInc = DMA_PINC_DISABLE;
+	hdma.Init.MemInc = DMA_MINC_ENABLE;
+	hdma.Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+	hdma.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+	hdma.Init.Mode = DMA_NORMAL;
+	hdma.Init.Priority = DMA_PRIORITY_LOW;
+	debug_assert(HAL_DMA_Init(&hdma) == HAL_OK, "Failed to configure PWM DMA");
+
+	__HAL_LINKDMA(&htim, hdma[TIM_DMA_ID_UPDATE], hdma);
+
+	HAL_NVIC_SetPriority(DMA1_Channel5_IRQn, 2, 1);
+	HAL_NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+}
+
+// Set an output's duty cycle (16-bit, scaled to PWM_RESOLUTION), fading over time ms
+void pwm_set(uint8_t pin, bool enabled, uint16_t duty, uint16_t time)
+{
+	pwm_channel_t *channel = find_channel(pin);
+	if(!channel) return;
+
+	if(!enabled)
+	{
+		if(!channel->enabled) return;
+
+		HAL_TIMEx_PWMN_Stop(&htim, channel->channel);
+		channel->enabled = false;
+		channel->target = 0;
+
+		// a running ramp keeps this channel at 0
+		size_t index = channel - channels;
+		for(size_t i = 0; i < PWM_RAMP_STEPS; i++) ramp[i][index] = 0;
+		__HAL_TIM_SET_COMPARE(&htim, channel->channel, 0);
+
+		// hand the pin back to GPIO, off
+		GPIO_InitTypeDef gpio_config = {0};
+		HAL_GPIO_WritePin(OUT_PORT, channel->gpio_pin, GPIO_PIN_RESET);
+		gpio_config.Pin = channel->gpio_pin;
+		gpio_config.Mode = GPIO_MODE_OUTPUT_PP;
+		gpio_config.Pull = GPIO_NOPULL;
+		gpio_config.Speed = GPIO_SPEED_FREQ_LOW;
+		HAL_GPIO_Init(OUT_PORT, &gpio_config);
+		gpio_reserve_outputs(GPIO_OWNER_PWM, 1 << (pin - 1), false);
+		return;
+	}
+
+	if(!channel->enabled)
+	{
+		// start from the pin's on/off state so a fade begins where the output was
+		bool on = gpio_read_outputs() & (1 << (pin - 1));
+		__HAL_TIM_SET_COMPARE(&htim, channel->channel, on ? PWM_FULL : 0);
+		HAL_TIMEx_PWMN_Start(&htim, channel->channel);
+
+		GPIO_InitTypeDef gpio_config = {0};
+		gpio_config.Pin = channel->gpio_pin;
+		gpio_config.Mode = GPIO_MODE_AF_PP;
+		gpio_config.Pull = GPIO_NOPULL;
+		gpio_config.Speed = GPIO_SPEED_FREQ_LOW;
+		gpio_config.Alternate = channel->alternate;
+		HAL_GPIO_Init(OUT_PORT, &gpio_config);
+		gpio_reserve_outputs(GPIO_OWNER_PWM, 1 << (pin - 1), true);
+		channel->enabled = true;
+	}
+
+	// 0xFFFF is full on, one count past the period
+	channel->target = ((uint32_t)duty * PWM_FULL + 0x7FFF) / 0xFFFF;
+	start_ramp(time);
+}
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Return the timer channel driving an output, NULL if there is none
+static pwm_channel_t *find_channel(uint8_t pin)
+{
+	for(size_t i = 0; i < PWM_NUM_CHANNELS; i++)
+	{
+		if(channels[i].pin == pin) return &channels[i];
+	}
+
+	return NULL;
+}
+
+// Ramp all channels from their current duty to their targets
+static void start_ramp(uint16_t time)
+{
+	// a new ramp picks up unfinished ones where they are, they all end together
+	__HAL_TIM_DISABLE_DMA(&htim, TIM_DMA_UPDATE);
+	HAL_DMA_Abort(&hdma);
+
+	uint16_t from[PWM_NUM_CHANNELS];
+	for(size_t i = 0; i < PWM_NUM_CHANNELS; i++) from[i] = __HAL_TIM_GET_COMPARE(&htim, channels[i].channel);
+
+	// the 8-bit repetition counter limits a step to 256 periods, longer ramps are clamped
+	uint32_t periods = (uint32_t)time * pwm_frequency / 1000;
+	if(periods > PWM_RAMP_STEPS * PWM_STEP_PERIODS) periods = PWM_RAMP_STEPS * PWM_STEP_PERIODS;
+	if(periods == 0)
+	{
+		for(size_t i = 0; i < PWM_NUM_CHANNELS; i++) __HAL_TIM_SET_COMPARE(&htim, channels[i].channel, channels[i].target);
+		return;
+	}
+
+	uint32_t steps = periods < PWM_RAMP_STEPS ? periods : PWM_RAMP_STEPS;
+	uint32_t step_periods = periods / steps;
+
+	for(size_t step = 0; step < steps; step++)
+	{
+		for(size_t i = 0; i < PWM_NUM_CHANNELS; i++)
+		{
+			int32_t delta = (int32_t)channels[i].target - from[i];
+			ramp[step][i] = from[i] + delta * (int32_t)(step + 1) / (int32_t)steps;
+		}
+	}
+
+	// each update event bursts one step into CCR1-CCR3
+	htim.Instance->RCR = step_periods - 1;
+	htim.Instance->DCR = TIM_DMABASE_CCR1 | TIM_DMABURSTLENGTH_3TRANSFERS;
+	HAL_DMA_Start_IT(&hdma, (uint32_t)ramp, (uint32_t)&htim.Instance->DMAR, steps * PWM_NUM_CHANNELS);
+	__HAL_TIM_ENABLE_DMA(&htim, TIM_DMA_UPDATE);
+}
+
+
+//------------------------------------------------------------------------------
+// ISRs
+//------------------------------------------------------------------------------
+
+// PWM ramp DMA Transfer Complete ISR
+void DMA1_Channel5_IRQHandler(void)
+{
+	if(__HAL_DMA_GET_FLAG(&hdma, DMA_FLAG_TC5))
+	{
+		// ramp finished, the last step holds the targets
+		__HAL_TIM_DISABLE_DMA(&htim, TIM_DMA_UPDATE);
+	}
+
+	HAL_DMA_IRQHandler(&hdma);
+}
+
+#endif // PWM
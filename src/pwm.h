@@ -0,0 +1,59 @@
+//==============================================================================
+// Output PWM Driver
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_PWM_H
+#define ATLC_PWM_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	Outputs 2-4 can be driven by TIM1 complementary channels instead of GPIO:
+	- PB13: TIM1_CH1N
+	- PB14: TIM1_CH2N
+	- PB15: TIM1_CH3N
+
+	PB12 (output 1) has no timer channel and stays on/off only.
+
+	Fade ramps are a table of compare values written to CCR1-CCR3 by a
+	TIM1 update DMA burst on DMA1 channel 5. The repetition counter spaces
+	the steps, so a ramp runs without the CPU.
+*/
+
+// full on is a compare value of 1 << PWM_RESOLUTION, which has to fit CCRx
+#if PWM_RESOLUTION < 8 || PWM_RESOLUTION > 15
+#error "PWM_RESOLUTION must be 8 to 15 bits"
+#endif
+
+// Steps in a fade ramp, each at most 256 PWM periods, longer fades are cut to that
+#define PWM_RAMP_STEPS		64
+#define PWM_STEP_PERIODS	256
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+#ifdef PWM
+
+void pwm_init(void);
+void pwm_set(uint8_t pin, bool enabled, uint16_t duty, uint16_t time);
+
+#endif // PWM
+
+
+#endif // ATLC_PWM_H
@@ -0,0 +1,181 @@
+//==============================================================================
+// Reliable Commands
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stm32f3xx_hal.h>
+
+#include "can.h"
+#include "config.h"
+#include "reliable.h"
+
+
+#ifdef RELIABLE
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+#define SEQ_HALF	((CAN_RELIABLE_SEQ_MASK + 1) / 2)
+
+typedef struct
+{
+	bool used;
+	uint8_t sender;
+	uint8_t lane;
+	uint8_t next;				// sequence of the next command to apply
+	uint8_t unacked;			// commands applied since the last ack
+	bool ack_pending;
+	bool nack_pending;
+	bool nacked;				// gap already reported
+	uint32_t pending_time;		// tick the ack was first due
+	uint32_t last_used;
+} stream_t;
+
+
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static stream_t *find_stream(uint8_t sender, uint8_t lane, uint8_t seq);
+static void request_ack(stream_t *stream, bool now);
+static void send_ack(stream_t *stream, uint8_t status);
+
+
+//------------------------------------------------------------------------------
+// Private Variables
+//------------------------------------------------------------------------------
+
+static stream_t streams[RELIABLE_STREAMS];
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Check a reliable command's sequence number, true if it should be applied
+bool reliable_accept(const can_msg_t *msg)
+{
+	// every member of a group would ack
+	if(can_is_group(msg->id)) return true;
+
+	// sync, both sequences start over
+	if(msg->cmd == CAN_CMD_ACK)
+	{
+		for(uint8_t lane = RELIABLE_LANE_CONTROL; lane <= RELIABLE_LANE_BULK; lane++)
+		{
+			stream_t *stream = find_stream(msg->sender, lane, msg->seq);
+			stream->next = msg->seq;
+			stream->nacked = false;
+			stream->nack_pending = false;
+			request_ack(stream, true);
+		}
+
+		return false;
+	}
+
+	uint8_t lane = msg->cmd <= CAN_CMD_TRUTH_TABLE ? RELIABLE_LANE_CONTROL : RELIABLE_LANE_BULK;
+	stream_t *stream = find_stream(msg->sender, lane, msg->seq);
+
+	uint8_t ahead = (msg->seq - stream->next) & CAN_RELIABLE_SEQ_MASK;
+	if(ahead == 0)
+	{
+		stream->next = (stream->next + 1) & CAN_RELIABLE_SEQ_MASK;
+		stream->nacked = false;
+		stream->unacked++;
+		request_ack(stream, stream->unacked >= RELIABLE_ACK_BATCH);
+		return true;
+	}
+
+	// already applied, the sender missed our ack
+	if(ahead >= SEQ_HALF)
+	{
+		request_ack(stream, false);
+		return false;
+	}
+
+	// an earlier command was lost, everything after it is resent
+	if(!stream->nacked)
+	{
+		stream->nack_pending = true;
+		stream->nacked = true;
+	}
+
+	return false;
+}
+
+// Send acks that are due, call from the main loop
+void reliable_task(void)
+{
+	uint32_t now = HAL_GetTick();
+
+	for(size_t i = 0; i < RELIABLE_STREAMS; i++)
+	{
+		stream_t *stream = &streams[i];
+		if(!stream->used) continue;
+
+		// a nack also acks what came before the gap
+		if(stream->nack_pending) send_ack(stream, RELIABLE_NACK);
+		else if(stream->ack_pending && now - stream->pending_time >= RELIABLE_ACK_DELAY) send_ack(stream, RELIABLE_ACK);
+	}
+}
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Find a sender's sequence, a new one starts at seq and replaces the least recently used
+static stream_t *find_stream(uint8_t sender, uint8_t lane, uint8_t seq)
+{
+	uint32_t now = HAL_GetTick();
+	stream_t *oldest = &streams[0];
+
+	for(size_t i = 0; i < RELIABLE_STREAMS; i++)
+	{
+		stream_t *stream = &streams[i];
+		if(stream->used && stream->sender == sender && stream->lane == lane)
+		{
+			stream->last_used = now;
+			return stream;
+		}
+
+		if(oldest->used && (!stream->used || now - stream->last_used > now - oldest->last_used)) oldest = stream;
+	}
+
+	*oldest = (stream_t){
+		.used = true,
+		.sender = sender,
+		.lane = lane,
+		.next = seq,
+		.last_used = now
+	};
+	return oldest;
+}
+
+// Mark an ack as due, after RELIABLE_ACK_DELAY unless now
+static void request_ack(stream_t *stream, bool now)
+{
+	if(!stream->ack_pending) stream->pending_time = HAL_GetTick();
+	if(now) stream->pending_time = HAL_GetTick() - RELIABLE_ACK_DELAY;
+	stream->ack_pending = true;
+}
+
+// Send an Ack to a sender with the next sequence we expect
+static void send_ack(stream_t *stream, uint8_t status)
+{
+	uint8_t payload[] = {can_get_id(), stream->lane, stream->next, status};
+	can_send(stream->sender, CAN_CMD_ACK, payload, sizeof(payload));
+
+	stream->ack_pending = false;
+	stream->nack_pending = false;
+	stream->unacked = 0;
+}
+
+#endif // RELIABLE
@@ -0,0 +1,62 @@
+//==============================================================================
+// Reliable Commands
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_RELIABLE_H
+#define ATLC_RELIABLE_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "can.h"
+#include "config.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	A command sent with CAN_RELIABLE_FLAG set in its extended id also
+	carries the sender's id and a 6-bit sequence number. Each sender has
+	two sequences, one for control commands (0-3, the FIFO1 lane) and one
+	for the rest, since the control lane is handled ahead of the other.
+
+	Commands are applied in sequence order. A repeat of an applied command
+	is acked again but not applied twice, and a command past a gap is
+	dropped and the gap nacked once, so the sender goes back to the first
+	missing command. Acks are cumulative and batched: one ack covers
+	everything applied in the last RELIABLE_ACK_DELAY ms, or
+	RELIABLE_ACK_BATCH commands. The sender should keep at most 32
+	commands per lane unacked.
+
+	A reliable Ack command from a sender starts both of its sequences over
+	at its sequence number. Commands to group ids are never acked.
+*/
+
+#define RELIABLE_LANE_CONTROL	0
+#define RELIABLE_LANE_BULK		1
+
+#define RELIABLE_ACK		0
+#define RELIABLE_NACK		1
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+#ifdef RELIABLE
+
+bool reliable_accept(const can_msg_t *msg);
+void reliable_task(void);
+
+#endif // RELIABLE
+
+
+#endif // ATLC_RELIABLE_H
@@ -7,15 +7,20 @@
 // Includes
 //------------------------------------------------------------------------------
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stm32f3xx_hal.h>
 
+#include "ccm.h"
 #include "config.h"
 #include "debug.h"
 #include "gpio.h"
+#include "profile.h"
 #include "rgb_strip.h"
+#include "store.h"
+#include "trace.h"
 
 
 //------------------------------------------------------------------------------
@@ -35,6 +40,15 @@
 #define COLOR_INTERVAL		1000UL	// ms
 #define RAINBOW_INTERVAL	100UL	// ms
 
+// LED data kept per strip, palette indices or GRB bytes
+#ifdef PALETTE
+#define FRAME_SIZE			((RGB_NUM_LEDS * RGB_PALETTE_BITS + 7) / 8)
+#define PALETTE_SIZE		(1 << RGB_PALETTE_BITS)
+#define SOLID_ENTRY			PALETTE_SIZE	// color of the solid modes, past the host's entries
+#else
+#define FRAME_SIZE			(RGB_NUM_LEDS * BYTES_PER_LED)
+#endif // PALETTE
+
 typedef enum
 {
 	STATE_INIT = 0,
@@ -59,6 +73,21 @@ typedef struct
 	uint32_t last_update;
 } rgb_strip_t;
 
+typedef struct
+{
+	bool pending;
+	uint8_t cmd;
+	uint32_t timestamp;
+} rgb_strip_trace_t;
+
+typedef struct
+{
+	uint16_t period;		// ns
+	uint16_t one_pulse;		// ns
+	uint16_t zero_pulse;	// ns
+	uint32_t reset_pulse;	// ns
+} rgb_chip_timing_t;
+
 
 //------------------------------------------------------------------------------
 // Private Function Definitions
@@ -67,8 +96,20 @@ typedef struct
 static void timer_init(uint8_t strip, TIM_TypeDef *timer);
 static void dma_init(uint8_t strip, DMA_Channel_TypeDef *channel);
 static void set_rgb(uint8_t strip, uint8_t r, uint8_t g, uint8_t b);
+static void fill(uint8_t strip, uint8_t r, uint8_t g, uint8_t b);
+static void set_grb(uint8_t *dst, uint8_t r, uint8_t g, uint8_t b);
+static void render(uint8_t strip);
 static void update(uint8_t strip);
 static void load_next_led(uint8_t strip, uint8_t index, dma_buffer_half_t half);
+
+#ifdef PALETTE
+static uint8_t get_index(uint8_t strip, uint8_t led);
+static void set_index(uint8_t strip, uint8_t led, uint8_t value);
+static void show_indexed(uint8_t strip, bool show);
+#endif // PALETTE
+
+static void refill(uint8_t strip, dma_buffer_half_t half);
+static void start_end_reset(uint8_t strip);
 static void dma_process_halfcomplete(uint8_t strip);
 static void dma_process_complete(uint8_t strip);
 
@@ -80,19 +121,42 @@ static void dma_process_complete(uint8_t strip);
 static DMA_HandleTypeDef hdmas[RGB_NUM_STRIPS];
 static TIM_HandleTypeDef htims[RGB_NUM_STRIPS];
 
-static uint8_t buffer[RGB_NUM_STRIPS][RGB_NUM_LEDS * BYTES_PER_LED];
-//static volatile uint16_t dma_buffer[RGB_NUM_STRIPS][RESET_PULSE / PERIOD];
-static volatile uint16_t dma_buffer[RGB_NUM_STRIPS][2 * 8 * BYTES_PER_LED];
+static uint8_t buffer[RGB_NUM_STRIPS][FRAME_SIZE];
+static volatile uint16_t dma_buffer[RGB_NUM_STRIPS][2 * 8 * BYTES_PER_LED];	// SRAM, DMA can't reach CCM
 static volatile rgb_strip_state_t state[RGB_NUM_STRIPS];
 static volatile uint8_t led_index[RGB_NUM_STRIPS];
+static volatile rgb_strip_stats_t stats[RGB_NUM_STRIPS];
+static volatile uint8_t retries[RGB_NUM_STRIPS];
+static volatile bool retry_pending[RGB_NUM_STRIPS];
+static volatile uint8_t reset_laps_left[RGB_NUM_STRIPS];
+
+#ifdef TRACE
+static volatile rgb_strip_trace_t traces[RGB_NUM_STRIPS];
+#endif // TRACE
 
 static uint16_t timer_arr_period;
 static uint16_t timer_ccr_one;
 static uint16_t timer_ccr_zero;
-static uint16_t timer_ccr_reset;
+static uint8_t reset_laps;			// DMA buffer laps in a reset pulse
+
+static const rgb_chip_timing_t chip_timings[RGB_NUM_CHIPS] = RGB_CHIP_TIMINGS;
+static uint8_t num_strips;
+static uint8_t num_leds[RGB_NUM_STRIPS];
+
+// timer cc values for each 4-bit nibble, MSB first
+static uint16_t nibble_lut[16][4] CCM_BSS;
 
 static rgb_strip_t strips[RGB_NUM_STRIPS];
 
+#ifdef PALETTE
+
+// GRB colors for each index, read by the LED encoder
+static uint8_t palettes[RGB_NUM_STRIPS][PALETTE_SIZE + 1][BYTES_PER_LED] CCM_BSS;
+static uint8_t depths[RGB_NUM_STRIPS];	// bits per LED
+static bool solid[RGB_NUM_STRIPS];		// every LED shows SOLID_ENTRY, the framebuffer is kept
+
+#endif // PALETTE
+
 
 //------------------------------------------------------------------------------
 // Public Functions
@@ -101,11 +165,46 @@ static rgb_strip_t strips[RGB_NUM_STRIPS];
 // Initialize timers and DMA for RGB strips
 void rgb_strip_init(void)
 {
-	// calculate timer values based on selected config options
-	timer_arr_period = HAL_RCC_GetPCLK2Freq() / 1000000 * PERIOD / 1000;
-	timer_ccr_one = HAL_RCC_GetPCLK2Freq() / 1000000 * ONE_PULSE / 1000;
-	timer_ccr_zero = HAL_RCC_GetPCLK2Freq() / 1000000 * ZERO_PULSE / 1000;
-	timer_ccr_reset = HAL_RCC_GetPCLK2Freq() / 1000000 * RESET_PULSE / 1000;
+	// defaults from config.h, stored settings override them
+	uint8_t chip = RGB_CHIP;
+	num_strips = RGB_NUM_STRIPS;
+	for(size_t i = 0; i < RGB_NUM_STRIPS; i++) num_leds[i] = RGB_NUM_LEDS;
+
+#ifdef PALETTE
+
+	for(size_t i = 0; i < RGB_NUM_STRIPS; i++) depths[i] = RGB_PALETTE_BITS;
+
+#endif // PALETTE
+
+#ifdef CONFIG_STORE
+
+	uint8_t value[RGB_NUM_STRIPS];
+	if(store_get(STORE_KEY_STRIP_COUNT, value, 1) && value[0] <= RGB_NUM_STRIPS) num_strips = value[0];
+	if(store_get(STORE_KEY_CHIP_TYPE, value, 1) && value[0] < RGB_NUM_CHIPS) chip = value[0];
+
+	uint8_t len = store_get(STORE_KEY_STRIP_LEDS, value, RGB_NUM_STRIPS);
+	for(size_t i = 0; i < len; i++)
+	{
+		if(value[i] <= RGB_NUM_LEDS) num_leds[i] = value[i];
+	}
+
+#endif // CONFIG_STORE
+
+	// calculate timer values for the chip type
+	const rgb_chip_timing_t *timing = &chip_timings[chip];
+	timer_arr_period = HAL_RCC_GetPCLK2Freq() / 1000000 * timing->period / 1000;
+	timer_ccr_one = HAL_RCC_GetPCLK2Freq() / 1000000 * timing->one_pulse / 1000;
+	timer_ccr_zero = HAL_RCC_GetPCLK2Freq() / 1000000 * timing->zero_pulse / 1000;
+
+	// a reset pulse is whole laps of the zeroed DMA buffer
+	uint32_t lap = (uint32_t)timing->period * 2 * 8 * BYTES_PER_LED;
+	reset_laps = (timing->reset_pulse + lap - 1) / lap;
+
+	// build encoder lookup table
+	for(size_t nibble = 0; nibble < 16; nibble++)
+	{
+		for(size_t bit = 0; bit < 4; bit++) nibble_lut[nibble][bit] = (nibble & (1 << (3 - bit))) ? timer_ccr_one : timer_ccr_zero;
+	}
 
 	// configure gpio pins
 	GPIO_InitTypeDef gpio_config = {0};
@@ -151,7 +250,7 @@ void rgb_strip_deinit(void)
 // Disables strip
 void rgb_strip_disable(uint8_t strip)
 {
-	if(strip >= RGB_NUM_STRIPS) return;
+	if(strip >= num_strips) return;
 
 	strips[strip].mode = RGB_STRIP_DISABLED;
 	set_rgb(strip, 0, 0, 0);
@@ -160,7 +259,7 @@ void rgb_strip_disable(uint8_t strip)
 // Set strip to an RGB color value
 void rgb_strip_set_color(uint8_t strip, uint8_t r, uint8_t g, uint8_t b)
 {
-	if(strip >= RGB_NUM_STRIPS) return;
+	if(strip >= num_strips) return;
 
 	strips[strip].mode = RGB_STRIP_COLOR;
 	strips[strip].red = r;
@@ -172,53 +271,208 @@ void rgb_strip_set_color(uint8_t strip, uint8_t r, uint8_t g, uint8_t b)
 // Set strip to rainbow color mode
 void rgb_strip_set_rainbow(uint8_t strip)
 {
-	if(strip >= RGB_NUM_STRIPS) return;
+	if(strip >= num_strips) return;
 
 	strips[strip].mode = RGB_STRIP_RAINBOW;
 	strips[strip].wheel = 0;
 }
 
+// Get a strip's mode and color
+void rgb_strip_get(uint8_t strip, rgb_strip_setting_t *setting)
+{
+	if(strip >= RGB_NUM_STRIPS) return;
+
+	setting->mode = strips[strip].mode;
+	setting->red = strips[strip].red;
+	setting->green = strips[strip].green;
+	setting->blue = strips[strip].blue;
+}
+
+// Set all strips at once, their next frames start together
+void rgb_strip_apply(const rgb_strip_setting_t *settings)
+{
+	// let frames in flight finish so no strip shows half of the change
+	for(size_t i = 0; i < num_strips; i++) while(state[i] != STATE_INIT);
+
+	for(size_t i = 0; i < num_strips; i++)
+	{
+		strips[i].mode = settings[i].mode;
+		strips[i].red = settings[i].red;
+		strips[i].green = settings[i].green;
+		strips[i].blue = settings[i].blue;
+		strips[i].wheel = 0;
+		render(i);
+	}
+
+	for(size_t i = 0; i < num_strips; i++) update(i);
+}
+
+// Get frame and underrun counters for a strip
+void rgb_strip_get_stats(uint8_t strip, rgb_strip_stats_t *copy)
+{
+	if(strip >= RGB_NUM_STRIPS) return;
+
+	copy->frames = stats[strip].frames;
+	copy->underruns = stats[strip].underruns;
+	copy->retries = stats[strip].retries;
+}
+
+#ifdef PALETTE
+
+// Switch a strip to indexed mode with 2, 4 or 8 bits per LED, all LEDs show entry 0
+bool rgb_strip_set_depth(uint8_t strip, uint8_t depth)
+{
+	if(strip >= num_strips) return false;
+	if((depth != 2 && depth != 4 && depth != 8) || depth > RGB_PALETTE_BITS) return false;
+
+	// the buffer is read during a frame, wait for it before clearing
+	while(state[strip] != STATE_INIT);
+	depths[strip] = depth;
+	memset(buffer[strip], 0, sizeof(buffer[strip]));
+
+	strips[strip].mode = RGB_STRIP_INDEXED;
+	show_indexed(strip, true);
+	return true;
+}
+
+// Get a strip's bits per LED in indexed mode, 0 if it isn't driven
+uint8_t rgb_strip_get_depth(uint8_t strip)
+{
+	return strip < num_strips ? depths[strip] : 0;
+}
+
+// Write palette entries from RGB triplets, show sends a frame with them
+void rgb_strip_set_palette(uint8_t strip, uint8_t first, const uint8_t *colors, uint8_t count, bool show)
+{
+	if(strip >= num_strips) return;
+
+	while(state[strip] != STATE_INIT);
+	for(size_t i = 0; i < count && first + i < PALETTE_SIZE; i++)
+	{
+		set_grb(palettes[strip][first + i], colors[i * 3 + 0], colors[i * 3 + 1], colors[i * 3 + 2]);
+	}
+
+	if(strips[strip].mode == RGB_STRIP_INDEXED) show_indexed(strip, show);
+}
+
+// Write packed indices from LED first on, MSB first, show sends a frame with them
+void rgb_strip_set_pixels(uint8_t strip, uint8_t first, const uint8_t *indices, uint8_t len, bool show)
+{
+	if(strip >= num_strips) return;
+
+	uint8_t depth = depths[strip];
+	uint8_t per_byte = 8 / depth;
+	uint8_t mask = (1 << depth) - 1;
+
+	while(state[strip] != STATE_INIT);
+	for(size_t i = 0; i < (size_t)len * per_byte && first + i < num_leds[strip]; i++)
+	{
+		uint8_t shift = 8 - depth - (i % per_byte) * depth;
+		set_index(strip, first + i, (indices[i / per_byte] >> shift) & mask);
+	}
+
+	strips[strip].mode = RGB_STRIP_INDEXED;
+	show_indexed(strip, show);
+}
+
+// Write [count, index] runs from LED first on, xor flips the LEDs' index bits instead
+void rgb_strip_set_runs(uint8_t strip, uint8_t first, const uint8_t *runs, uint8_t len, bool xor, bool show)
+{
+	if(strip >= num_strips) return;
+
+	uint8_t mask = (1 << depths[strip]) - 1;
+	uint16_t led = first;
+
+	// runs are decoded straight into the framebuffer once the frame in flight is sent
+	while(state[strip] != STATE_INIT);
+	for(size_t i = 0; i + 1 < len; i += 2)
+	{
+		uint8_t value = runs[i + 1] & mask;
+		uint16_t end = led + runs[i];
+		if(end > num_leds[strip]) end = num_leds[strip];
+
+		// a zero XOR run skips unchanged LEDs
+		if(xor && value == 0) led = end;
+
+		for(; led < end; led++) set_index(strip, led, xor ? get_index(strip, led) ^ value : value);
+	}
+
+	strips[strip].mode = RGB_STRIP_INDEXED;
+	show_indexed(strip, show);
+}
+
+// Get the number of LEDs on a strip, 0 if it isn't driven
+uint8_t rgb_strip_get_leds(uint8_t strip)
+{
+	return strip < num_strips ? num_leds[strip] : 0;
+}
+
+// Wait for frames in flight on a mask of strips and switch them to indexed mode
+void rgb_strip_begin(uint8_t mask)
+{
+	for(size_t i = 0; i < num_strips; i++)
+	{
+		if(!(mask & (1 << i))) continue;
+
+		while(state[i] != STATE_INIT);
+		strips[i].mode = RGB_STRIP_INDEXED;
+	}
+}
+
+// Set an LED's palette index, between rgb_strip_begin() and rgb_strip_show()
+void rgb_strip_set_index(uint8_t strip, uint8_t led, uint8_t index)
+{
+	if(strip >= num_strips || led >= num_leds[strip]) return;
+
+	set_index(strip, led, index & ((1 << depths[strip]) - 1));
+}
+
+// Send frames on a mask of strips, they start together
+void rgb_strip_show(uint8_t mask)
+{
+	for(size_t i = 0; i < num_strips; i++)
+	{
+		if(mask & (1 << i)) show_indexed(i, true);
+	}
+}
+
+#endif // PALETTE
+
+#ifdef TRACE
+
+// Trace latency of a command until the next frame's first LED bit
+void rgb_strip_trace(uint8_t strip, uint8_t cmd, uint32_t timestamp)
+{
+	if(strip >= RGB_NUM_STRIPS) return;
+
+	traces[strip].pending = false;
+	traces[strip].cmd = cmd;
+	traces[strip].timestamp = timestamp;
+	traces[strip].pending = true;
+}
+
+#endif // TRACE
+
 // Update strip color dependineg on moed
 void rgb_strip_task(void)
 {
-	for(size_t i = 0; i < RGB_NUM_STRIPS; i++)
+	PROFILE_START(PROFILE_RGB_STRIP_TASK);
+
+	for(size_t i = 0; i < num_strips; i++)
 	{
-		if(strips[i].mode == RGB_STRIP_DISABLED
-			&& HAL_GetTick() >= strips[i].last_update + DISABLED_INTERVAL)
-		{
-			set_rgb(i, 0, 0, 0);
-			strips[i].last_update = HAL_GetTick();
-		}
-		else if(strips[i].mode == RGB_STRIP_COLOR
-			&& HAL_GetTick() >= strips[i].last_update + COLOR_INTERVAL)
-		{
-			set_rgb(i, strips[i].red, strips[i].green, strips[i].blue);
-			strips[i].last_update = HAL_GetTick();
-		}
-		else if(strips[i].mode == RGB_STRIP_RAINBOW
-			&& HAL_GetTick() >= strips[i].last_update + RAINBOW_INTERVAL)
-		{
-			uint8_t wheel = 255 - strips[i].wheel;
-
-			if(wheel < 85)
-			{
-				set_rgb(i, 255 - wheel * 3, 0, wheel * 3);
-			}
-			else if(wheel < 170)
-			{
-				wheel -= 85;
-				set_rgb(i, 0, wheel * 3, 255 - wheel * 3);
-			}
-			else
-			{
-				wheel -= 170;
-				set_rgb(i, wheel * 3, 255 - wheel * 3, 0);
-			}
-
-			strips[i].wheel++;
-			strips[i].last_update = HAL_GetTick();
-		}
+		uint32_t interval = DISABLED_INTERVAL;
+		if(strips[i].mode == RGB_STRIP_COLOR || strips[i].mode == RGB_STRIP_INDEXED) interval = COLOR_INTERVAL;
+		else if(strips[i].mode == RGB_STRIP_RAINBOW) interval = RAINBOW_INTERVAL;
+
+		if(HAL_GetTick() < strips[i].last_update + interval) continue;
+
+		// the buffer is read during a frame, wait for it before rendering
+		while(state[i] != STATE_INIT);
+		render(i);
+		update(i);
 	}
+
+	PROFILE_STOP(PROFILE_RGB_STRIP_TASK);
 }
 
 //------------------------------------------------------------------------------
@@ -278,27 +532,95 @@ static void dma_init(uint8_t strip, DMA_Channel_TypeDef *channel)
 	__HAL_LINKDMA(&htims[strip], hdma[TIM_DMA_ID_UPDATE], hdmas[strip]);
 }
 
-// Set strip buffer to an RGB color value
+// Set strip buffer to an RGB color value and send it
 static void set_rgb(uint8_t strip, uint8_t r, uint8_t g, uint8_t b)
 {
-	if(strip >= RGB_NUM_STRIPS) return;
+	if(strip >= num_strips) return;
 
-	for(size_t i = 0; i < RGB_NUM_LEDS * BYTES_PER_LED; i += BYTES_PER_LED)
-	{
+	// the buffer is read during a frame, wait for it before filling
+	while(state[strip] != STATE_INIT);
+	fill(strip, r, g, b);
+	update(strip);
+}
+
+// Set strip buffer to an RGB color value
+static void fill(uint8_t strip, uint8_t r, uint8_t g, uint8_t b)
+{
+#ifdef PALETTE
+
+	// the host's palette and indices are left for when the strip goes back to indexed mode
+	set_grb(palettes[strip][SOLID_ENTRY], r, g, b);
+	solid[strip] = true;
+
+#else
+
+	for(size_t i = 0; i < num_leds[strip] * BYTES_PER_LED; i += BYTES_PER_LED) set_grb(&buffer[strip][i], r, g, b);
+
+#endif // PALETTE
+}
+
+// Write an RGB color value in the strip's byte order
+static void set_grb(uint8_t *dst, uint8_t r, uint8_t g, uint8_t b)
+{
 #ifdef FORMAT_GRB
-		buffer[strip][i + 0] = g;
-		buffer[strip][i + 1] = r;
-		buffer[strip][i + 2] = b;
+	dst[0] = g;
+	dst[1] = r;
+	dst[2] = b;
 #endif
+}
+
+// Fill strip buffer for its mode, rainbow steps the color wheel
+static void render(uint8_t strip)
+{
+	rgb_strip_t *s = &strips[strip];
+
+	if(s->mode == RGB_STRIP_COLOR)
+	{
+		fill(strip, s->red, s->green, s->blue);
 	}
+	else if(s->mode == RGB_STRIP_RAINBOW)
+	{
+		uint8_t wheel = 255 - s->wheel;
 
-	update(strip);
+		if(wheel < 85)
+		{
+			fill(strip, 255 - wheel * 3, 0, wheel * 3);
+		}
+		else if(wheel < 170)
+		{
+			wheel -= 85;
+			fill(strip, 0, wheel * 3, 255 - wheel * 3);
+		}
+		else
+		{
+			wheel -= 170;
+			fill(strip, wheel * 3, 255 - wheel * 3, 0);
+		}
+
+		s->wheel++;
+	}
+	else if(s->mode == RGB_STRIP_INDEXED)
+	{
+		// the framebuffer is written by rgb_strip_set_pixels()
+
+#ifdef PALETTE
+
+		solid[strip] = false;
+
+#endif // PALETTE
+	}
+	else
+	{
+		fill(strip, 0, 0, 0);
+	}
+
+	s->last_update = HAL_GetTick();
 }
 
 // Send color data to the RGB strips
 static void update(uint8_t strip)
 {
-	if(strip >= RGB_NUM_STRIPS) return;
+	if(strip >= num_strips || num_leds[strip] == 0) return;
 
 	// wait for the current update to complete
 	while(state[strip] != STATE_INIT);
@@ -307,58 +629,151 @@ static void update(uint8_t strip)
 	for(size_t i = 0; i < (2 * 8 * BYTES_PER_LED); i++) dma_buffer[strip][i] = 0;
 
 	// move to start reset state and start DMA transfer
+	retries[strip] = 0;
+	reset_laps_left[strip] = reset_laps - 1;
 	state[strip] = STATE_START_RESET;
 	HAL_TIM_PWM_Start_DMA(&htims[strip], TIM_CHANNEL_1, (uint32_t *)dma_buffer[strip], 2 * 8 * BYTES_PER_LED);
 }
 
 // Load a single LED's data into the dma buffer
-static void load_next_led(uint8_t strip, uint8_t index, dma_buffer_half_t half)
+CCM_FUNC static void load_next_led(uint8_t strip, uint8_t index, dma_buffer_half_t half)
 {
-	if(index >= RGB_NUM_LEDS) return;
+	if(index >= num_leds[strip]) return;
+
+	PROFILE_START(PROFILE_LOAD_NEXT_LED);
+
+	volatile uint16_t *dst = &dma_buffer[strip][half ? 8 * BYTES_PER_LED : 0];
+
+#ifdef PALETTE
+	// expand the LED's palette index to GRB
+	const uint8_t *src = palettes[strip][solid[strip] ? SOLID_ENTRY : get_index(strip, index)];
+#else
+	const uint8_t *src = &buffer[strip][index * BYTES_PER_LED];
+#endif // PALETTE
 
 	for(size_t byte = 0; byte < BYTES_PER_LED; byte++)
 	{
-		dma_buffer[strip][(half ? 8 * BYTES_PER_LED : 0) + byte * 8 + 0] = (buffer[strip][index * BYTES_PER_LED + byte] & (1 << 7)) ? timer_ccr_one : timer_ccr_zero;
-		dma_buffer[strip][(half ? 8 * BYTES_PER_LED : 0) + byte * 8 + 1] = (buffer[strip][index * BYTES_PER_LED + byte] & (1 << 6)) ? timer_ccr_one : timer_ccr_zero;
-		dma_buffer[strip][(half ? 8 * BYTES_PER_LED : 0) + byte * 8 + 2] = (buffer[strip][index * BYTES_PER_LED + byte] & (1 << 5)) ? timer_ccr_one : timer_ccr_zero;
-		dma_buffer[strip][(half ? 8 * BYTES_PER_LED : 0) + byte * 8 + 3] = (buffer[strip][index * BYTES_PER_LED + byte] & (1 << 4)) ? timer_ccr_one : timer_ccr_zero;
-		dma_buffer[strip][(half ? 8 * BYTES_PER_LED : 0) + byte * 8 + 4] = (buffer[strip][index * BYTES_PER_LED + byte] & (1 << 3)) ? timer_ccr_one : timer_ccr_zero;
-		dma_buffer[strip][(half ? 8 * BYTES_PER_LED : 0) + byte * 8 + 5] = (buffer[strip][index * BYTES_PER_LED + byte] & (1 << 2)) ? timer_ccr_one : timer_ccr_zero;
-		dma_buffer[strip][(half ? 8 * BYTES_PER_LED : 0) + byte * 8 + 6] = (buffer[strip][index * BYTES_PER_LED + byte] & (1 << 1)) ? timer_ccr_one : timer_ccr_zero;
-		dma_buffer[strip][(half ? 8 * BYTES_PER_LED : 0) + byte * 8 + 7] = (buffer[strip][index * BYTES_PER_LED + byte] & (1 << 0)) ? timer_ccr_one : timer_ccr_zero;
+		const uint16_t *high = nibble_lut[src[byte] >> 4];
+		const uint16_t *low = nibble_lut[src[byte] & 0xF];
+
+		dst[byte * 8 + 0] = high[0];
+		dst[byte * 8 + 1] = high[1];
+		dst[byte * 8 + 2] = high[2];
+		dst[byte * 8 + 3] = high[3];
+		dst[byte * 8 + 4] = low[0];
+		dst[byte * 8 + 5] = low[1];
+		dst[byte * 8 + 6] = low[2];
+		dst[byte * 8 + 7] = low[3];
 	}
+
+	PROFILE_STOP(PROFILE_LOAD_NEXT_LED);
+}
+
+#ifdef PALETTE
+
+// Get an LED's palette index, indices are packed MSB first
+CCM_FUNC static uint8_t get_index(uint8_t strip, uint8_t led)
+{
+	uint8_t depth = depths[strip];
+	uint16_t bit = led * depth;
+	return (buffer[strip][bit >> 3] >> (8 - depth - (bit & 7))) & ((1 << depth) - 1);
+}
+
+// Set an LED's palette index
+static void set_index(uint8_t strip, uint8_t led, uint8_t value)
+{
+	uint8_t depth = depths[strip];
+	uint16_t bit = led * depth;
+	uint8_t shift = 8 - depth - (bit & 7);
+	uint8_t mask = ((1 << depth) - 1) << shift;
+	buffer[strip][bit >> 3] = (buffer[strip][bit >> 3] & ~mask) | ((value << shift) & mask);
+}
+
+// Send a frame of an indexed strip now, or hold off the periodic resend while it's being written
+static void show_indexed(uint8_t strip, bool show)
+{
+	solid[strip] = false;
+	strips[strip].last_update = HAL_GetTick();
+	if(show) update(strip);
+}
+
+#endif // PALETTE
+
+// Load LED n+2 into a buffer half and check that DMA hasn't already wrapped onto it
+CCM_FUNC static void refill(uint8_t strip, dma_buffer_half_t half)
+{
+	if(led_index[strip] + 2 >= num_leds[strip]) return;
+
+	load_next_led(strip, led_index[strip] + 2, half);
+
+	/*
+		CNDTR counts down from 2 * 8 * BYTES_PER_LED and reloads on wrap, so DMA
+		is reading the first half while more than half of the transfers remain.
+		If DMA is already in the half we just wrote, part of that LED went out
+		with stale data. This catches refills up to one full buffer lap late.
+	*/
+	bool dma_in_first_half = __HAL_DMA_GET_COUNTER(&hdmas[strip]) > 8 * BYTES_PER_LED;
+	if((half == BUF_FIRST_HALF) != dma_in_first_half) return;
+
+	stats[strip].underruns++;
+
+#if RGB_UNDERRUN_RETRIES > 0
+
+	// abort the frame, it is resent after the end reset pulse
+	if(retries[strip] < RGB_UNDERRUN_RETRIES)
+	{
+		retry_pending[strip] = true;
+		start_end_reset(strip);
+	}
+
+#endif // RGB_UNDERRUN_RETRIES
+}
+
+// Stop sending data and start the end reset pulse
+CCM_FUNC static void start_end_reset(uint8_t strip)
+{
+	HAL_TIM_PWM_Stop_DMA(&htims[strip], TIM_CHANNEL_1);
+
+	// set dma buffer to reset pulse (timer cc reg = 0)
+	for(size_t i = 0; i < (2 * 8 * BYTES_PER_LED); i++) dma_buffer[strip][i] = 0;
+
+	// move to end reset state and start DMA transfer
+	reset_laps_left[strip] = reset_laps - 1;
+	state[strip] = STATE_END_RESET;
+	HAL_TIM_PWM_Start_DMA(&htims[strip], TIM_CHANNEL_1, (uint32_t *)dma_buffer[strip], 2 * 8 * BYTES_PER_LED);
 }
 
 // Process state machine when DMA transfer is half complete
-static void dma_process_halfcomplete(uint8_t strip)
+CCM_FUNC static void dma_process_halfcomplete(uint8_t strip)
 {
 	if(state[strip] == STATE_DATA)
 	{
 		(led_index[strip])++;
 
 		// stop dma if we've sent all leds, otherwise load next led
-		if(led_index[strip] >= RGB_NUM_LEDS)
+		if(led_index[strip] >= num_leds[strip])
 		{
 			// data complete
-			HAL_TIM_PWM_Stop_DMA(&htims[strip], TIM_CHANNEL_1);
-
-			// set dma buffer to reset pulse (timer cc reg = 0)
-			for(size_t i = 0; i < (2 * 8 * BYTES_PER_LED); i++) dma_buffer[strip][i] = 0;
-
-			// move to end reset state and start DMA transfer
-			state[strip] = STATE_END_RESET;
-			HAL_TIM_PWM_Start_DMA(&htims[strip], TIM_CHANNEL_1, (uint32_t *)dma_buffer[strip], 2 * 8 * BYTES_PER_LED);
+			stats[strip].frames++;
+			start_end_reset(strip);
 		}
 		else
 		{
-			load_next_led(strip, led_index[strip] + 2, BUF_FIRST_HALF);
+			refill(strip, BUF_FIRST_HALF);
 		}
 	}
 }
 
 // Process state machine when DMA transfer is complete
-static void dma_process_complete(uint8_t strip)
+CCM_FUNC static void dma_process_complete(uint8_t strip)
 {
+	// long reset pulses take more than one lap of the zeroed buffer
+	if(state[strip] != STATE_DATA && reset_laps_left[strip])
+	{
+		reset_laps_left[strip]--;
+		return;
+	}
+
 	if(state[strip] == STATE_START_RESET)
 	{
 		// start reset pulse complete
@@ -372,27 +787,31 @@ static void dma_process_complete(uint8_t strip)
 		// move to data state and start DMA transfer
 		state[strip] = STATE_DATA;
 		HAL_TIM_PWM_Start_DMA(&htims[strip], TIM_CHANNEL_1, (uint32_t *)dma_buffer[strip], 2 * 8 * BYTES_PER_LED);
+
+#ifdef TRACE
+
+		if(traces[strip].pending)
+		{
+			trace_record(traces[strip].cmd, TRACE_LED_DATA, traces[strip].timestamp);
+			traces[strip].pending = false;
+		}
+
+#endif // TRACE
 	}
 	else if(state[strip] == STATE_DATA)
 	{
 		(led_index[strip])++;
 
 		// stop dma if we've sent all leds, otherwise load next led
-		if(led_index[strip] >= RGB_NUM_LEDS)
+		if(led_index[strip] >= num_leds[strip])
 		{
 			// data complete
-			HAL_TIM_PWM_Stop_DMA(&htims[strip], TIM_CHANNEL_1);
-
-			// set dma buffer to reset pulse (timer cc reg = 0)
-			for(size_t i = 0; i < (2 * 8 * BYTES_PER_LED); i++) dma_buffer[strip][i] = 0;
-
-			// move to end reset state and start DMA transfer
-			state[strip] = STATE_END_RESET;
-			HAL_TIM_PWM_Start_DMA(&htims[strip], TIM_CHANNEL_1, (uint32_t *)dma_buffer[strip], 2 * 8 * BYTES_PER_LED);
+			stats[strip].frames++;
+			start_end_reset(strip);
 		}
 		else
 		{
-			load_next_led(strip, led_index[strip] + 2, BUF_SECOND_HALF);
+			refill(strip, BUF_SECOND_HALF);
 		}
 	}
 	else if(state[strip] == STATE_END_RESET)
@@ -400,8 +819,22 @@ static void dma_process_complete(uint8_t strip)
 		// end reset pulse complete
 		HAL_TIM_PWM_Stop_DMA(&htims[strip], TIM_CHANNEL_1);
 
-		// reset state machine
-		state[strip] = STATE_INIT;
+		if(retry_pending[strip])
+		{
+			// resend the aborted frame, dma buffer still holds a reset pulse
+			retry_pending[strip] = false;
+			retries[strip]++;
+			stats[strip].retries++;
+
+			reset_laps_left[strip] = reset_laps - 1;
+			state[strip] = STATE_START_RESET;
+			HAL_TIM_PWM_Start_DMA(&htims[strip], TIM_CHANNEL_1, (uint32_t *)dma_buffer[strip], 2 * 8 * BYTES_PER_LED);
+		}
+		else
+		{
+			// reset state machine
+			state[strip] = STATE_INIT;
+		}
 	}
 }
 
@@ -411,8 +844,10 @@ static void dma_process_complete(uint8_t strip)
 //------------------------------------------------------------------------------
 
 // RGB1 DMA Half Complete / Transfer Complete ISR
-void DMA1_Channel3_IRQHandler(void)
+CCM_FUNC void DMA1_Channel3_IRQHandler(void)
 {
+	PROFILE_START(PROFILE_RGB1_DMA_ISR);
+
 	if(__HAL_DMA_GET_FLAG(&hdmas[0], DMA_FLAG_HT3))
 	{
 		// DMA transfer half complete
@@ -425,11 +860,15 @@ void DMA1_Channel3_IRQHandler(void)
 	}
 
 	HAL_DMA_IRQHandler(&hdmas[0]);
+
+	PROFILE_STOP(PROFILE_RGB1_DMA_ISR);
 }
 
 // RGB2 DMA Half Complete / Transfer Complete ISR
-void DMA1_Channel1_IRQHandler(void)
+CCM_FUNC void DMA1_Channel1_IRQHandler(void)
 {
+	PROFILE_START(PROFILE_RGB2_DMA_ISR);
+
 	if(__HAL_DMA_GET_FLAG(&hdmas[1], DMA_FLAG_HT1))
 	{
 		// DMA transfer half complete
@@ -442,4 +881,6 @@ void DMA1_Channel1_IRQHandler(void)
 	}
 
 	HAL_DMA_IRQHandler(&hdmas[1]);
+
+	PROFILE_STOP(PROFILE_RGB2_DMA_ISR);
 }
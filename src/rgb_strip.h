@@ -11,6 +11,9 @@
 // Includes
 //------------------------------------------------------------------------------
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "config.h"
 
 
@@ -18,13 +21,38 @@
 // Definitions
 //------------------------------------------------------------------------------
 
+// Strip byte flag of Palette and Pixels commands, send a frame after the write
+#define RGB_STRIP_SHOW			0x80
+
+// Strip byte field of Pixels commands, how the indices are encoded
+#define RGB_PIXELS_ENCODING		0x60
+#define RGB_PIXELS_PACKED		0x00	// indices packed MSB first
+#define RGB_PIXELS_RLE			0x20	// [count, index] runs
+#define RGB_PIXELS_XOR			0x40	// [count, index] runs XORed onto the LEDs
+
 typedef enum
 {
 	RGB_STRIP_DISABLED = 0,
 	RGB_STRIP_COLOR = 1,
 	RGB_STRIP_RAINBOW = 2,
+	RGB_STRIP_INDEXED = 3,
 } rgb_strip_mode_t;
 
+typedef struct
+{
+	uint8_t mode;			// rgb_strip_mode_t
+	uint8_t red;
+	uint8_t green;
+	uint8_t blue;
+} rgb_strip_setting_t;
+
+typedef struct
+{
+	uint32_t frames;		// frames sent
+	uint32_t underruns;		// DMA buffer refills that finished too late
+	uint32_t retries;		// frames resent after an underrun
+} rgb_strip_stats_t;
+
 
 //------------------------------------------------------------------------------
 // Public Functions
@@ -35,6 +63,35 @@ void rgb_strip_deinit(void);
 void rgb_strip_disable(uint8_t strip);
 void rgb_strip_set_color(uint8_t strip, uint8_t r, uint8_t g, uint8_t b);
 void rgb_strip_set_rainbow(uint8_t strip);
+void rgb_strip_get(uint8_t strip, rgb_strip_setting_t *setting);
+void rgb_strip_apply(const rgb_strip_setting_t *settings);
+void rgb_strip_get_stats(uint8_t strip, rgb_strip_stats_t *stats);
+
+#ifdef PALETTE
+
+bool rgb_strip_set_depth(uint8_t strip, uint8_t depth);
+uint8_t rgb_strip_get_depth(uint8_t strip);
+void rgb_strip_set_palette(uint8_t strip, uint8_t first, const uint8_t *colors, uint8_t count, bool show);
+void rgb_strip_set_pixels(uint8_t strip, uint8_t first, const uint8_t *indices, uint8_t len, bool show);
+void rgb_strip_set_runs(uint8_t strip, uint8_t first, const uint8_t *runs, uint8_t len, bool xor, bool show);
+uint8_t rgb_strip_get_leds(uint8_t strip);
+void rgb_strip_begin(uint8_t mask);
+void rgb_strip_set_index(uint8_t strip, uint8_t led, uint8_t index);
+void rgb_strip_show(uint8_t mask);
+
+#endif // PALETTE
+
+
+#ifdef TRACE
+
+void rgb_strip_trace(uint8_t strip, uint8_t cmd, uint32_t timestamp);
+
+#else
+
+#define rgb_strip_trace(strip, cmd, timestamp)
+
+#endif // TRACE
+
 void rgb_strip_task(void);
 
 
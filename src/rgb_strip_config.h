@@ -7,15 +7,19 @@
 #define ATLC_RGB_STRIP_CONFIG_H
 
 
-#ifdef RGB_WS2812B
-
+// Chip types, RGB_CHIP in config.h selects the default
+#define RGB_CHIP_WS2812B	0
+#define RGB_CHIP_SK6812		1
+#define RGB_NUM_CHIPS		2
+
+// Period, one pulse, zero pulse and reset pulse for each chip type, ns
+#define RGB_CHIP_TIMINGS { \
+	{1250, 800, 400, 50000},	/* WS2812B */ \
+	{1250, 600, 300, 80000}		/* SK6812 */ \
+}
+
+// All supported chips take GRB data
 #define FORMAT_GRB
-#define PERIOD			1250	// ns
-#define ONE_PULSE		800		// ns
-#define ZERO_PULSE		400		// ns
-#define RESET_PULSE		50000	// ns, multiple of PERIOD
-
-#endif // RGB_WS2812B
 
 
 #ifdef FORMAT_GRB
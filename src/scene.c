@@ -0,0 +1,89 @@
+//==============================================================================
+// Scene Presets
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "can.h"
+#include "config.h"
+#include "gpio.h"
+#include "rgb_strip.h"
+#include "scene.h"
+#include "store.h"
+#include "trace.h"
+
+
+#ifdef SCENES
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+_Static_assert(STORE_KEY_SCENE + SCENE_MAX <= STORE_NUM_KEYS, "SCENE_MAX slots don't fit in the config store");
+_Static_assert(sizeof(scene_t) <= STORE_VALUE_MAX, "A scene doesn't fit in a config store value");
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Save the current outputs in output_mask and strip modes to a slot
+bool scene_save(uint8_t slot, uint8_t output_mask)
+{
+	if(slot >= SCENE_MAX) return false;
+
+	scene_t scene = {0};
+	scene.output_mask = output_mask;
+	scene.outputs = gpio_read_outputs() & output_mask;
+
+#ifdef RGB_STRIP
+
+	for(uint8_t i = 0; i < RGB_NUM_STRIPS; i++) rgb_strip_get(i, &scene.strips[i]);
+
+#endif // RGB_STRIP
+
+	return store_set(STORE_KEY_SCENE + slot, (const uint8_t *)&scene, sizeof(scene));
+}
+
+// Apply a saved scene, false if the slot is empty
+bool scene_recall(uint8_t slot, uint32_t timestamp)
+{
+	if(slot >= SCENE_MAX) return false;
+
+	scene_t scene;
+	if(store_get(STORE_KEY_SCENE + slot, (uint8_t *)&scene, sizeof(scene)) != sizeof(scene)) return false;
+
+#ifdef RGB_STRIP
+
+	for(uint8_t i = 0; i < RGB_NUM_STRIPS; i++) rgb_strip_trace(i, CAN_CMD_SCENE, timestamp);
+	rgb_strip_apply(scene.strips);
+
+#endif // RGB_STRIP
+
+	// outputs switch as the strip frames start, except those owned by a truth table or PWM
+	uint8_t mask = scene.output_mask & ~gpio_reserved_outputs();
+	if(mask)
+	{
+		gpio_update_outputs(scene.outputs, mask);
+		trace_record(CAN_CMD_SCENE, TRACE_GPIO_WRITE, timestamp);
+	}
+
+	return true;
+}
+
+// Remove a saved scene
+bool scene_delete(uint8_t slot)
+{
+	if(slot >= SCENE_MAX) return false;
+
+	uint8_t none = 0;
+	return store_set(STORE_KEY_SCENE + slot, &none, 0);
+}
+
+#endif // SCENES
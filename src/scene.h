@@ -0,0 +1,62 @@
+//==============================================================================
+// Scene Presets
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_SCENE_H
+#define ATLC_SCENE_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "rgb_strip.h"
+#include "store.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	A scene is a snapshot of the outputs and strip modes, kept in the config
+	store with one key per slot. Store values are cached in RAM, so a recall
+	is a copy out of RAM: it waits for strip frames in flight, starts the
+	new frames on all strips together and writes the outputs with them.
+*/
+
+#if defined(SCENES) && !defined(CONFIG_STORE)
+#error "SCENES needs CONFIG_STORE"
+#endif
+
+#define SCENE_OP_RECALL		0
+#define SCENE_OP_SAVE		1
+#define SCENE_OP_DELETE		2
+
+typedef struct
+{
+	uint8_t output_mask;	// outputs the scene sets, others are left alone
+	uint8_t outputs;
+	rgb_strip_setting_t strips[RGB_NUM_STRIPS];
+} scene_t;
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+#ifdef SCENES
+
+bool scene_save(uint8_t slot, uint8_t output_mask);
+bool scene_recall(uint8_t slot, uint32_t timestamp);
+bool scene_delete(uint8_t slot);
+
+#endif // SCENES
+
+
+#endif // ATLC_SCENE_H
@@ -0,0 +1,223 @@
+//==============================================================================
+// Strip Segments
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stm32f3xx_hal.h>
+
+#include "config.h"
+#include "profile.h"
+#include "rgb_strip.h"
+#include "segment.h"
+
+
+#ifdef SEGMENTS
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+#define CANVAS_SIZE		(RGB_NUM_STRIPS * RGB_NUM_LEDS)
+
+_Static_assert(CANVAS_SIZE <= 256, "Segments address the canvas with 8-bit LED numbers");
+
+typedef struct
+{
+	uint8_t strip;
+	uint8_t led;
+	uint8_t segment;		// SEGMENT_NONE if no segment covers the LED
+	uint8_t position;		// in the segment's effect, after reverse and mirror
+} canvas_led_t;
+
+
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static void build(void);
+static void render(uint8_t strips);
+static uint8_t effect(uint8_t index, uint8_t position);
+static uint8_t indexed_strips(void);
+
+
+//------------------------------------------------------------------------------
+// Private Variables
+//------------------------------------------------------------------------------
+
+static segment_t segments[SEGMENT_MAX];
+static uint16_t steps[SEGMENT_MAX];
+static uint32_t last_step[SEGMENT_MAX];
+
+static canvas_led_t canvas[CANVAS_SIZE];
+static uint16_t canvas_len;
+static uint8_t covered;		// strips with a segment on them
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Set a segment and draw it, switching its strips to indexed mode; the off effect removes it
+void segment_set(uint8_t index, const segment_t *segment)
+{
+	if(index >= SEGMENT_MAX || segment->effect >= SEGMENT_NUM_EFFECTS) return;
+	if(segment->effect != SEGMENT_OFF && segment->length == 0) return;
+
+	segments[index] = *segment;
+	steps[index] = 0;
+	last_step[index] = HAL_GetTick();
+
+	uint8_t claimed = covered & indexed_strips();
+	build();
+
+	// strips this segment covers are taken over, the others are only redrawn if they're still indexed
+	for(size_t i = 0; i < canvas_len; i++)
+	{
+		if(canvas[i].segment == index) claimed |= 1 << canvas[i].strip;
+	}
+
+	render(claimed & covered);
+}
+
+// Get a segment, false if the index is out of range
+bool segment_get(uint8_t index, segment_t *segment)
+{
+	if(index >= SEGMENT_MAX) return false;
+
+	*segment = segments[index];
+	return true;
+}
+
+// Step segment effects and redraw the canvas when any has moved
+void segment_task(void)
+{
+	if(!covered) return;
+
+	bool stepped = false;
+	uint32_t now = HAL_GetTick();
+
+	for(size_t i = 0; i < SEGMENT_MAX; i++)
+	{
+		if(segments[i].effect == SEGMENT_OFF || segments[i].speed == 0) continue;
+		if(now - last_step[i] < (uint32_t)segments[i].speed * SEGMENT_TICK) continue;
+
+		steps[i]++;
+		last_step[i] = now;
+		stepped = true;
+	}
+
+	// a strip switched to another mode since keeps it
+	if(stepped) render(covered & indexed_strips());
+}
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Map each canvas LED to its strip LED and the segment drawn on it, later segments win
+static void build(void)
+{
+	canvas_len = 0;
+	for(uint8_t strip = 0; strip < RGB_NUM_STRIPS; strip++)
+	{
+		for(uint8_t led = 0; led < rgb_strip_get_leds(strip); led++)
+		{
+			canvas[canvas_len].strip = strip;
+			canvas[canvas_len].led = led;
+			canvas[canvas_len].segment = SEGMENT_NONE;
+			canvas_len++;
+		}
+	}
+
+	covered = 0;
+	for(uint8_t i = 0; i < SEGMENT_MAX; i++)
+	{
+		const segment_t *segment = &segments[i];
+		if(segment->effect == SEGMENT_OFF) continue;
+
+		uint8_t span = (segment->flags & SEGMENT_MIRROR) ? (segment->length + 1) / 2 : segment->length;
+
+		for(uint16_t j = 0; j < segment->length && segment->start + j < canvas_len; j++)
+		{
+			uint8_t position = j < span ? j : segment->length - 1 - j;
+			if(segment->flags & SEGMENT_REVERSE) position = span - 1 - position;
+
+			canvas_led_t *led = &canvas[segment->start + j];
+			led->segment = i;
+			led->position = position;
+			covered |= 1 << led->strip;
+		}
+	}
+}
+
+// Draw every segment on the given strips in one pass and send their frames together
+static void render(uint8_t strips)
+{
+	if(!strips) return;
+
+	PROFILE_START(PROFILE_SEGMENT_RENDER);
+
+	rgb_strip_begin(strips);
+
+	for(size_t i = 0; i < canvas_len; i++)
+	{
+		const canvas_led_t *led = &canvas[i];
+		if(led->segment == SEGMENT_NONE || !(strips & (1 << led->strip))) continue;
+
+		rgb_strip_set_index(led->strip, led->led, effect(led->segment, led->position));
+	}
+
+	rgb_strip_show(strips);
+
+	PROFILE_STOP(PROFILE_SEGMENT_RENDER);
+}
+
+// Palette index a segment's effect draws at a position
+static uint8_t effect(uint8_t index, uint8_t position)
+{
+	const segment_t *segment = &segments[index];
+	uint8_t span = (segment->flags & SEGMENT_MIRROR) ? (segment->length + 1) / 2 : segment->length;
+	uint16_t step = steps[index];
+
+	switch(segment->effect)
+	{
+		case SEGMENT_SWEEP:
+		{
+			// spread a..b over the span, b < a runs the palette backwards
+			int16_t range = segment->b - segment->a;
+			uint8_t offset = (position + step) % span;
+			return segment->a + range * offset / (span > 1 ? span - 1 : 1);
+		}
+
+		case SEGMENT_CHASE:
+			return position == step % span ? segment->b : segment->a;
+
+		case SEGMENT_BLINK:
+			return (step & 1) ? segment->b : segment->a;
+
+		default:
+			return segment->a;
+	}
+}
+
+// Strips currently in indexed mode
+static uint8_t indexed_strips(void)
+{
+	uint8_t strips = 0;
+	for(uint8_t strip = 0; strip < RGB_NUM_STRIPS; strip++)
+	{
+		rgb_strip_setting_t setting;
+		rgb_strip_get(strip, &setting);
+		if(setting.mode == RGB_STRIP_INDEXED) strips |= 1 << strip;
+	}
+	return strips;
+}
+
+#endif // SEGMENTS
@@ -0,0 +1,82 @@
+//==============================================================================
+// Strip Segments
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_SEGMENT_H
+#define ATLC_SEGMENT_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	The strips are laid end to end as one virtual canvas, strip 0's LEDs
+	first. A segment is a span of the canvas, so it can be part of a strip
+	or run on from one strip onto the next, and it draws its own effect in
+	palette indices. Reverse runs the effect from the segment's end, and
+	mirror draws the first half and reflects it onto the second.
+
+	Whenever segments change, a table is built that maps each canvas LED to
+	its strip and LED and to the segment and effect position drawn there.
+	All segments are then drawn in one pass over the table, and their
+	effects step on the node with no CAN traffic.
+*/
+
+#if defined(SEGMENTS) && !defined(PALETTE)
+#error "SEGMENTS needs PALETTE"
+#endif
+
+#define SEGMENT_NONE		0xFF
+
+// Segment flags
+#define SEGMENT_REVERSE		(1 << 0)
+#define SEGMENT_MIRROR		(1 << 1)
+
+typedef enum
+{
+	SEGMENT_OFF = 0,			// removes the segment, its LEDs are left as they are
+	SEGMENT_FILL = 1,			// every LED shows index a
+	SEGMENT_SWEEP = 2,			// indices a to b spread over the segment, scrolling
+	SEGMENT_CHASE = 3,			// one LED of index b moving over index a
+	SEGMENT_BLINK = 4,			// every LED alternates between index a and b
+	SEGMENT_NUM_EFFECTS
+} segment_effect_t;
+
+typedef struct
+{
+	uint8_t start;			// canvas LED
+	uint8_t length;
+	uint8_t flags;			// SEGMENT_REVERSE, SEGMENT_MIRROR
+	uint8_t effect;
+	uint8_t a;				// palette indices
+	uint8_t b;
+	uint8_t speed;			// SEGMENT_TICK ms per effect step, 0 holds it still
+} segment_t;
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+#ifdef SEGMENTS
+
+void segment_set(uint8_t index, const segment_t *segment);
+bool segment_get(uint8_t index, segment_t *segment);
+void segment_task(void);
+
+#endif // SEGMENTS
+
+
+#endif // ATLC_SEGMENT_H
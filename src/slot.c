@@ -0,0 +1,193 @@
+//==============================================================================
+// Firmware Slots
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stm32f3xx_hal.h>
+
+#include "crc.h"
+#include "slot.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+#define RECORD_SIZE			sizeof(boot_record_t)
+#define RECORDS_PER_PAGE	(SLOT_PAGE_SIZE / RECORD_SIZE)
+#define ERASED				0xFFFFFFFF
+
+#define record_address(page, index)	(BOOT_RECORD_ADDRESS + (page) * SLOT_PAGE_SIZE + (index) * RECORD_SIZE)
+
+// RAM the initial stack pointer has to be in
+#define STACK_MIN			0x20000000
+#define STACK_MAX			0x20010000
+
+
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static bool find_record(boot_record_t *record, uint8_t *page);
+static int free_record(uint8_t page);
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Return the flash address of a slot
+uint32_t slot_address(uint8_t slot)
+{
+	return slot == SLOT_B ? SLOT_B_ADDRESS : SLOT_A_ADDRESS;
+}
+
+// Return the slot this image runs from, SLOT_NONE without the bootloader
+uint8_t slot_running(void)
+{
+	uint32_t vectors = (uint32_t)g_pfnVectors;
+	if(vectors == SLOT_A_ADDRESS) return SLOT_A;
+	if(vectors == SLOT_B_ADDRESS) return SLOT_B;
+	return SLOT_NONE;
+}
+
+// Check that a slot's vector table points into RAM and the slot
+bool slot_bootable(uint8_t slot)
+{
+	if(slot >= SLOT_NUM_SLOTS) return false;
+
+	const volatile uint32_t *vectors = (const volatile uint32_t *)slot_address(slot);
+	uint32_t stack = vectors[0];
+	uint32_t reset = vectors[1] & ~1UL;
+
+	return stack > STACK_MIN && stack <= STACK_MAX
+		&& reset >= slot_address(slot) && reset < slot_address(slot) + SLOT_SIZE;
+}
+
+// CRC-32 of the first size bytes of a slot
+uint32_t slot_crc(uint8_t slot, uint32_t size)
+{
+	if(size > SLOT_SIZE) size = SLOT_SIZE;
+	return crc32_update(CRC32_INIT, (const uint8_t *)slot_address(slot), size) ^ CRC32_XOROUT;
+}
+
+// Erase the pages of a slot that size bytes from offset fall in
+bool slot_erase(uint8_t slot, uint32_t offset, uint32_t size)
+{
+	if(slot >= SLOT_NUM_SLOTS || offset > SLOT_SIZE || size > SLOT_SIZE - offset) return false;
+	if(size == 0) return true;
+
+	uint32_t first = offset / SLOT_PAGE_SIZE;
+	uint32_t last = (offset + size - 1) / SLOT_PAGE_SIZE;
+
+	FLASH_EraseInitTypeDef erase = {0};
+	erase.TypeErase = FLASH_TYPEERASE_PAGES;
+	erase.PageAddress = slot_address(slot) + first * SLOT_PAGE_SIZE;
+	erase.NbPages = last - first + 1;
+
+	uint32_t page_error;
+	HAL_FLASH_Unlock();
+	bool ok = HAL_FLASHEx_Erase(&erase, &page_error) == HAL_OK;
+	HAL_FLASH_Lock();
+
+	return ok;
+}
+
+// Read the current boot record, false if there is none
+bool slot_read_record(boot_record_t *record)
+{
+	uint8_t page;
+	return find_record(record, &page);
+}
+
+// Append a boot record, its sequence is set to follow the current one
+bool slot_write_record(boot_record_t *record)
+{
+	boot_record_t current;
+	uint8_t page = 0;
+	record->sequence = find_record(&current, &page) ? current.sequence + 1 : 1;
+
+	HAL_FLASH_Unlock();
+
+	// a full page moves on to the other one, which has the older records
+	bool ok = true;
+	int index = free_record(page);
+	if(index < 0)
+	{
+		page = (page + 1) % BOOT_RECORD_PAGES;
+		index = 0;
+
+		FLASH_EraseInitTypeDef erase = {0};
+		erase.TypeErase = FLASH_TYPEERASE_PAGES;
+		erase.PageAddress = record_address(page, 0);
+		erase.NbPages = 1;
+
+		uint32_t page_error;
+		ok = HAL_FLASHEx_Erase(&erase, &page_error) == HAL_OK;
+	}
+
+	// the sequence goes last, it makes the record valid
+	uint32_t address = record_address(page, index);
+	const uint32_t *words = (const uint32_t *)record;
+	for(size_t i = 1; ok && i < RECORD_SIZE / 4; i++)
+	{
+		ok = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address + i * 4, words[i]) == HAL_OK;
+	}
+
+	ok = ok && HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address, words[0]) == HAL_OK;
+
+	HAL_FLASH_Lock();
+	return ok;
+}
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Find the record with the highest sequence and the page it is in
+static bool find_record(boot_record_t *record, uint8_t *page)
+{
+	bool found = false;
+
+	for(uint8_t p = 0; p < BOOT_RECORD_PAGES; p++)
+	{
+		for(size_t i = 0; i < RECORDS_PER_PAGE; i++)
+		{
+			const boot_record_t *candidate = (const boot_record_t *)record_address(p, i);
+
+			// a word is programmed low half first, a cut short sequence reads 0xFFFFxxxx
+			uint32_t sequence = candidate->sequence;
+			if((sequence >> 16) == 0xFFFF) continue;
+			if(found && sequence <= record->sequence) continue;
+
+			memcpy(record, candidate, RECORD_SIZE);
+			*page = p;
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+// Return the first erased record in a page, -1 if it is full
+static int free_record(uint8_t page)
+{
+	for(size_t i = 0; i < RECORDS_PER_PAGE; i++)
+	{
+		const volatile uint32_t *words = (const volatile uint32_t *)record_address(page, i);
+
+		bool erased = true;
+		for(size_t j = 0; j < RECORD_SIZE / 4; j++) erased = erased && words[j] == ERASED;
+		if(erased) return i;
+	}
+
+	return -1;
+}
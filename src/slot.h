@@ -0,0 +1,87 @@
+//==============================================================================
+// Firmware Slots
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_SLOT_H
+#define ATLC_SLOT_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	Flash layout with the bootloader:
+
+	0x08000000	16K		bootloader (src/boot)
+	0x08004000	240K	slot A
+	0x08040000	240K	slot B
+	0x0807C000	4K		boot records
+	0x0807E000	8K		config store (src/store.h)
+
+	Each slot holds a complete image linked for that slot's address, so
+	the image written by an update is the one built for the slot that
+	isn't running.
+
+	The boot records are an append-only log over 2 pages, the record with
+	the highest sequence is current. A record's sequence is programmed
+	last, so a record cut short by a reset is never used. When a page
+	fills, the next record starts the other page after erasing it.
+
+	The bootloader boots the confirmed slot. After an update, the trial
+	slot is booted once if its CRC checks out. The firmware confirms it
+	when told to, and a reset before that falls back to the confirmed
+	slot.
+*/
+
+#define SLOT_A				0
+#define SLOT_B				1
+#define SLOT_NUM_SLOTS		2
+#define SLOT_NONE			0xFF
+
+#define SLOT_A_ADDRESS		0x08004000
+#define SLOT_B_ADDRESS		0x08040000
+#define SLOT_SIZE			(240 * 1024)
+#define SLOT_PAGE_SIZE		2048
+
+#define BOOT_RECORD_ADDRESS	0x0807C000
+#define BOOT_RECORD_PAGES	2
+
+typedef struct
+{
+	uint32_t sequence;		// newest record wins, programmed last
+	uint8_t confirmed;		// slot known to run
+	uint8_t trial;			// slot to boot once, SLOT_NONE if none
+	uint8_t tries;			// boots of the trial slot so far
+	uint8_t reserved;
+	uint32_t trial_size;	// bytes checked against trial_crc before booting
+	uint32_t trial_crc;		// CRC-32
+} boot_record_t;
+
+// Vector table of the running image, from the startup file
+extern uint32_t g_pfnVectors[];
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+uint32_t slot_address(uint8_t slot);
+uint8_t slot_running(void);
+bool slot_bootable(uint8_t slot);
+uint32_t slot_crc(uint8_t slot, uint32_t size);
+bool slot_erase(uint8_t slot, uint32_t offset, uint32_t size);
+bool slot_read_record(boot_record_t *record);
+bool slot_write_record(boot_record_t *record);
+
+
+#endif // ATLC_SLOT_H
@@ -0,0 +1,85 @@
+//==============================================================================
+// Status LED
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stm32f3xx_hal.h>
+
+#include "config.h"
+#include "gpio.h"
+#include "status.h"
+
+
+//------------------------------------------------------------------------------
+// Private Variables
+//------------------------------------------------------------------------------
+
+static volatile uint16_t activity_time;		// ms until the LED comes back on
+static volatile uint16_t blink_steps;		// on/off phases left in a pattern, off when even
+static volatile uint16_t blink_time;		// ms left in the current phase
+static volatile uint16_t blink_period;
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Blink the LED off once for bus activity
+void status_activity(void)
+{
+	if(blink_steps) return;
+
+	HAL_GPIO_WritePin(STATUS_PORT, STATUS_PIN, GPIO_PIN_RESET);
+	activity_time = STATUS_BLINK_TIME;
+}
+
+// Blink the LED count times, off then on for period ms each
+void status_blink(uint8_t count, uint16_t period)
+{
+	if(count == 0 || period == 0) return;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	HAL_GPIO_WritePin(STATUS_PORT, STATUS_PIN, GPIO_PIN_RESET);
+	blink_period = period;
+	blink_time = period;
+	blink_steps = count * 2;
+	activity_time = 0;
+
+	__set_PRIMASK(primask);
+}
+
+// Stop any blinking and leave the LED to the caller
+void status_stop(void)
+{
+	blink_steps = 0;
+	activity_time = 0;
+}
+
+// Advance blinks -- called from SysTick every 1ms
+void status_tick(void)
+{
+	if(blink_steps)
+	{
+		if(--blink_time) return;
+
+		blink_steps--;
+		blink_time = blink_period;
+		// on for odd phases and once the pattern ends
+		bool on = (blink_steps & 1) || blink_steps == 0;
+		HAL_GPIO_WritePin(STATUS_PORT, STATUS_PIN, on ? GPIO_PIN_SET : GPIO_PIN_RESET);
+		return;
+	}
+
+	if(activity_time && --activity_time == 0)
+	{
+		HAL_GPIO_WritePin(STATUS_PORT, STATUS_PIN, GPIO_PIN_SET);
+	}
+}
@@ -0,0 +1,37 @@
+//==============================================================================
+// Status LED
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_STATUS_H
+#define ATLC_STATUS_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdint.h>
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	The status LED is on while running and blinks off for bus activity. Blinks
+	are timed from SysTick, so showing them never holds up the main loop.
+*/
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+void status_activity(void);
+void status_blink(uint8_t count, uint16_t period);
+void status_stop(void);
+void status_tick(void);
+
+
+#endif // ATLC_STATUS_H
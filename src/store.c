@@ -0,0 +1,309 @@
+//==============================================================================
+// Flash Config Store
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stm32f3xx_hal.h>
+
+#include "config.h"
+#include "crc.h"
+#include "debug.h"
+#include "store.h"
+
+
+#ifdef CONFIG_STORE
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+#define PAGE_MAGIC			0x53544F52	// "STOR"
+#define PAGE_HEADER_SIZE	8
+#define RECORD_HEADER_SIZE	4
+#define ERASED				0xFFFF
+
+#define page_address(page)	(STORE_ADDRESS + (page) * STORE_PAGE_SIZE)
+#define record_size(len)	(RECORD_HEADER_SIZE + (((len) + 1) & ~1))
+
+typedef struct
+{
+	uint8_t len;			// 0 if unset
+	uint8_t data[STORE_VALUE_MAX];
+} store_value_t;
+
+
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static uint32_t page_sequence(uint8_t page);
+static void load_page(void);
+static bool write_value(uint8_t key);
+static bool append(uint32_t address, uint8_t key, const uint8_t *data, uint8_t len);
+static bool compact(void);
+static bool erase_page(uint8_t page);
+static uint16_t record_crc(uint8_t key, const uint8_t *data, uint8_t len);
+
+
+//------------------------------------------------------------------------------
+// Private Variables
+//------------------------------------------------------------------------------
+
+static store_value_t values[STORE_NUM_KEYS];
+static uint8_t active_page;
+static uint32_t sequence;
+static uint32_t write_pos;			// offset of the next record in the active page
+
+static uint32_t dirty;				// keys changed by store_set_later()
+static uint32_t dirty_time;			// tick of the last store_set_later()
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Find the active page and cache its values
+void store_init(void)
+{
+	sequence = 0;
+	for(uint8_t page = 0; page < STORE_NUM_PAGES; page++)
+	{
+		uint32_t page_seq = page_sequence(page);
+		if(page_seq != 0 && page_seq >= sequence)
+		{
+			sequence = page_seq;
+			active_page = page;
+		}
+	}
+
+	if(sequence == 0)
+	{
+		// blank or unreadable store, start over on the first page
+		HAL_FLASH_Unlock();
+		active_page = 0;
+		sequence = 1;
+		bool ok = erase_page(0)
+			&& HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, page_address(0), PAGE_MAGIC) == HAL_OK
+			&& HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, page_address(0) + 4, sequence) == HAL_OK;
+		HAL_FLASH_Lock();
+		if(!ok) log_error("Failed to format config store");
+	}
+
+	load_page();
+
+	// an older valid page means a compaction was cut short, finish it
+	for(uint8_t page = 0; page < STORE_NUM_PAGES; page++)
+	{
+		if(page == active_page || page_sequence(page) == 0) continue;
+
+		HAL_FLASH_Unlock();
+		erase_page(page);
+		HAL_FLASH_Lock();
+	}
+}
+
+// Copy a value into data, returns its length, 0 if unset
+uint8_t store_get(uint8_t key, uint8_t *data, uint8_t size)
+{
+	if(key >= STORE_NUM_KEYS) return 0;
+
+	uint8_t len = values[key].len;
+	if(len > size) len = size;
+	memcpy(data, values[key].data, len);
+	return len;
+}
+
+// Write a value to flash now, a length of 0 removes it
+bool store_set(uint8_t key, const uint8_t *data, uint8_t len)
+{
+	if(key >= STORE_NUM_KEYS || len > STORE_VALUE_MAX) return false;
+
+	dirty &= ~(1UL << key);
+	if(values[key].len == len && memcmp(values[key].data, data, len) == 0) return true;
+
+	values[key].len = len;
+	memcpy(values[key].data, data, len);
+	return write_value(key);
+}
+
+// Change a value now and write it once changes stop for STORE_SAVE_DELAY
+void store_set_later(uint8_t key, const uint8_t *data, uint8_t len)
+{
+	if(key >= STORE_NUM_KEYS || len > STORE_VALUE_MAX) return;
+	if(values[key].len == len && memcmp(values[key].data, data, len) == 0) return;
+
+	values[key].len = len;
+	memcpy(values[key].data, data, len);
+	dirty |= 1UL << key;
+	dirty_time = HAL_GetTick();
+}
+
+// Write deferred values, call from the main loop
+void store_task(void)
+{
+	if(!dirty || HAL_GetTick() - dirty_time < STORE_SAVE_DELAY) return;
+
+	for(uint8_t key = 0; key < STORE_NUM_KEYS; key++)
+	{
+		if(dirty & (1UL << key)) write_value(key);
+	}
+
+	dirty = 0;
+}
+
+// Write deferred values now, before a reset
+void store_flush(void)
+{
+	dirty_time = HAL_GetTick() - STORE_SAVE_DELAY;
+	store_task();
+}
+
+// Return STORE_FEATURE_x flags
+uint8_t store_features(void)
+{
+	uint8_t features;
+	return store_get(STORE_KEY_FEATURES, &features, 1) ? features : 0xFF;
+}
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Return a page's sequence number, 0 if it has no valid header
+static uint32_t page_sequence(uint8_t page)
+{
+	const volatile uint32_t *header = (const volatile uint32_t *)page_address(page);
+	if(header[0] != PAGE_MAGIC || header[1] == 0xFFFFFFFF) return 0;
+	return header[1];
+}
+
+// Replay the active page's records into the cache
+static void load_page(void)
+{
+	const volatile uint8_t *page = (const volatile uint8_t *)page_address(active_page);
+	memset(values, 0, sizeof(values));
+
+	write_pos = PAGE_HEADER_SIZE;
+	while(write_pos + RECORD_HEADER_SIZE <= STORE_PAGE_SIZE)
+	{
+		uint8_t key = page[write_pos];
+		uint8_t len = page[write_pos + 1];
+		uint16_t crc = page[write_pos + 2] | (page[write_pos + 3] << 8);
+		if(key == 0xFF && len == 0xFF) break;
+
+		// a garbled length can't be skipped, leave the rest of the page alone
+		if(len > STORE_VALUE_MAX || write_pos + record_size(len) > STORE_PAGE_SIZE)
+		{
+			write_pos = STORE_PAGE_SIZE;
+			break;
+		}
+
+		uint8_t data[STORE_VALUE_MAX];
+		for(size_t i = 0; i < len; i++) data[i] = page[write_pos + RECORD_HEADER_SIZE + i];
+
+		if(key < STORE_NUM_KEYS && crc == record_crc(key, data, len))
+		{
+			values[key].len = len;
+			memcpy(values[key].data, data, len);
+		}
+
+		write_pos += record_size(len);
+	}
+}
+
+// Write a cached value to the active page, compacting if it is full
+static bool write_value(uint8_t key)
+{
+	uint8_t len = values[key].len;
+	if(write_pos + record_size(len) > STORE_PAGE_SIZE) return compact();
+
+	HAL_FLASH_Unlock();
+	bool ok = append(page_address(active_page) + write_pos, key, values[key].data, len);
+	HAL_FLASH_Lock();
+
+	write_pos += record_size(len);
+	return ok;
+}
+
+// Program a record, flash must be unlocked
+static bool append(uint32_t address, uint8_t key, const uint8_t *data, uint8_t len)
+{
+	uint16_t crc = record_crc(key, data, len);
+	if(HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address, key | (len << 8)) != HAL_OK) return false;
+	if(HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + 2, crc) != HAL_OK) return false;
+
+	for(size_t i = 0; i < len; i += 2)
+	{
+		uint16_t halfword = data[i] | ((i + 1 < len ? data[i + 1] : 0xFF) << 8);
+		if(HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + RECORD_HEADER_SIZE + i, halfword) != HAL_OK) return false;
+	}
+
+	return true;
+}
+
+// Move the cached values to the next page and erase the active one
+static bool compact(void)
+{
+	uint8_t next = (active_page + 1) % STORE_NUM_PAGES;
+	uint32_t address = page_address(next);
+	uint32_t pos = PAGE_HEADER_SIZE;
+
+	HAL_FLASH_Unlock();
+	bool ok = erase_page(next);
+
+	for(uint8_t key = 0; ok && key < STORE_NUM_KEYS; key++)
+	{
+		if(values[key].len == 0) continue;
+
+		ok = append(address + pos, key, values[key].data, values[key].len);
+		pos += record_size(values[key].len);
+	}
+
+	// the header makes the new page valid, then the old one can go
+	ok = ok
+		&& HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address, PAGE_MAGIC) == HAL_OK
+		&& HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address + 4, sequence + 1) == HAL_OK;
+
+	if(ok)
+	{
+		erase_page(active_page);
+		active_page = next;
+		sequence++;
+		write_pos = pos;
+	}
+
+	HAL_FLASH_Lock();
+
+	if(!ok) log_error("Failed to compact config store");
+	return ok;
+}
+
+// Erase a page, flash must be unlocked
+static bool erase_page(uint8_t page)
+{
+	FLASH_EraseInitTypeDef erase = {0};
+	erase.TypeErase = FLASH_TYPEERASE_PAGES;
+	erase.PageAddress = page_address(page);
+	erase.NbPages = 1;
+
+	uint32_t page_error;
+	return HAL_FLASHEx_Erase(&erase, &page_error) == HAL_OK;
+}
+
+// CRC of a record's key, length and data
+static uint16_t record_crc(uint8_t key, const uint8_t *data, uint8_t len)
+{
+	uint8_t header[] = {key, len};
+	uint16_t crc = crc16_update(CRC16_INIT, header, sizeof(header));
+	return crc16_update(crc, data, len);
+}
+
+#endif // CONFIG_STORE
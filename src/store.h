@@ -0,0 +1,90 @@
+//==============================================================================
+// Flash Config Store
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_STORE_H
+#define ATLC_STORE_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	Small key/value settings kept in the last 8K of flash, which the linker
+	script leaves out of FLASH. The 4 pages are used as a ring: records are
+	appended to the active page, and when it fills the live values are
+	copied to the next page and the old one is erased, so erases are spread
+	over all pages.
+
+	Page:	magic (32-bit), sequence (32-bit), records...
+	Record:	key, length, CRC-16 (key, length, data), data padded to 16 bits
+
+	The page with the highest sequence is active. Its header is written last
+	and records with a bad CRC are skipped, so a reset during a write loses
+	at most that write. All values are cached in RAM by store_init().
+
+	Flash is stalled during a write, up to a page erase (~40 ms) when the
+	ring moves on. Nothing runs meanwhile, ISRs placed in CCM_RAM included:
+	the vector table and the HAL handlers they call are in flash. Strips
+	whose DMA buffer runs dry send a glitched frame, and CAN frames past the
+	3 each RX FIFO holds are lost, so saves should be rare and not mid-show.
+*/
+
+#define STORE_ADDRESS		0x0807E000
+#define STORE_PAGE_SIZE		2048
+#define STORE_NUM_PAGES		4
+
+#define STORE_NUM_KEYS		20		// at most 32
+#define STORE_VALUE_MAX		10		// bytes, Config Read replies 6 at a time
+
+typedef enum
+{
+	STORE_KEY_CAN_ID = 0,			// node id, applied at reset or by a Discovery assign
+	STORE_KEY_STRIP_COUNT = 1,		// strips driven, applied at reset
+	STORE_KEY_STRIP_LEDS = 2,		// LEDs on each strip, applied at reset
+	STORE_KEY_CHIP_TYPE = 3,		// RGB_CHIP_x, applied at reset
+	STORE_KEY_FEATURES = 4,			// STORE_FEATURE_x flags
+	STORE_KEY_OUTPUTS = 5,			// last written output states
+	STORE_KEY_STRIP_STATE = 6,		// mode, red, green, blue, one key per strip
+	STORE_KEY_SCENE = 8,			// scene_t, one key per scene slot
+	STORE_KEY_GROUPS = 16,			// CAN group ids, applied when written
+	STORE_KEY_HEARTBEAT = 17		// bus stats heartbeat id and interval, applied when written
+} store_key_t;
+
+// Feature flags, all set if the key is missing
+#define STORE_FEATURE_RESTORE	(1 << 0)	// restore outputs and strips at boot
+
+// Config Write key that resets the controller to apply settings
+#define STORE_KEY_RESET			0xFF
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+#ifdef CONFIG_STORE
+
+void store_init(void);
+uint8_t store_get(uint8_t key, uint8_t *data, uint8_t size);
+bool store_set(uint8_t key, const uint8_t *data, uint8_t len);
+void store_set_later(uint8_t key, const uint8_t *data, uint8_t len);
+void store_task(void);
+void store_flush(void);
+uint8_t store_features(void);
+
+#endif // CONFIG_STORE
+
+
+#endif // ATLC_STORE_H
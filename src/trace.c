@@ -0,0 +1,101 @@
+//==============================================================================
+// Command Latency Tracing
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stm32f3xx_hal.h>
+
+#include "ccm.h"
+#include "clock.h"
+#include "config.h"
+#include "trace.h"
+
+
+#ifdef TRACE
+
+//------------------------------------------------------------------------------
+// Private Variables
+//------------------------------------------------------------------------------
+
+static trace_entry_t buffer[TRACE_BUF_SIZE] CCM_BSS;
+static size_t buf_write_pos CCM_BSS;
+static size_t buf_count CCM_BSS;
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Record the latency of a command, may be called from ISRs
+CCM_FUNC void trace_record(uint8_t cmd, trace_event_t event, uint32_t timestamp)
+{
+	uint32_t now = clock_cycles();
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	buffer[buf_write_pos].cmd = cmd;
+	buffer[buf_write_pos].event = event;
+	buffer[buf_write_pos].timestamp = timestamp;
+	buffer[buf_write_pos].latency = now - timestamp;
+
+	// oldest entries are overwritten
+	buf_write_pos++;
+	if(buf_write_pos >= TRACE_BUF_SIZE) buf_write_pos = 0;
+	if(buf_count < TRACE_BUF_SIZE) buf_count++;
+
+	__set_PRIMASK(primask);
+}
+
+// Read a trace entry, index 0 is the most recent
+bool trace_read(uint8_t index, trace_entry_t *entry)
+{
+	bool found = false;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	if(index < buf_count)
+	{
+		*entry = buffer[(buf_write_pos + TRACE_BUF_SIZE - 1 - index) % TRACE_BUF_SIZE];
+		found = true;
+	}
+
+	__set_PRIMASK(primask);
+
+	return found;
+}
+
+// Clear all trace entries
+void trace_clear(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	buf_count = 0;
+	__set_PRIMASK(primask);
+}
+
+// Print all trace entries over UART, oldest first
+void trace_dump(void)
+{
+	uint32_t cycles_per_us = SystemCoreClock / 1000000;
+
+	printf("cmd event  timestamp   latency (us)\r\n");
+
+	for(int i = TRACE_BUF_SIZE - 1; i >= 0; i--)
+	{
+		trace_entry_t entry;
+		if(!trace_read(i, &entry)) continue;
+
+		printf("%3u %5u %10lu %10lu\r\n", entry.cmd, entry.event, entry.timestamp, entry.latency / cycles_per_us);
+	}
+}
+
+#endif // TRACE
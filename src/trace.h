@@ -0,0 +1,61 @@
+//==============================================================================
+// Command Latency Tracing
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_TRACE_H
+#define ATLC_TRACE_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+typedef enum
+{
+	TRACE_GPIO_WRITE = 1,	// output pins written
+	TRACE_LED_DATA = 2		// first LED bit on the wire
+} trace_event_t;
+
+typedef struct
+{
+	uint8_t cmd;
+	uint8_t event;
+	uint32_t timestamp;		// cycle counter when the command was received
+	uint32_t latency;		// cycles from receive to event
+} trace_entry_t;
+
+// Trace command indexes
+#define TRACE_INDEX_CLEAR	0xFE
+#define TRACE_INDEX_DUMP	0xFF
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+#ifdef TRACE
+
+void trace_record(uint8_t cmd, trace_event_t event, uint32_t timestamp);
+bool trace_read(uint8_t index, trace_entry_t *entry);
+void trace_clear(void);
+void trace_dump(void);
+
+#else
+
+#define trace_record(cmd, event, timestamp)
+
+#endif // TRACE
+
+
+#endif // ATLC_TRACE_H
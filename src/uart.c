@@ -10,9 +10,18 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/unistd.h>
 #include <stm32f3xx_hal.h>
 
+#include "can.h"
+#include "ccm.h"
+#include "clock.h"
+#include "cobs.h"
+#include "command.h"
+#include "config.h"
+#include "crc.h"
 #include "debug.h"
 #include "uart.h"
 
@@ -27,7 +36,42 @@
 */
 
 #define UART_PORT	GPIOC
-#define UART_PINS	GPIO_PIN_10 | GPIO_PIN_11;
+#define UART_PINS	GPIO_PIN_10 | GPIO_PIN_11
+
+#define TX_MASK		(UART_TX_BUF_SIZE - 1)
+
+#if UART_TX_BUF_SIZE & TX_MASK
+#error "UART_TX_BUF_SIZE must be a power of 2"
+#endif
+
+#define RX_DMA_SIZE		256		// bytes, interrupts every half buffer and on idle
+#define RX_BUF_SIZE		16		// received commands
+#define CMD_HEADER_SIZE	3		// frame type, command, device id
+#define CMD_PAYLOAD_MAX	(UART_FRAME_MAX - 2)
+
+// Command frame, payloads over 8 bytes are split into CAN sized messages as they're read
+typedef struct
+{
+	can_cmd_t cmd;
+	uint8_t id;
+	uint8_t payload[CMD_PAYLOAD_MAX];
+	uint8_t len;
+	uint32_t timestamp;
+} rx_cmd_t;
+
+
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static bool push(const uint8_t *data, size_t len);
+static void start_tx(void);
+
+#ifdef UART_COMMANDS
+static void start_rx(void);
+static void rx_process(void);
+static void rx_frame(void);
+#endif // UART_COMMANDS
 
 
 //------------------------------------------------------------------------------
@@ -35,6 +79,34 @@
 //------------------------------------------------------------------------------
 
 static UART_HandleTypeDef huart;
+static DMA_HandleTypeDef hdma_tx;
+
+static uint8_t tx_buffer[UART_TX_BUF_SIZE];		// SRAM, DMA can't reach CCM
+static volatile size_t tx_head;					// next byte written
+static volatile size_t tx_tail;					// next byte sent
+static volatile size_t tx_len;					// bytes in the running transfer, 0 when idle
+
+static uint32_t dropped;			// bytes dropped since boot
+static uint32_t unreported;			// bytes dropped since the last note in the output
+
+#ifdef UART_COMMANDS
+
+static DMA_HandleTypeDef hdma_rx;
+
+static uint8_t rx_dma[RX_DMA_SIZE];				// SRAM, DMA can't reach CCM
+static size_t rx_dma_pos;						// next byte to process
+static uint8_t rx_frame_buf[COBS_MAX_SIZE(1 + UART_FRAME_MAX + 2)];
+static size_t rx_frame_len;
+static bool rx_frame_overflow;
+
+static volatile rx_cmd_t rx_buffer[RX_BUF_SIZE] CCM_BSS;
+static volatile size_t rx_write_pos CCM_BSS;
+static volatile size_t rx_read_pos CCM_BSS;
+
+static rx_cmd_t rx_long;			// command being split, the rest of it
+static bool rx_splitting;
+
+#endif // UART_COMMANDS
 
 
 //------------------------------------------------------------------------------
@@ -54,7 +126,7 @@ void uart_init(void)
 
 	// configure peripheral
 	huart.Instance = UART4;
-	huart.Init.BaudRate = 115200;
+	huart.Init.BaudRate = UART_BAUD_RATE;
 	huart.Init.WordLength = UART_WORDLENGTH_8B;
 	huart.Init.StopBits = UART_STOPBITS_1;
 	huart.Init.Parity = UART_PARITY_NONE;
@@ -64,16 +136,355 @@ void uart_init(void)
 	huart.Init.OneBitSampling = UART_ONE_BIT_SAMPLE_DISABLE;
 	huart.AdvancedInit.AdvFeatureInit = UART_ADVFEATURE_NO_INIT;
 	debug_assert(HAL_UART_Init(&huart) == HAL_OK, "Failed to configure UART");
+
+	// configure tx dma
+	hdma_tx.Instance = DMA2_Channel5;
+	hdma_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+	hdma_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+	hdma_tx.Init.MemInc = DMA_MINC_ENABLE;
+	hdma_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+	hdma_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+	hdma_tx.Init.Mode = DMA_NORMAL;
+	hdma_tx.Init.Priority = DMA_PRIORITY_LOW;
+	debug_assert(HAL_DMA_Init(&hdma_tx) == HAL_OK, "Failed to configure UART DMA");
+
+	__HAL_LINKDMA(&huart, hdmatx, hdma_tx);
+
+#ifdef UART_COMMANDS
+
+	// configure rx dma, bytes are picked up on half/full buffer and line idle
+	hdma_rx.Instance = DMA2_Channel3;
+	hdma_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+	hdma_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+	hdma_rx.Init.MemInc = DMA_MINC_ENABLE;
+	hdma_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+	hdma_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+	hdma_rx.Init.Mode = DMA_CIRCULAR;
+	hdma_rx.Init.Priority = DMA_PRIORITY_MEDIUM;
+	debug_assert(HAL_DMA_Init(&hdma_rx) == HAL_OK, "Failed to configure UART RX DMA");
+
+	__HAL_LINKDMA(&huart, hdmarx, hdma_rx);
+
+	HAL_NVIC_SetPriority(DMA2_Channel3_IRQn, 3, 0);
+	HAL_NVIC_EnableIRQ(DMA2_Channel3_IRQn);
+
+#endif // UART_COMMANDS
+
+	// below everything else, output only falls behind
+	HAL_NVIC_SetPriority(DMA2_Channel5_IRQn, 3, 0);
+	HAL_NVIC_EnableIRQ(DMA2_Channel5_IRQn);
+	HAL_NVIC_SetPriority(UART4_IRQn, 3, 0);
+	HAL_NVIC_EnableIRQ(UART4_IRQn);
+
+#ifdef UART_COMMANDS
+
+	start_rx();
+
+#endif // UART_COMMANDS
+}
+
+// Send everything queued before returning, safe with interrupts masked
+void uart_flush(void)
+{
+	// stop the transfer where it is and finish it by polling
+	if(tx_len)
+	{
+		// abort first, the disabled channel keeps its count, so no byte is sent twice
+		HAL_UART_AbortTransmit(&huart);
+		size_t sent = tx_len - __HAL_DMA_GET_COUNTER(&hdma_tx);
+		tx_tail = (tx_tail + sent) & TX_MASK;
+		tx_len = 0;
+	}
+
+	while(tx_tail != tx_head)
+	{
+		size_t len = (tx_head > tx_tail ? tx_head : UART_TX_BUF_SIZE) - tx_tail;
+		HAL_UART_Transmit(&huart, &tx_buffer[tx_tail], len, 1000);
+		tx_tail = (tx_tail + len) & TX_MASK;
+	}
+}
+
+// Return the number of output bytes dropped because the buffer was full
+uint32_t uart_get_dropped(void)
+{
+	return dropped;
+}
+
+// Queue data to send, dropped whole if it doesn't fit -- safe from ISRs
+bool uart_write(const uint8_t *data, size_t len)
+{
+	// log macros can run in ISRs, a write there mustn't interleave with one it interrupted
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	// let the reader know a gap is coming before the next complete write
+	if(unreported)
+	{
+		char note[32];
+		int note_len = snprintf(note, sizeof(note), "\r\n[%lu bytes dropped]\r\n", (unsigned long)unreported);
+		if(push((uint8_t *)note, note_len)) unreported = 0;
+	}
+
+	// writes go in whole or not at all, so lines aren't torn
+	bool written = !unreported && push(data, len);
+	if(!written)
+	{
+		dropped += len;
+		unreported += len;
+	}
+
+	__set_PRIMASK(primask);
+	return written;
 }
 
-// Redirect printf() to UART
+// Send a packet as 0x00, COBS(type, data, CRC-16), 0x00 -- safe from ISRs
+bool uart_send_frame(uint8_t type, const uint8_t *data, size_t len)
+{
+	if(len > UART_FRAME_MAX) return false;
+
+	uint8_t packet[1 + UART_FRAME_MAX + 2];
+	packet[0] = type;
+	for(size_t i = 0; i < len; i++) packet[1 + i] = data[i];
+
+	uint16_t crc = crc16_update(CRC16_INIT, packet, len + 1);
+	packet[len + 1] = crc >> 8;
+	packet[len + 2] = crc & 0xFF;
+
+	// the leading delimiter splits the frame from any printf() text before it
+	uint8_t frame[COBS_MAX_SIZE(sizeof(packet)) + 2];
+	frame[0] = 0;
+	size_t frame_len = 1 + cobs_encode(packet, len + 3, &frame[1]);
+	frame[frame_len++] = 0;
+
+	return uart_write(frame, frame_len);
+}
+
+#ifdef UART_COMMANDS
+
+// Send a command frame, the UART counterpart of can_send()
+void uart_send_command(uint8_t id, can_cmd_t cmd, const uint8_t *payload, uint8_t len)
+{
+	uint8_t data[2 + 8];
+	if(len > 8) len = 8;
+
+	data[0] = cmd;
+	data[1] = id;
+	for(size_t i = 0; i < len; i++) data[2 + i] = payload[i];
+
+	uart_send_frame(UART_FRAME_COMMAND, data, 2 + len);
+}
+
+// Receive a command frame, same as can_receive(), a long one comes out as several messages
+bool uart_receive(can_msg_t *msg)
+{
+	if(!rx_splitting)
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+
+		if(rx_read_pos == rx_write_pos)
+		{
+			__set_PRIMASK(primask);
+			return false;
+		}
+
+		volatile rx_cmd_t *entry = &rx_buffer[rx_read_pos];
+		rx_long.cmd = entry->cmd;
+		rx_long.id = entry->id;
+		for(size_t i = 0; i < entry->len; i++) rx_long.payload[i] = entry->payload[i];
+		rx_long.len = entry->len;
+		rx_long.timestamp = entry->timestamp;
+
+		rx_read_pos++;
+		if(rx_read_pos >= RX_BUF_SIZE) rx_read_pos = 0;
+
+		__set_PRIMASK(primask);
+	}
+
+	msg->cmd = rx_long.cmd;
+	msg->id = rx_long.id;
+	msg->timestamp = rx_long.timestamp;
+	msg->source = MSG_SOURCE_UART;
+	msg->reliable = false;
+
+	// split at dispatch, packed pixels depend on the depth earlier commands set
+	rx_splitting = command_split(msg, rx_long.payload, &rx_long.len);
+	if(rx_splitting) return true;
+	if(rx_long.len > 8) return false;
+
+	for(size_t i = 0; i < rx_long.len; i++) msg->payload[i] = rx_long.payload[i];
+	msg->len = rx_long.len;
+	return true;
+}
+
+#endif // UART_COMMANDS
+
+// Redirect printf() to UART, queues the data and returns without waiting
 int _write(int file, char *data, int len)
 {
-   if(file != STDOUT_FILENO && file != STDERR_FILENO)
-   {
-      errno = EBADF;
-      return -1;
-   }
+	if(file != STDOUT_FILENO && file != STDERR_FILENO)
+	{
+		errno = EBADF;
+		return -1;
+	}
+
+	// report the write as done, stdio would retry otherwise
+	uart_write((uint8_t *)data, len);
+	return len;
+}
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Copy data into the tx buffer and start sending, false if it doesn't fit -- call with interrupts disabled
+static bool push(const uint8_t *data, size_t len)
+{
+	// uart_write() is the only writer, the tx ISR only moves the tail
+	size_t head = tx_head;
+	size_t used = (head - tx_tail) & TX_MASK;
+	if(len > UART_TX_BUF_SIZE - 1 - used) return false;
+
+	size_t first = UART_TX_BUF_SIZE - head;
+	if(first > len) first = len;
+	memcpy(&tx_buffer[head], data, first);
+	memcpy(tx_buffer, data + first, len - first);
+	tx_head = (head + len) & TX_MASK;
+
+	if(!tx_len) start_tx();
+
+	return true;
+}
+
+// Send the next contiguous run of the tx buffer, call with interrupts disabled
+static void start_tx(void)
+{
+	size_t head = tx_head;
+	if(head == tx_tail) return;
+
+	tx_len = (head > tx_tail ? head : UART_TX_BUF_SIZE) - tx_tail;
+	if(HAL_UART_Transmit_DMA(&huart, &tx_buffer[tx_tail], tx_len) != HAL_OK) tx_len = 0;
+}
+
+#ifdef UART_COMMANDS
+
+// Start circular rx DMA and the idle line interrupt
+static void start_rx(void)
+{
+	rx_dma_pos = 0;
+	rx_frame_len = 0;
+	rx_frame_overflow = false;
+
+	HAL_UART_Receive_DMA(&huart, rx_dma, RX_DMA_SIZE);
+	__HAL_UART_CLEAR_IDLEFLAG(&huart);
+	__HAL_UART_ENABLE_IT(&huart, UART_IT_IDLE);
+}
+
+// Split bytes the DMA has written since the last call into frames
+static void rx_process(void)
+{
+	size_t head = RX_DMA_SIZE - __HAL_DMA_GET_COUNTER(&hdma_rx);
+	if(head >= RX_DMA_SIZE) head = 0;
+
+	while(rx_dma_pos != head)
+	{
+		uint8_t byte = rx_dma[rx_dma_pos];
+		rx_dma_pos++;
+		if(rx_dma_pos >= RX_DMA_SIZE) rx_dma_pos = 0;
+
+		if(byte == 0)
+		{
+			if(rx_frame_len && !rx_frame_overflow) rx_frame();
+			rx_frame_len = 0;
+			rx_frame_overflow = false;
+		}
+		else if(rx_frame_len < sizeof(rx_frame_buf)) rx_frame_buf[rx_frame_len++] = byte;
+		else rx_frame_overflow = true;
+	}
+}
+
+// Check a complete frame and queue the command it holds
+static void rx_frame(void)
+{
+	uint8_t *packet = rx_frame_buf;
+	size_t len = cobs_decode(rx_frame_buf, rx_frame_len, packet);
+	if(len < CMD_HEADER_SIZE + 2 || len > 1 + UART_FRAME_MAX + 2) return;
+
+	uint16_t crc = (packet[len - 2] << 8) | packet[len - 1];
+	if(crc16_update(CRC16_INIT, packet, len - 2) != crc) return;
+	if(packet[0] != UART_FRAME_COMMAND) return;
+	if(packet[2] != can_get_id() && !can_is_group(packet[2])) return;
+
+	volatile rx_cmd_t *entry = &rx_buffer[rx_write_pos];
+	entry->cmd = packet[1];
+	entry->id = packet[2];
+	entry->len = len - CMD_HEADER_SIZE - 2;
+	for(size_t i = 0; i < entry->len; i++) entry->payload[i] = packet[CMD_HEADER_SIZE + i];
+	entry->timestamp = clock_cycles();
+
+	rx_write_pos++;
+	if(rx_write_pos >= RX_BUF_SIZE) rx_write_pos = 0;
+
+	// drop the oldest command if the buffer is full
+	if(rx_read_pos == rx_write_pos)
+	{
+		rx_read_pos++;
+		if(rx_read_pos >= RX_BUF_SIZE) rx_read_pos = 0;
+	}
+}
+
+#endif // UART_COMMANDS
+
+
+//------------------------------------------------------------------------------
+// ISRs
+//------------------------------------------------------------------------------
+
+// Transfer finished, move on to whatever was queued meanwhile
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *handle)
+{
+	tx_tail = (tx_tail + tx_len) & TX_MASK;
+	tx_len = 0;
+	start_tx();
+}
+
+// UART TX DMA Transfer Complete ISR
+void DMA2_Channel5_IRQHandler(void)
+{
+	HAL_DMA_IRQHandler(&hdma_tx);
+}
+
+#ifdef UART_COMMANDS
+
+// Receive error, the HAL stops rx DMA on an overrun so start it again
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *handle)
+{
+	HAL_UART_AbortReceive(&huart);
+	start_rx();
+}
+
+// UART RX DMA Half Complete / Transfer Complete ISR
+void DMA2_Channel3_IRQHandler(void)
+{
+	rx_process();
+	HAL_DMA_IRQHandler(&hdma_rx);
+}
+
+#endif // UART_COMMANDS
+
+// UART Transmission Complete / Idle Line ISR
+void UART4_IRQHandler(void)
+{
+#ifdef UART_COMMANDS
+
+	if(__HAL_UART_GET_FLAG(&huart, UART_FLAG_IDLE))
+	{
+		__HAL_UART_CLEAR_IDLEFLAG(&huart);
+		rx_process();
+	}
+
+#endif // UART_COMMANDS
 
-   return (HAL_UART_Transmit(&huart, (uint8_t *)data, len, 1000) == HAL_OK) ? len : 0;
+	HAL_UART_IRQHandler(&huart);
 }
@@ -7,11 +7,57 @@
 #define ATLC_UART_H
 
 
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "can.h"
+#include "config.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	printf() output is queued in a ring buffer and sent by DMA2 channel 5,
+	so logging costs a copy instead of ~10 bit times per character. A write
+	that doesn't fit is dropped whole and counted, and a note with the count
+	is sent ahead of the next write that fits.
+
+	Binary packets share the line with printf() text as frames:
+		0x00, COBS(type, data, CRC-16 MSB first), 0x00
+	The CRC covers the type and data. Command frames carry the same messages
+	as CAN, data is the command, device id and 0-8 payload bytes. RGB Pixels
+	and Update Data take up to UART_FRAME_MAX - 2 payload bytes, which are
+	split into the messages CAN would have carried.
+*/
+
+#define UART_FRAME_MAX		64		// data bytes in a frame
+
+// Frame types
+#define UART_FRAME_LOG		0x01	// tokenized log message
+#define UART_FRAME_COMMAND	0x02	// command or reply
+
+
 //------------------------------------------------------------------------------
 // Public Functions
 //------------------------------------------------------------------------------
 
 void uart_init(void);
+void uart_flush(void);
+bool uart_write(const uint8_t *data, size_t len);
+bool uart_send_frame(uint8_t type, const uint8_t *data, size_t len);
+
+#ifdef UART_COMMANDS
+void uart_send_command(uint8_t id, can_cmd_t cmd, const uint8_t *payload, uint8_t len);
+bool uart_receive(can_msg_t *msg);
+#endif // UART_COMMANDS
+uint32_t uart_get_dropped(void);
 
 
 #endif  // ATLC_UART_H
@@ -0,0 +1,400 @@
+//==============================================================================
+// Firmware Update
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stm32f3xx_hal.h>
+
+#include "can.h"
+#include "ccm.h"
+#include "command.h"
+#include "config.h"
+#include "debug.h"
+#include "slot.h"
+#include "store.h"
+#include "uart.h"
+#include "update.h"
+#include "version.h"
+
+
+#ifdef UPDATE
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+#define NO_BLOCK		0xFFFF
+#define HOLD_QUIET		5		// ms without data frames before erasing
+#define HOLD_TIMEOUT	100		// ms, erase anyway if the host keeps sending
+
+typedef struct
+{
+	volatile uint16_t block;		// block being received, NO_BLOCK if none
+	volatile uint16_t count;		// frames received
+	volatile uint32_t received[UPDATE_BLOCK_FRAMES / 32];
+	uint8_t data[UPDATE_BLOCK_SIZE];
+} block_buffer_t;
+
+
+//------------------------------------------------------------------------------
+// Private Function Definitions
+//------------------------------------------------------------------------------
+
+static uint16_t block_frames(uint16_t block);
+static uint32_t block_end(uint16_t block);
+static bool erase_window(void);
+static bool program_block(uint16_t block, const block_buffer_t *buffer);
+static void fail(void);
+static void read_record(boot_record_t *record);
+
+
+//------------------------------------------------------------------------------
+// Private Variables
+//------------------------------------------------------------------------------
+
+static block_buffer_t buffers[UPDATE_WINDOW];	// SRAM, too big for CCM
+
+static can_msg_t request;			// start command, acks go to its sender
+static volatile bool active;		// receiving blocks
+static bool verified;				// image CRC checked, ready to activate
+static uint8_t target_slot;
+static uint32_t image_size;
+static uint32_t image_crc;
+static uint16_t num_blocks;
+static volatile uint16_t next_block;	// blocks before it are programmed
+static uint32_t erased;					// bytes of the slot erased, whole pages
+static volatile bool ack_pending;
+
+static bool holding;				// host told to stop sending until an erase is done
+static uint32_t hold_time;
+static uint32_t quiet_time;			// last time data frames were seen while holding
+static volatile uint16_t data_frames;	// frames received, to see the host has stopped
+static uint16_t seen_frames;
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+// Run an Update command
+void update_command(const can_msg_t *msg)
+{
+	uint8_t op = msg->payload[1];
+	uint8_t id = can_get_id();
+
+	if(op == UPDATE_OP_START && msg->len == 5)
+	{
+		uint32_t size = (msg->payload[2] << 16) | (msg->payload[3] << 8) | msg->payload[4];
+		uint8_t slot = slot_running() == SLOT_A ? SLOT_B : SLOT_A;
+
+		active = false;
+		verified = false;
+		request = *msg;
+
+		boot_record_t record;
+		read_record(&record);
+
+		// an unconfirmed trial would overwrite its own fallback
+		uint8_t status = UPDATE_OK;
+		if(slot_running() == SLOT_NONE) status = UPDATE_ERR_SLOT;
+		else if(record.trial == slot_running()) status = UPDATE_ERR_STATE;
+		else if(size == 0 || size > SLOT_SIZE) status = UPDATE_ERR_SIZE;
+
+		if(status == UPDATE_OK)
+		{
+			for(size_t i = 0; i < UPDATE_WINDOW; i++) buffers[i].block = NO_BLOCK;
+
+			target_slot = slot;
+			image_size = size;
+			num_blocks = (size + UPDATE_BLOCK_SIZE - 1) / UPDATE_BLOCK_SIZE;
+			next_block = 0;
+			erased = 0;
+			ack_pending = false;
+			holding = false;
+			active = true;
+
+			log_info("Update of %lu bytes into slot %c", size, 'A' + slot);
+		}
+
+		uint8_t payload[] = {UPDATE_OP_START, id, status, slot, UPDATE_WINDOW};
+		command_reply(msg, CAN_CMD_UPDATE, payload, sizeof(payload));
+	}
+
+	else if(op == UPDATE_OP_FINISH && msg->len == 6)
+	{
+		uint32_t crc = (msg->payload[2] << 24) | (msg->payload[3] << 16) | (msg->payload[4] << 8) | msg->payload[5];
+
+		uint8_t status = UPDATE_OK;
+		if(!active) status = UPDATE_ERR_STATE;
+		else if(next_block < num_blocks) status = UPDATE_ERR_INCOMPLETE;
+		else if(slot_crc(target_slot, image_size) != crc) status = UPDATE_ERR_CRC;
+
+		if(status == UPDATE_OK)
+		{
+			active = false;
+			verified = true;
+			image_crc = crc;
+		}
+
+		uint8_t payload[] = {UPDATE_OP_FINISH, id, status};
+		command_reply(msg, CAN_CMD_UPDATE, payload, sizeof(payload));
+	}
+
+	else if(op == UPDATE_OP_ACTIVATE && msg->len == 2)
+	{
+		uint8_t status = UPDATE_OK;
+		if(!verified) status = UPDATE_ERR_STATE;
+		else
+		{
+			// the confirmed slot stays the fallback
+			boot_record_t record;
+			read_record(&record);
+			record.trial = target_slot;
+			record.tries = 0;
+			record.trial_size = image_size;
+			record.trial_crc = image_crc;
+			if(!slot_write_record(&record)) status = UPDATE_ERR_FLASH;
+		}
+
+		uint8_t payload[] = {UPDATE_OP_ACTIVATE, id, status};
+		command_reply(msg, CAN_CMD_UPDATE, payload, sizeof(payload));
+
+		if(status == UPDATE_OK)
+		{
+			log_info("Starting slot %c", 'A' + target_slot);
+
+#ifdef CONFIG_STORE
+
+			store_flush();
+
+#endif // CONFIG_STORE
+
+			can_flush(10);
+			uart_flush();
+			NVIC_SystemReset();
+		}
+	}
+
+	else if(op == UPDATE_OP_CONFIRM && msg->len == 2)
+	{
+		boot_record_t record;
+		read_record(&record);
+
+		uint8_t status = UPDATE_OK;
+		uint8_t running = slot_running();
+		if(running == SLOT_NONE) status = UPDATE_ERR_SLOT;
+		else if(record.trial == running)
+		{
+			record.confirmed = running;
+			record.trial = SLOT_NONE;
+			record.tries = 0;
+			if(!slot_write_record(&record)) status = UPDATE_ERR_FLASH;
+		}
+		else if(record.confirmed != running) status = UPDATE_ERR_STATE;
+
+		uint8_t payload[] = {UPDATE_OP_CONFIRM, id, status};
+		command_reply(msg, CAN_CMD_UPDATE, payload, sizeof(payload));
+	}
+
+	else if(op == UPDATE_OP_STATUS && msg->len == 2)
+	{
+		boot_record_t record;
+		read_record(&record);
+
+		uint8_t payload[] = {
+			UPDATE_OP_STATUS, id,
+			slot_running(), record.confirmed, record.trial,
+			VER_MAJOR, VER_MINOR, VER_PATCH
+		};
+		command_reply(msg, CAN_CMD_UPDATE, payload, sizeof(payload));
+	}
+}
+
+// Place an Update Data frame in its block buffer -- called from the CAN RX ISR
+CCM_FUNC void update_receive(const uint8_t *payload, uint8_t len)
+{
+	if(!active || len < 3) return;
+
+	data_frames++;
+
+	uint16_t block = payload[0];
+	uint8_t frame = payload[1];
+
+	// a resent block means our ack was lost
+	if(block < next_block)
+	{
+		ack_pending = true;
+		return;
+	}
+
+	if(block >= next_block + UPDATE_WINDOW || block >= num_blocks) return;
+
+	// the buffer's last block is already programmed, it falls outside the window
+	block_buffer_t *buffer = &buffers[block % UPDATE_WINDOW];
+	if(buffer->block != block)
+	{
+		for(size_t i = 0; i < UPDATE_BLOCK_FRAMES / 32; i++) buffer->received[i] = 0;
+		buffer->count = 0;
+		buffer->block = block;
+	}
+
+	uint32_t bit = 1UL << (frame % 32);
+	if(buffer->received[frame / 32] & bit) return;
+
+	uint32_t offset = frame * UPDATE_FRAME_DATA;
+	for(size_t i = 0; i < len - 2u; i++) buffer->data[offset + i] = payload[2 + i];
+
+	buffer->received[frame / 32] |= bit;
+	buffer->count++;
+}
+
+// Erase ahead while the host holds, program complete blocks in order, call from the main loop
+void update_task(void)
+{
+	if(!active) return;
+
+	uint32_t now = HAL_GetTick();
+
+	// an erase stalls every ISR for ~40 ms a page, frames sent meanwhile would be lost
+	if(next_block < num_blocks && block_end(next_block) > erased)
+	{
+		if(!holding)
+		{
+			holding = true;
+			hold_time = now;
+			quiet_time = now;
+			seen_frames = data_frames;
+
+			uint8_t payload[] = {UPDATE_OP_HOLD, can_get_id(), next_block >> 8, next_block & 0xFF};
+			command_reply(&request, CAN_CMD_UPDATE, payload, sizeof(payload));
+		}
+		else if(seen_frames != data_frames)
+		{
+			seen_frames = data_frames;
+			quiet_time = now;
+		}
+
+		if(now - quiet_time < HOLD_QUIET && now - hold_time < HOLD_TIMEOUT) return;
+
+		holding = false;
+		if(!erase_window())
+		{
+			fail();
+			return;
+		}
+
+		// the ack tells the host to go on
+		ack_pending = true;
+	}
+
+	else if(next_block < num_blocks)
+	{
+		block_buffer_t *buffer = &buffers[next_block % UPDATE_WINDOW];
+		if(buffer->block == next_block && buffer->count == block_frames(next_block))
+		{
+			if(!program_block(next_block, buffer))
+			{
+				fail();
+				return;
+			}
+
+			// frees the buffer for the block past the window
+			next_block++;
+			ack_pending = true;
+		}
+	}
+
+	if(ack_pending)
+	{
+		// acks are cumulative, the count of blocks programmed
+		ack_pending = false;
+
+		uint16_t blocks = next_block;
+		uint8_t payload[] = {UPDATE_OP_ACK, can_get_id(), blocks >> 8, blocks & 0xFF};
+		command_reply(&request, CAN_CMD_UPDATE, payload, sizeof(payload));
+	}
+}
+
+
+//------------------------------------------------------------------------------
+// Private Functions
+//------------------------------------------------------------------------------
+
+// Return the number of data frames in a block, the last one is short
+static uint16_t block_frames(uint16_t block)
+{
+	uint32_t bytes = image_size - block * UPDATE_BLOCK_SIZE;
+	if(bytes > UPDATE_BLOCK_SIZE) bytes = UPDATE_BLOCK_SIZE;
+	return (bytes + UPDATE_FRAME_DATA - 1) / UPDATE_FRAME_DATA;
+}
+
+// Return the slot offset a block ends at
+static uint32_t block_end(uint16_t block)
+{
+	uint32_t end = (block + 1) * UPDATE_BLOCK_SIZE;
+	return end < image_size ? end : image_size;
+}
+
+// Erase the pages the blocks in the window fall in, one hold per window instead of per page
+static bool erase_window(void)
+{
+	uint16_t last = next_block + UPDATE_WINDOW - 1;
+	if(last >= num_blocks) last = num_blocks - 1;
+
+	uint32_t end = block_end(last);
+	if(!slot_erase(target_slot, erased, end - erased)) return false;
+
+	erased = (end + SLOT_PAGE_SIZE - 1) / SLOT_PAGE_SIZE * SLOT_PAGE_SIZE;
+	return true;
+}
+
+// Program a block into the target slot and read it back
+static bool program_block(uint16_t block, const block_buffer_t *buffer)
+{
+	uint32_t address = slot_address(target_slot) + block * UPDATE_BLOCK_SIZE;
+	uint32_t len = image_size - block * UPDATE_BLOCK_SIZE;
+	if(len > UPDATE_BLOCK_SIZE) len = UPDATE_BLOCK_SIZE;
+
+	// each halfword stalls the CPU for ~50 us, the CAN FIFO holds 3 frames meanwhile
+	HAL_FLASH_Unlock();
+
+	bool ok = true;
+	for(size_t i = 0; ok && i < len; i += 2)
+	{
+		uint16_t halfword = buffer->data[i] | ((i + 1 < len ? buffer->data[i + 1] : 0xFF) << 8);
+		ok = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + i, halfword) == HAL_OK;
+	}
+
+	HAL_FLASH_Lock();
+
+	return ok && memcmp((const void *)address, buffer->data, len) == 0;
+}
+
+// Stop the update and tell the host which block failed
+static void fail(void)
+{
+	active = false;
+
+	uint8_t payload[] = {UPDATE_OP_NACK, can_get_id(), UPDATE_ERR_FLASH, next_block >> 8, next_block & 0xFF};
+	command_reply(&request, CAN_CMD_UPDATE, payload, sizeof(payload));
+	log_error("Failed to program update block %u", next_block);
+}
+
+// Read the boot record, as if the running slot was confirmed if there is none
+static void read_record(boot_record_t *record)
+{
+	if(slot_read_record(record)) return;
+
+	memset(record, 0, sizeof(*record));
+	record->confirmed = slot_running();
+	record->trial = SLOT_NONE;
+}
+
+#endif // UPDATE
@@ -0,0 +1,83 @@
+//==============================================================================
+// Firmware Update
+// Ian Glen <ian@ianglen.me>
+//==============================================================================
+
+#ifndef ATLC_UPDATE_H
+#define ATLC_UPDATE_H
+
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stdint.h>
+
+#include "can.h"
+#include "config.h"
+
+
+//------------------------------------------------------------------------------
+// Definitions
+//------------------------------------------------------------------------------
+
+/*
+	Writes a new image into the slot that isn't running (src/slot.h), for
+	the bootloader to try on the next reset. tools/can_upload.py is the
+	host side.
+
+	The image is sent in blocks of UPDATE_BLOCK_SIZE bytes, 6 bytes per
+	Update Data frame. The CAN receive ISR copies data frames straight
+	into one of UPDATE_WINDOW block buffers. The main loop programs
+	complete blocks in order and acks each one, so the host keeps sending
+	the next blocks while earlier ones are programmed. A block with lost frames is never
+	acked, the host resends it.
+
+	Start replies at once, the slot is erased as the update goes. A page
+	erase stalls every ISR for ~40 ms, so before erasing the pages of the
+	next window of blocks the node sends Hold and waits for the data frames
+	to stop. The ack after the erase lets the host go on.
+*/
+
+#define UPDATE_BLOCK_SIZE	1536	// bytes
+#define UPDATE_FRAME_DATA	6		// bytes per data frame
+#define UPDATE_BLOCK_FRAMES	(UPDATE_BLOCK_SIZE / UPDATE_FRAME_DATA)
+
+typedef enum
+{
+	UPDATE_OP_START = 0,
+	UPDATE_OP_FINISH = 1,
+	UPDATE_OP_ACTIVATE = 2,
+	UPDATE_OP_CONFIRM = 3,
+	UPDATE_OP_STATUS = 4,
+	UPDATE_OP_ACK = 5,
+	UPDATE_OP_NACK = 6,
+	UPDATE_OP_HOLD = 7
+} update_op_t;
+
+typedef enum
+{
+	UPDATE_OK = 0,
+	UPDATE_ERR_SLOT = 1,		// not started by the bootloader
+	UPDATE_ERR_SIZE = 2,		// image doesn't fit in a slot
+	UPDATE_ERR_FLASH = 3,		// erase, program or verify failed
+	UPDATE_ERR_STATE = 4,		// op out of order
+	UPDATE_ERR_INCOMPLETE = 5,	// finished before all blocks were acked
+	UPDATE_ERR_CRC = 6			// image CRC doesn't match
+} update_status_t;
+
+
+//------------------------------------------------------------------------------
+// Public Functions
+//------------------------------------------------------------------------------
+
+#ifdef UPDATE
+
+void update_command(const can_msg_t *msg);
+void update_receive(const uint8_t *payload, uint8_t len);
+void update_task(void);
+
+#endif // UPDATE
+
+
+#endif // ATLC_UPDATE_H
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+#===============================================================================
+# CAN Node Discovery
+# Ian Glen <ian@ianglen.me>
+#===============================================================================
+
+"""
+List the controllers on a SocketCAN bus and assign their node ids, see
+src/discovery.h.
+
+	can_discover.py -i can0
+	can_discover.py -i can0 --assign 1A2B3C4D=0xA4
+	can_discover.py -i can0 --auto 0xA0
+"""
+
+import argparse
+import sys
+import time
+
+from can_upload import CanBus
+
+CAN_CMD_DISCOVERY = 24
+CAN_CMD_MASK = 0x3F
+BROADCAST_ID = 0xFF
+ID_NONE = 0x00
+
+OP_ANNOUNCE = 0
+OP_DISCOVER = 1
+OP_ASSIGN = 2
+
+SOURCES = {0: "default", 1: "assigned"}
+SPREAD = 0.05			# s, announces are spread over 32 ms
+
+
+#-------------------------------------------------------------------------------
+# Discovery
+#-------------------------------------------------------------------------------
+
+def announces(bus, timeout):
+	"""Collect announces for timeout seconds, returns {uid: (id, source)}."""
+	nodes = {}
+	deadline = time.monotonic() + timeout
+	while True:
+		frame = bus.recv(max(0.0, deadline - time.monotonic()))
+		if frame is None:
+			return nodes
+		can_id, data = frame
+		if (can_id >> 8) & CAN_CMD_MASK != CAN_CMD_DISCOVERY or len(data) != 7 or data[1] != OP_ANNOUNCE:
+			continue
+		nodes[int.from_bytes(data[2:6], "big")] = (data[0], data[6])
+
+
+def discover(bus, host_id, timeout):
+	bus.send(CAN_CMD_DISCOVERY << 8 | BROADCAST_ID, bytes([host_id, OP_DISCOVER]))
+	return announces(bus, timeout)
+
+
+def assign(bus, host_id, uid, node_id, timeout):
+	"""Assign a node id by UID, true once the controller announces it."""
+	bus.send(CAN_CMD_DISCOVERY << 8 | BROADCAST_ID, bytes([host_id, OP_ASSIGN]) + uid.to_bytes(4, "big") + bytes([node_id]))
+	return announces(bus, timeout).get(uid, (None,))[0] == node_id
+
+
+def show(nodes):
+	for uid, (node_id, source) in sorted(nodes.items(), key=lambda item: item[1][0]):
+		state = "unassigned" if node_id == ID_NONE else f"0x{node_id:02X}"
+		print(f"{uid:08X}  {state:<10}  {SOURCES.get(source, source)}")
+
+	ids = [node_id for node_id, _ in nodes.values() if node_id != ID_NONE]
+	for node_id in sorted({i for i in ids if ids.count(i) > 1}):
+		print(f"id 0x{node_id:02X} is used more than once")
+
+
+def main():
+	parser = argparse.ArgumentParser(description="List controllers and assign node ids over CAN")
+	parser.add_argument("-i", "--interface", default="can0", help="SocketCAN interface")
+	parser.add_argument("--host-id", type=lambda x: int(x, 0), default=0x01, help="our id")
+	parser.add_argument("--timeout", type=float, default=0.2, help="s to wait for announces")
+	parser.add_argument("--assign", action="append", default=[], metavar="UID=ID", help="give the controller with UID a node id")
+	parser.add_argument("--auto", type=lambda x: int(x, 0), metavar="FIRST", help="give unassigned and duplicate controllers free ids from FIRST up")
+	args = parser.parse_args()
+
+	bus = CanBus(args.interface, [(CAN_CMD_DISCOVERY << 8 | BROADCAST_ID, CAN_CMD_MASK << 8 | 0xFF)])
+	nodes = discover(bus, args.host_id, args.timeout + SPREAD)
+
+	assignments = []
+	for item in args.assign:
+		uid, node_id = item.split("=")
+		assignments.append((int(uid, 16), int(node_id, 0)))
+
+	if args.auto is not None:
+		used = set()
+		needed = []
+		for uid, (node_id, _) in sorted(nodes.items(), key=lambda item: -item[1][1]):
+			if node_id == ID_NONE or node_id in used:
+				needed.append(uid)
+			else:
+				used.add(node_id)
+
+		free = (i for i in range(args.auto, BROADCAST_ID) if i not in used)
+		assignments += [(uid, next(free)) for uid in needed]
+
+	ok = True
+	for uid, node_id in assignments:
+		if assign(bus, args.host_id, uid, node_id, args.timeout):
+			print(f"{uid:08X} is now 0x{node_id:02X}")
+		else:
+			print(f"{uid:08X} didn't take 0x{node_id:02X}")
+			ok = False
+
+	if assignments:
+		nodes = discover(bus, args.host_id, args.timeout + SPREAD)
+	show(nodes)
+	sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+	try:
+		main()
+	except KeyboardInterrupt:
+		pass
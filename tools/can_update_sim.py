@@ -0,0 +1,234 @@
+#!/usr/bin/env python3
+#===============================================================================
+# CAN Firmware Update Simulator
+# Ian Glen <ian@ianglen.me>
+#===============================================================================
+
+"""
+Stand in for controllers on a SocketCAN interface to test can_upload.py.
+
+Each simulated node answers Update commands like src/update.c, with slots
+held in memory. Activating switches the running slot after a short delay,
+as if the node had reset. --drop loses a share of the data frames to
+exercise resends. Erases hold the host first and lose every frame for
+ERASE_TIME a page, like the stall on the real node.
+
+	ip link add dev vcan0 type vcan && ip link set up vcan0
+	can_update_sim.py -i vcan0 --id 0xA3 --id 0xA4 --drop 0.01
+"""
+
+import argparse
+import random
+import time
+import zlib
+
+from can_upload import (
+	BLOCK_SIZE, CAN_CMD_UPDATE, CAN_CMD_UPDATE_DATA, CanBus, FRAME_DATA,
+	OP_ACK, OP_ACTIVATE, OP_CONFIRM, OP_FINISH, OP_HOLD, OP_START, OP_STATUS, SLOT_SIZE,
+)
+
+WINDOW = 4				# UPDATE_WINDOW
+PROGRAM_TIME = 0.04		# s to program a block
+ERASE_TIME = 0.04		# s a page erase stalls the node
+PAGE_SIZE = 2048		# SLOT_PAGE_SIZE
+HOLD_QUIET = 0.005		# s without data frames before erasing
+HOLD_TIMEOUT = 0.1		# s, erase anyway if the host keeps sending
+RESET_TIME = 0.3		# s from activating to running the new slot
+SLOT_NONE = 0xFF
+
+OK, ERR_SIZE, ERR_STATE, ERR_INCOMPLETE, ERR_CRC = 0, 2, 4, 5, 6
+
+
+#-------------------------------------------------------------------------------
+# Node
+#-------------------------------------------------------------------------------
+
+class SimNode:
+	def __init__(self, node_id, version=(1, 0, 0)):
+		self.id = node_id
+		self.version = version
+		self.slots = [bytearray(b"\xFF" * SLOT_SIZE), bytearray(b"\xFF" * SLOT_SIZE)]
+		self.running = 0
+		self.confirmed = 0
+		self.trial = SLOT_NONE
+		self.active = False
+		self.verified = False
+		self.reset_at = None
+		self.stall_until = 0.0	# erasing, frames are lost
+		self.ack_at = None
+		self.host = None
+
+	def reply(self, payload):
+		return (CAN_CMD_UPDATE << 8 | self.host, bytes(payload))
+
+	def command(self, data, now):
+		"""Handle an Update command, returns the replies."""
+		self.host, op = data[0], data[1]
+
+		if op == OP_START and len(data) == 5:
+			size = int.from_bytes(data[2:5], "big")
+			slot = 1 - self.running
+			status = OK
+			if self.trial == self.running:
+				status = ERR_STATE
+			elif size == 0 or size > SLOT_SIZE:
+				status = ERR_SIZE
+			if status == OK:
+				self.slots[slot][:] = b"\xFF" * SLOT_SIZE
+				self.target = slot
+				self.size = size
+				self.blocks = (size + BLOCK_SIZE - 1) // BLOCK_SIZE
+				self.next_block = 0
+				self.buffers = {}
+				self.ready_at = now
+				self.erased = 0
+				self.hold_at = None
+				self.ack_at = None
+				self.last_frame = now
+				self.active = True
+				self.verified = False
+			return [self.reply([OP_START, self.id, status, slot, WINDOW])]
+
+		if op == OP_FINISH and len(data) == 6:
+			status = OK
+			if not self.active:
+				status = ERR_STATE
+			elif self.next_block < self.blocks:
+				status = ERR_INCOMPLETE
+			elif zlib.crc32(self.slots[self.target][:self.size]) != int.from_bytes(data[2:6], "big"):
+				status = ERR_CRC
+			if status == OK:
+				self.active = False
+				self.verified = True
+			return [self.reply([OP_FINISH, self.id, status])]
+
+		if op == OP_ACTIVATE and len(data) == 2:
+			status = OK if self.verified else ERR_STATE
+			if status == OK:
+				self.trial = self.target
+				self.reset_at = now + RESET_TIME
+			return [self.reply([OP_ACTIVATE, self.id, status])]
+
+		if op == OP_CONFIRM and len(data) == 2:
+			status = OK
+			if self.trial == self.running:
+				self.confirmed = self.running
+				self.trial = SLOT_NONE
+			elif self.confirmed != self.running:
+				status = ERR_STATE
+			return [self.reply([OP_CONFIRM, self.id, status])]
+
+		if op == OP_STATUS and len(data) == 2:
+			if self.reset_at is not None:
+				return []
+			return [self.reply([OP_STATUS, self.id, self.running, self.confirmed, self.trial, *self.version])]
+
+		return []
+
+	def receive(self, data, now):
+		"""Place a data frame in its block buffer, returns the replies."""
+		if not self.active or len(data) < 3 or now < self.stall_until:
+			return []
+
+		self.last_frame = now
+
+		block, frame = data[0], data[1]
+		if block < self.next_block:
+			return [self.ack()]
+		if block >= self.next_block + WINDOW or block >= self.blocks:
+			return []
+
+		buffer = self.buffers.setdefault(block, {})
+		buffer[frame] = bytes(data[2:])
+		return []
+
+	def task(self, now):
+		"""Program complete blocks and reset after activating, returns the replies."""
+		if self.reset_at is not None and now >= self.reset_at:
+			self.reset_at = None
+			self.running = self.trial
+			self.version = (self.version[0], self.version[1] + 1, 0)
+
+		replies = []
+		while self.active and self.next_block < self.blocks and now >= max(self.ready_at, self.stall_until):
+			# hold the host and erase the pages of the next window once its frames stop
+			if self.block_end(self.next_block) > self.erased:
+				if self.hold_at is None:
+					self.hold_at = now
+					replies.append(self.reply([OP_HOLD, self.id, self.next_block >> 8, self.next_block & 0xFF]))
+				if now - self.last_frame < HOLD_QUIET and now - self.hold_at < HOLD_TIMEOUT:
+					break
+
+				end = self.block_end(min(self.next_block + WINDOW, self.blocks) - 1)
+				pages = (end + PAGE_SIZE - 1) // PAGE_SIZE - self.erased // PAGE_SIZE
+				self.erased += pages * PAGE_SIZE
+				self.hold_at = None
+				self.stall_until = now + pages * ERASE_TIME
+				self.ack_at = self.stall_until
+				break
+
+			block = self.next_block
+			length = min(BLOCK_SIZE, self.size - block * BLOCK_SIZE)
+			frames = (length + FRAME_DATA - 1) // FRAME_DATA
+			buffer = self.buffers.get(block, {})
+			if len(buffer) < frames:
+				break
+
+			address = block * BLOCK_SIZE
+			data = b"".join(buffer[i] for i in range(frames))[:length]
+			self.slots[self.target][address:address + length] = data
+			del self.buffers[block]
+			self.next_block += 1
+			self.ready_at = now + PROGRAM_TIME
+			replies.append(self.ack())
+
+		if self.active and self.ack_at is not None and now >= self.ack_at:
+			self.ack_at = None
+			replies.append(self.ack())
+		return replies
+
+	def block_end(self, block):
+		return min((block + 1) * BLOCK_SIZE, self.size)
+
+	def ack(self):
+		return self.reply([OP_ACK, self.id, self.next_block >> 8, self.next_block & 0xFF])
+
+
+def simulate(bus, nodes, drop=0.0, duration=None):
+	"""Run the nodes on a bus until duration seconds have passed."""
+	end = None if duration is None else time.monotonic() + duration
+	while end is None or time.monotonic() < end:
+		replies = []
+		frame = bus.recv(0.005)
+		now = time.monotonic()
+		if frame is not None:
+			can_id, data = frame
+			command, node = can_id >> 8, nodes.get(can_id & 0xFF)
+			if node is not None and command == CAN_CMD_UPDATE and len(data) >= 2:
+				replies += node.command(data, now)
+			elif node is not None and command == CAN_CMD_UPDATE_DATA and random.random() >= drop:
+				replies += node.receive(data, now)
+
+		for node in nodes.values():
+			replies += node.task(now)
+		for can_id, data in replies:
+			bus.send(can_id, data)
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Simulate controllers taking a CAN firmware update")
+	parser.add_argument("-i", "--interface", default="vcan0", help="SocketCAN interface")
+	parser.add_argument("--id", action="append", type=lambda x: int(x, 0), required=True, help="node id, repeat for more nodes")
+	parser.add_argument("--drop", type=float, default=0.0, help="share of data frames to lose")
+	args = parser.parse_args()
+
+	filters = [(command << 8 | node_id, CanBus.EFF_MASK) for node_id in args.id for command in (CAN_CMD_UPDATE, CAN_CMD_UPDATE_DATA)]
+	bus = CanBus(args.interface, filters)
+	simulate(bus, {node_id: SimNode(node_id) for node_id in args.id}, args.drop)
+
+
+if __name__ == "__main__":
+	try:
+		main()
+	except KeyboardInterrupt:
+		pass
@@ -0,0 +1,380 @@
+#!/usr/bin/env python3
+#===============================================================================
+# CAN Firmware Uploader
+# Ian Glen <ian@ianglen.me>
+#===============================================================================
+
+"""
+Update controllers over a SocketCAN interface, see src/update.h.
+
+Each node runs from slot A or B and is sent the image built for the other
+one. All nodes are sent their image at once, interleaved frame by frame,
+so the bus stays busy while each node programs flash. Once every node has
+checked its image CRC, they are all started together and confirmed when
+they come back with the new slot running.
+
+	can_upload.py -i can0 --id 0xA3 --id 0xA4 \\
+		.pio/build/led-controller-a/firmware.bin .pio/build/led-controller-b/firmware.bin
+	can_upload.py -i can0 --id 0xA3 --status
+
+For testing without hardware, run can_update_sim.py on a vcan interface:
+
+	ip link add dev vcan0 type vcan && ip link set up vcan0
+	can_update_sim.py -i vcan0 --id 0xA3 --id 0xA4 &
+	can_upload.py -i vcan0 --id 0xA3 --id 0xA4 a.bin b.bin
+"""
+
+import argparse
+import errno
+import socket
+import struct
+import sys
+import time
+import zlib
+
+CAN_CMD_UPDATE = 20
+CAN_CMD_UPDATE_DATA = 21
+
+OP_START = 0
+OP_FINISH = 1
+OP_ACTIVATE = 2
+OP_CONFIRM = 3
+OP_STATUS = 4
+OP_ACK = 5
+OP_NACK = 6
+OP_HOLD = 7
+
+STATUS_TEXT = {
+	0: "ok",
+	1: "not started by the bootloader",
+	2: "image doesn't fit in a slot",
+	3: "flash error",
+	4: "out of order",
+	5: "incomplete",
+	6: "CRC mismatch",
+}
+
+BLOCK_SIZE = 1536		# bytes, UPDATE_BLOCK_SIZE
+FRAME_DATA = 6			# bytes per data frame
+SLOT_SIZE = 240 * 1024
+SLOT_NAMES = {0: "A", 1: "B", 0xFF: "-"}
+
+ACK_TIMEOUT = 0.5		# s without an ack before unacked blocks are resent
+REPLY_TIMEOUT = 1.0		# s
+BOOT_TIMEOUT = 5.0		# s for a node to come back after activating
+MAX_RETRIES = 10		# resends of a block before giving up on a node
+
+
+#-------------------------------------------------------------------------------
+# SocketCAN
+#-------------------------------------------------------------------------------
+
+class CanBus:
+	"""Raw SocketCAN socket for extended-ID frames."""
+
+	FRAME = struct.Struct("=IB3x8s")
+	EFF_FLAG = 0x80000000
+	EFF_MASK = 0x1FFFFFFF
+
+	def __init__(self, interface, filters=()):
+		self.sock = socket.socket(socket.AF_CAN, socket.SOCK_RAW, socket.CAN_RAW)
+		if filters:
+			data = b"".join(struct.pack("=II", can_id | self.EFF_FLAG, mask | self.EFF_FLAG) for can_id, mask in filters)
+			self.sock.setsockopt(socket.SOL_CAN_RAW, socket.CAN_RAW_FILTER, data)
+		self.sock.bind((interface,))
+
+	def send(self, can_id, data):
+		frame = self.FRAME.pack(can_id | self.EFF_FLAG, len(data), bytes(data).ljust(8, b"\0"))
+		while True:
+			try:
+				self.sock.send(frame)
+				return
+			except OSError as e:
+				# the interface tx queue is full, let it drain
+				if e.errno != errno.ENOBUFS:
+					raise
+				time.sleep(0.001)
+
+	def recv(self, timeout):
+		"""Return (can_id, data), or None after timeout seconds."""
+		self.sock.settimeout(timeout)
+		try:
+			frame = self.sock.recv(self.FRAME.size)
+		except socket.timeout:
+			return None
+		can_id, length, data = self.FRAME.unpack(frame)
+		return can_id & self.EFF_MASK, data[:length]
+
+
+#-------------------------------------------------------------------------------
+# Update
+#-------------------------------------------------------------------------------
+
+class Node:
+	"""Update state of one controller."""
+
+	def __init__(self, node_id):
+		self.id = node_id
+		self.image = b""
+		self.blocks = 0
+		self.acked = 0			# blocks programmed
+		self.window = 0
+		self.sent = 0			# blocks sent since the last ack
+		self.held = False		# erasing, nothing is sent until its next ack
+		self.last_ack = 0.0
+		self.resends = 0
+		self.retries = 0		# resends since the last ack that moved on
+		self.error = None
+
+	def start(self, image, window):
+		self.image = image
+		self.blocks = (len(image) + BLOCK_SIZE - 1) // BLOCK_SIZE
+		self.acked = 0
+		self.sent = 0
+		self.retries = 0
+		self.window = window
+		self.last_ack = time.monotonic()
+
+	def done(self):
+		return self.error is not None or self.acked >= self.blocks
+
+	def frames(self, block):
+		data = self.image[block * BLOCK_SIZE:(block + 1) * BLOCK_SIZE]
+		for frame in range(0, len(data), FRAME_DATA):
+			yield bytes([block & 0xFF, frame // FRAME_DATA]) + data[frame:frame + FRAME_DATA]
+
+
+class Uploader:
+	def __init__(self, bus, host_id, verbose=False):
+		self.bus = bus
+		self.host_id = host_id
+		self.verbose = verbose
+
+	def log(self, node, text):
+		print(f"0x{node.id:02X}: {text}", flush=True)
+
+	def command(self, node, op, data=b""):
+		self.bus.send(CAN_CMD_UPDATE << 8 | node.id, bytes([self.host_id, op]) + data)
+
+	def reply(self, timeout, nodes, op):
+		"""Wait for an op reply from every node, returns {id: payload}."""
+		replies = {}
+		deadline = time.monotonic() + timeout
+		while len(replies) < len(nodes):
+			frame = self.bus.recv(max(0.0, deadline - time.monotonic()))
+			if frame is None:
+				break
+			data = self.handle(frame, nodes)
+			if data and data[0] == op and data[1] in nodes:
+				replies[data[1]] = data
+		return replies
+
+	def handle(self, frame, nodes):
+		"""Apply acks and nacks, returns the update reply payload."""
+		can_id, data = frame
+		if can_id != (CAN_CMD_UPDATE << 8 | self.host_id) or len(data) < 2:
+			return None
+
+		node = nodes.get(data[1])
+		if node is not None and data[0] == OP_ACK and len(data) >= 4:
+			acked = data[2] << 8 | data[3]
+			if acked > node.acked:
+				node.sent = max(0, node.sent - (acked - node.acked))
+				node.acked = acked
+				node.retries = 0
+			node.held = False
+			node.last_ack = time.monotonic()
+		elif node is not None and data[0] == OP_HOLD:
+			node.held = True
+			node.last_ack = time.monotonic()
+		elif node is not None and data[0] == OP_NACK and len(data) >= 5:
+			node.error = f"block {data[3] << 8 | data[4]}: {STATUS_TEXT.get(data[2], data[2])}"
+		return data
+
+	def status(self, nodes):
+		for node in nodes.values():
+			self.command(node, OP_STATUS)
+		return self.reply(REPLY_TIMEOUT, nodes, OP_STATUS)
+
+	def send_images(self, nodes):
+		"""Stream blocks to every node, interleaving frames between them."""
+		streams = {}
+		while not all(node.done() for node in nodes.values()):
+			now = time.monotonic()
+			for node in nodes.values():
+				if node.done():
+					continue
+
+				# no ack for a while, go back to the first unacked block
+				if now - node.last_ack > ACK_TIMEOUT:
+					node.held = False
+					node.sent = 0
+					node.resends += 1
+					node.retries += 1
+					node.last_ack = now
+					streams.pop(node.id, None)
+					if node.retries > MAX_RETRIES:
+						node.error = "no acks"
+						continue
+
+				# the node is erasing flash and can't take frames
+				if node.held:
+					continue
+
+				stream = streams.get(node.id)
+				if stream is None and node.sent < node.window and node.acked + node.sent < node.blocks:
+					stream = streams[node.id] = node.frames(node.acked + node.sent)
+				if stream is None:
+					continue
+
+				frame = next(stream, None)
+				if frame is None:
+					node.sent += 1
+					del streams[node.id]
+				else:
+					self.bus.send(CAN_CMD_UPDATE_DATA << 8 | node.id, frame)
+
+			# pick up acks without stalling the stream
+			sending = any(not nodes[node_id].held for node_id in streams)
+			while True:
+				frame = self.bus.recv(0 if sending else 0.01)
+				if frame is None:
+					break
+				self.handle(frame, nodes)
+
+	def run(self, nodes, images, activate=True, confirm=True):
+		"""Update every node, true if they all succeeded."""
+		count = len(nodes)
+		states = self.status(nodes)
+		for node_id in list(nodes):
+			if node_id not in states:
+				self.log(nodes.pop(node_id), "no reply")
+		if not nodes:
+			return False
+
+		# each node gets the image built for the slot it isn't running
+		for node in nodes.values():
+			data = states[node.id]
+			slot = 0 if data[2] == 1 else 1
+			self.log(node, f"running {SLOT_NAMES.get(data[2], '?')} v{data[5]}.{data[6]}.{data[7]}, writing {SLOT_NAMES[slot]}")
+			node.image = images[slot]
+			size = len(node.image).to_bytes(3, "big")
+			self.command(node, OP_START, size)
+
+		starts = self.reply(REPLY_TIMEOUT, nodes, OP_START)
+		for node in list(nodes.values()):
+			data = starts.get(node.id)
+			if data is None or data[2] != 0:
+				self.log(node, f"start failed: {STATUS_TEXT.get(data[2], data[2]) if data else 'no reply'}")
+				del nodes[node.id]
+			else:
+				node.start(node.image, data[4])
+		if not nodes:
+			return False
+
+		started = time.monotonic()
+		self.send_images(nodes)
+		elapsed = time.monotonic() - started
+		total = sum(len(node.image) for node in nodes.values() if node.error is None)
+		print(f"sent {total} bytes in {elapsed:.2f} s ({total / elapsed / 1024:.1f} KiB/s)", flush=True)
+
+		for node in list(nodes.values()):
+			if node.error:
+				self.log(node, f"failed, {node.error}")
+				del nodes[node.id]
+			else:
+				crc = zlib.crc32(node.image)
+				self.command(node, OP_FINISH, crc.to_bytes(4, "big"))
+
+		finishes = self.reply(REPLY_TIMEOUT * 2, nodes, OP_FINISH)
+		for node in list(nodes.values()):
+			data = finishes.get(node.id)
+			if data is None or data[2] != 0:
+				self.log(node, f"verify failed: {STATUS_TEXT.get(data[2], data[2]) if data else 'no reply'}")
+				del nodes[node.id]
+			else:
+				self.log(node, f"image verified, {node.resends} resends")
+		if not nodes or not activate:
+			return len(nodes) == count
+
+		# start them all together
+		for node in nodes.values():
+			self.command(node, OP_ACTIVATE)
+		self.reply(REPLY_TIMEOUT, nodes, OP_ACTIVATE)
+
+		ok = len(nodes) == count
+		deadline = time.monotonic() + BOOT_TIMEOUT
+		pending = dict(nodes)
+		while pending and time.monotonic() < deadline:
+			time.sleep(0.2)
+			for node_id, data in self.status(pending).items():
+				if data[2] == data[4]:
+					self.log(pending.pop(node_id), f"running trial slot {SLOT_NAMES[data[2]]} v{data[5]}.{data[6]}.{data[7]}")
+		for node in pending.values():
+			self.log(node, "didn't start the new image, it falls back on the next reset")
+			ok = False
+			del nodes[node.id]
+
+		if confirm and nodes:
+			for node in nodes.values():
+				self.command(node, OP_CONFIRM)
+			confirms = self.reply(REPLY_TIMEOUT, nodes, OP_CONFIRM)
+			for node in nodes.values():
+				data = confirms.get(node.id)
+				if data is None or data[2] != 0:
+					self.log(node, f"confirm failed: {STATUS_TEXT.get(data[2], data[2]) if data else 'no reply'}")
+					ok = False
+				else:
+					self.log(node, "confirmed")
+
+		return ok
+
+
+def read_image(path):
+	with open(path, "rb") as f:
+		image = f.read()
+	if not image or len(image) > SLOT_SIZE:
+		sys.exit(f"{path}: {len(image)} bytes doesn't fit in a {SLOT_SIZE} byte slot")
+	return image
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Update controllers over CAN")
+	parser.add_argument("image_a", nargs="?", help="firmware .bin linked for slot A")
+	parser.add_argument("image_b", nargs="?", help="firmware .bin linked for slot B")
+	parser.add_argument("-i", "--interface", default="can0", help="SocketCAN interface")
+	parser.add_argument("--id", action="append", type=lambda x: int(x, 0), required=True, help="node id, repeat for more nodes")
+	parser.add_argument("--host-id", type=lambda x: int(x, 0), default=0x01, help="id replies are sent to")
+	parser.add_argument("--status", action="store_true", help="show the running slot and version and exit")
+	parser.add_argument("--no-activate", action="store_true", help="write and verify, don't start the new image")
+	parser.add_argument("--no-confirm", action="store_true", help="start the new image but leave it on trial")
+	args = parser.parse_args()
+
+	bus = CanBus(args.interface, [(CAN_CMD_UPDATE << 8 | args.host_id, CanBus.EFF_MASK)])
+	uploader = Uploader(bus, args.host_id)
+	nodes = {node_id: Node(node_id) for node_id in args.id}
+
+	if args.status:
+		states = uploader.status(nodes)
+		for node in nodes.values():
+			data = states.get(node.id)
+			if data is None:
+				uploader.log(node, "no reply")
+			else:
+				slots = f"running {SLOT_NAMES.get(data[2], '?')}, confirmed {SLOT_NAMES.get(data[3], '?')}, trial {SLOT_NAMES.get(data[4], '?')}"
+				uploader.log(node, f"v{data[5]}.{data[6]}.{data[7]}, {slots}")
+		return
+
+	if not args.image_a or not args.image_b:
+		parser.error("both slot images are needed")
+
+	images = [read_image(args.image_a), read_image(args.image_b)]
+	ok = uploader.run(nodes, images, not args.no_activate, not args.no_confirm)
+	sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+	try:
+		main()
+	except KeyboardInterrupt:
+		pass
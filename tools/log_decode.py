@@ -0,0 +1,273 @@
+#!/usr/bin/env python3
+#===============================================================================
+# Tokenized Log Decoder
+# Ian Glen <ian@ianglen.me>
+#===============================================================================
+
+"""
+Decode LOG_TOKENS output from the controller's UART.
+
+The format strings live in the .logstr section of the firmware ELF, and a
+token is an entry's offset in that section. printf() text between frames is
+passed through unchanged, and UART_COMMANDS replies are shown as hex.
+
+	log_decode.py .pio/build/led-controller/firmware.elf /dev/ttyUSB0
+	log_decode.py firmware.elf capture.bin
+	log_decode.py firmware.elf --table
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+FRAME_MAX = 72			# bytes, longer segments can only be text
+FRAME_LOG = 0x01
+FRAME_COMMAND = 0x02
+IDLE_TIME = 0.05		# s, text without a delimiter is printed after this
+
+FORMAT_SPEC = re.compile(r"%([-+ #0]*\d*(?:\.\d+)?)(hh|h|ll|l|z|j|t)?([diuxXoc%s])")
+
+
+#-------------------------------------------------------------------------------
+# Token Table
+#-------------------------------------------------------------------------------
+
+def read_section(path, name):
+	"""Return the contents of a little-endian ELF section."""
+	with open(path, "rb") as f:
+		elf = f.read()
+
+	if elf[:4] != b"\x7fELF" or elf[5] != 1:
+		sys.exit(f"{path}: not a little-endian ELF")
+
+	# offset, size and name fields differ between ELF32 and ELF64
+	if elf[4] == 1:
+		shoff, = struct.unpack_from("<I", elf, 0x20)
+		shentsize, shnum, shstrndx = struct.unpack_from("<HHH", elf, 0x2E)
+		section = "<IIIIII"
+	else:
+		shoff, = struct.unpack_from("<Q", elf, 0x28)
+		shentsize, shnum, shstrndx = struct.unpack_from("<HHH", elf, 0x3A)
+		section = "<IIQQQQ"
+
+	def header(index):
+		sh_name, _, _, _, sh_offset, sh_size = struct.unpack_from(section, elf, shoff + index * shentsize)
+		return sh_name, sh_offset, sh_size
+
+	strtab = header(shstrndx)[1]
+	for i in range(shnum):
+		sh_name, sh_offset, sh_size = header(i)
+		start = strtab + sh_name
+		if elf[start:elf.index(b"\0", start)].decode() == name:
+			return elf[sh_offset:sh_offset + sh_size]
+
+	sys.exit(f"{path}: no {name} section, was it built with LOG_TOKENS?")
+
+
+def load_table(path):
+	"""Map tokens to (level, file, line, format)."""
+	data = read_section(path, ".logstr")
+	table = {}
+
+	offset = 0
+	while offset < len(data):
+		end = data.index(b"\0", offset)
+		if end > offset:
+			fields = data[offset:end].decode(errors="replace").split("\x1f", 3)
+			if len(fields) == 4:
+				table[offset] = tuple(fields)
+		offset = end + 1
+
+	return table
+
+
+#-------------------------------------------------------------------------------
+# Framing
+#-------------------------------------------------------------------------------
+
+def crc16(data):
+	"""CRC-16/CCITT-FALSE, matches crc16_update() in src/crc.c."""
+	crc = 0xFFFF
+	for byte in data:
+		crc ^= byte << 8
+		for _ in range(8):
+			crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+			crc &= 0xFFFF
+	return crc
+
+
+def cobs_decode(data):
+	"""Return the decoded packet, or None if malformed."""
+	out = bytearray()
+	pos = 0
+	while pos < len(data):
+		code = data[pos]
+		pos += 1
+		if code == 0 or pos + code - 1 > len(data):
+			return None
+		out += data[pos:pos + code - 1]
+		pos += code - 1
+		if code != 0xFF and pos < len(data):
+			out.append(0)
+	return bytes(out)
+
+
+def read_varints(data):
+	values = []
+	value = shift = 0
+	for byte in data:
+		value |= (byte & 0x7F) << shift
+		shift += 7
+		if not byte & 0x80:
+			values.append(value)
+			value = shift = 0
+	if shift:
+		return None
+	return values
+
+
+def decode_frame(segment):
+	"""Return (type, data) for a valid frame, None otherwise."""
+	if len(segment) < 3 or len(segment) > FRAME_MAX:
+		return None
+
+	packet = cobs_decode(segment)
+	if packet is None or len(packet) < 3:
+		return None
+	if crc16(packet[:-2]) != struct.unpack(">H", packet[-2:])[0]:
+		return None
+
+	return packet[0], packet[1:-2]
+
+
+#-------------------------------------------------------------------------------
+# Formatting
+#-------------------------------------------------------------------------------
+
+def format_message(fmt, args):
+	"""printf() a format string with 32-bit integer arguments."""
+	args = list(args)
+
+	def convert(match):
+		flags, _, spec = match.groups()
+		if spec == "%":
+			return "%"
+		if not args:
+			return "<missing>"
+
+		value = args.pop(0) & 0xFFFFFFFF
+		if spec == "s":
+			return f"<str 0x{value:08x}>"
+		if spec == "c":
+			return chr(value & 0xFF)
+		if spec in "di" and value & 0x80000000:
+			value -= 1 << 32
+		if spec in "diu":
+			spec = "d"
+		return ("%" + flags + spec) % value
+
+	return FORMAT_SPEC.sub(convert, fmt)
+
+
+def format_entry(table, values):
+	token, args = values[0], values[1:]
+	if token not in table:
+		return f"? unknown token 0x{token:x} {args}"
+
+	level, file, line, fmt = table[token]
+	return f"{level} {file}:{line}: {format_message(fmt, args)}"
+
+
+#-------------------------------------------------------------------------------
+# Stream
+#-------------------------------------------------------------------------------
+
+class Decoder:
+	def __init__(self, table, out):
+		self.table = table
+		self.out = out
+		self.pending = bytearray()
+
+	def feed(self, data):
+		for byte in data:
+			if byte == 0:
+				self.segment(bytes(self.pending))
+				self.pending.clear()
+			else:
+				self.pending.append(byte)
+
+		# too long for a frame, must be text
+		if len(self.pending) > FRAME_MAX and b"\n" in self.pending:
+			end = self.pending.rindex(b"\n") + 1
+			self.text(bytes(self.pending[:end]))
+			del self.pending[:end]
+
+	def idle(self):
+		# frames arrive in one burst, anything left printable is text
+		if self.pending and all(b in b"\r\n\t" or 0x20 <= b < 0x7F for b in self.pending):
+			self.text(bytes(self.pending))
+			self.pending.clear()
+
+	def segment(self, segment):
+		frame = decode_frame(segment)
+		if frame is None:
+			if segment:
+				self.text(segment)
+			return
+
+		kind, data = frame
+		values = read_varints(data) if kind == FRAME_LOG else None
+		if values:
+			self.out.write(format_entry(self.table, values) + "\n")
+		elif kind == FRAME_COMMAND and len(data) >= 2:
+			self.out.write(f"> cmd {data[0]} id 0x{data[1]:02x}: {data[2:].hex(' ')}\n")
+		else:
+			self.out.write(f"? frame type {kind}: {data.hex(' ')}\n")
+		self.out.flush()
+
+	def text(self, data):
+		self.out.write(data.decode(errors="replace").replace("\r\n", "\n"))
+		self.out.flush()
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Decode tokenized log output")
+	parser.add_argument("elf", help="firmware ELF built with LOG_TOKENS")
+	parser.add_argument("input", nargs="?", help="serial port or capture file, stdin if omitted")
+	parser.add_argument("-b", "--baud", type=int, default=921600, help="serial baud rate")
+	parser.add_argument("--table", action="store_true", help="print the token table and exit")
+	args = parser.parse_args()
+
+	table = load_table(args.elf)
+	if args.table:
+		for token, (level, file, line, fmt) in sorted(table.items()):
+			print(f"0x{token:04x} {level} {file}:{line}: {fmt}")
+		return
+
+	decoder = Decoder(table, sys.stdout)
+
+	if args.input and args.input.startswith(("/dev/", "COM")):
+		import serial
+		port = serial.Serial(args.input, args.baud, timeout=IDLE_TIME)
+		while True:
+			data = port.read(4096)
+			if data:
+				decoder.feed(data)
+			else:
+				decoder.idle()
+
+	stream = open(args.input, "rb") if args.input else sys.stdin.buffer
+	while True:
+		data = stream.read1(4096) if hasattr(stream, "read1") else stream.read(4096)
+		if not data:
+			break
+		decoder.feed(data)
+	decoder.segment(bytes(decoder.pending))
+
+
+if __name__ == "__main__":
+	try:
+		main()
+	except KeyboardInterrupt:
+		pass
@@ -0,0 +1,285 @@
+#!/usr/bin/env python3
+#===============================================================================
+# RGB Pixels Codec
+# Ian Glen <ian@ianglen.me>
+#===============================================================================
+
+"""
+Encode indexed strip frames as RGB Pixels messages, see the Indexed Color
+section of the README.
+
+Each frame is sent packed, as runs, or as runs XORed onto the previous
+frame, whichever takes the fewest messages. Every encoding is decoded
+again by a model of src/rgb_strip.c and compared with the frame, and the
+message counts are reported next to what the frames cost as GRB.
+
+	rgb_codec.py --demo
+	rgb_codec.py --depth 4 capture.txt
+	rgb_codec.py --depth 4 -i can0 --id 0xA3 --strip 0 --fps 30 capture.txt
+
+A frame file has one frame per line, the palette index of each LED in hex
+separated by spaces. Lines starting with # are skipped. Without -i the
+exit status is 1 if any frame didn't decode back to itself.
+
+tools/frames/ holds checked-in sequences. Checking them after a change
+to the encoders or to the decoder in src/rgb_strip.c must exit with 0:
+
+	tools/rgb_codec.py --depth 4 tools/frames/tank_fill.txt
+"""
+
+import argparse
+import random
+import sys
+import time
+
+CAN_CMD_RGB_PALETTE = 25
+CAN_CMD_RGB_PIXELS = 26
+
+SHOW = 0x80
+PACKED = 0x00
+RLE = 0x20
+XOR = 0x40
+ENCODINGS = {PACKED: "packed", RLE: "rle", XOR: "xor"}
+
+PAYLOAD_DATA = 6		# bytes after the strip and LED bytes
+MAX_RUN = 255
+MAX_LEDS = 255
+
+
+#-------------------------------------------------------------------------------
+# Encoders
+#-------------------------------------------------------------------------------
+
+def encode_packed(frame, depth):
+	"""Messages of (encoding, first LED, data) with the indices packed MSB first."""
+	per_message = PAYLOAD_DATA * 8 // depth
+	messages = []
+	for first in range(0, len(frame), per_message):
+		value = 0
+		chunk = frame[first:first + per_message]
+		for index in chunk:
+			value = value << depth | index
+		bits = len(chunk) * depth
+		data = (value << (-bits % 8)).to_bytes((bits + 7) // 8, "big")
+		messages.append((PACKED, first, data))
+	return messages
+
+
+def runs(values):
+	"""Split values into (position, count, value) runs of at most MAX_RUN."""
+	result = []
+	position = 0
+	while position < len(values):
+		count = 1
+		while position + count < len(values) and count < MAX_RUN and values[position + count] == values[position]:
+			count += 1
+		result.append((position, count, values[position]))
+		position += count
+	return result
+
+
+def pack_runs(encoding, values, skip=None):
+	"""Messages of up to three runs, runs of skip start no message and end one."""
+	messages = []
+	first = None
+	data = b""
+	for position, count, value in runs(values):
+		if value == skip:
+			if first is not None:
+				messages.append((encoding, first, data))
+				first = None
+			continue
+
+		if first is None:
+			first, data = position, b""
+		data += bytes([count, value])
+		if len(data) == PAYLOAD_DATA:
+			messages.append((encoding, first, data))
+			first = None
+
+	if first is not None:
+		messages.append((encoding, first, data))
+	return messages
+
+
+def encode_rle(frame):
+	return pack_runs(RLE, frame)
+
+
+def encode_xor(previous, frame):
+	"""Runs of the change from previous, unchanged LEDs aren't sent."""
+	return pack_runs(XOR, [a ^ b for a, b in zip(previous, frame)], skip=0)
+
+
+def encode(previous, frame, depth):
+	"""Encode a frame in the fewest messages, previous is what the strip holds."""
+	options = [encode_packed(frame, depth), encode_rle(frame)]
+	if previous is not None:
+		options.append(encode_xor(previous, frame))
+	return min(options, key=len)
+
+
+def payloads(strip, messages):
+	"""RGB Pixels payloads for a frame, the last one shows it."""
+	result = []
+	for i, (encoding, first, data) in enumerate(messages):
+		flags = encoding | (SHOW if i == len(messages) - 1 else 0)
+		result.append(bytes([strip | flags, first]) + data)
+	return result
+
+
+#-------------------------------------------------------------------------------
+# Decoder
+#-------------------------------------------------------------------------------
+
+def decode(framebuffer, messages, depth):
+	"""Apply messages to a framebuffer like rgb_strip_set_pixels() and rgb_strip_set_runs()."""
+	mask = (1 << depth) - 1
+	for encoding, first, data in messages:
+		led = first
+		if encoding == PACKED:
+			per_byte = 8 // depth
+			for i in range(len(data) * per_byte):
+				if led + i >= len(framebuffer):
+					break
+				shift = 8 - depth - (i % per_byte) * depth
+				framebuffer[led + i] = (data[i // per_byte] >> shift) & mask
+			continue
+
+		for i in range(0, len(data) - 1, 2):
+			value = data[i + 1] & mask
+			end = min(led + data[i], len(framebuffer))
+			while led < end:
+				framebuffer[led] = framebuffer[led] ^ value if encoding == XOR else value
+				led += 1
+
+
+#-------------------------------------------------------------------------------
+# Sequences
+#-------------------------------------------------------------------------------
+
+def load(path, depth):
+	frames = []
+	with open(path) as file:
+		for line in file:
+			line = line.strip()
+			if not line or line.startswith("#"):
+				continue
+			frame = [int(value, 16) for value in line.split()]
+			if len(frame) > MAX_LEDS or max(frame) >= 1 << depth:
+				raise ValueError(f"{path}: frame {len(frames) + 1} doesn't fit {MAX_LEDS} LEDs at {depth} bits")
+			if frames and len(frame) != len(frames[0]):
+				raise ValueError(f"{path}: frame {len(frames) + 1} has {len(frame)} LEDs, not {len(frames[0])}")
+			frames.append(frame)
+	return frames
+
+
+def demo(leds, depth, count=120, seed=1):
+	"""Synthetic sequences for when no capture is at hand."""
+	rng = random.Random(seed)
+	colors = 1 << depth
+
+	sparkle = [0] * leds
+	sparkles = []
+	for _ in range(count):
+		sparkle = list(sparkle)
+		for _ in range(3):
+			sparkle[rng.randrange(leds)] = rng.randrange(colors)
+		sparkles.append(sparkle)
+
+	return {
+		"chase": [[1 if i == t % leds else 0 for i in range(leds)] for t in range(count)],
+		"fill": [[2 if i < t % (leds + 1) else 0 for i in range(leds)] for t in range(count)],
+		"zones": [[(i * 4 // leds + t // 10) % colors for i in range(leds)] for t in range(count)],
+		"sparkle": sparkles,
+		"gradient": [[(i + t) % colors for i in range(leds)] for t in range(count)],
+		"noise": [[rng.randrange(colors) for _ in range(leds)] for _ in range(count)],
+	}
+
+
+def grb_messages(leds):
+	"""Messages per frame if LEDs were sent as 3 bytes of GRB."""
+	return (leds * 3 + PAYLOAD_DATA - 1) // PAYLOAD_DATA
+
+
+def check(name, frames, depth):
+	"""Encode and decode a sequence, prints its message counts and returns true if it round trips."""
+	totals = {"grb": 0, "packed": 0, "rle": 0, "xor": 0, "best": 0}
+	framebuffer = [0] * len(frames[0])		# a depth change clears the strip
+	ok = True
+
+	for number, frame in enumerate(frames):
+		previous = list(framebuffer)
+		messages = encode(previous, frame, depth)
+		decode(framebuffer, messages, depth)
+		if framebuffer != frame:
+			print(f"{name}: frame {number + 1} decoded wrong")
+			framebuffer = list(frame)
+			ok = False
+
+		for encoding, result in ((PACKED, encode_packed(frame, depth)), (RLE, encode_rle(frame)), (XOR, encode_xor(previous, frame))):
+			copy = list(previous)
+			decode(copy, result, depth)
+			if copy != frame:
+				print(f"{name}: frame {number + 1} decoded wrong as {ENCODINGS[encoding]}")
+				ok = False
+			totals[ENCODINGS[encoding]] += len(result)
+
+		totals["grb"] += grb_messages(len(frame))
+		totals["best"] += len(messages)
+
+	ratio = totals["grb"] / max(totals["best"], 1)
+	print(f"{name:<12}{len(frames):>7}{len(frames[0]):>6}{totals['grb']:>8}{totals['packed']:>8}{totals['rle']:>8}{totals['xor']:>8}{totals['best']:>8}{ratio:>8.1f}x")
+	return ok
+
+
+#-------------------------------------------------------------------------------
+# Sending
+#-------------------------------------------------------------------------------
+
+def send(args, frames):
+	from can_upload import CanBus
+
+	bus = CanBus(args.interface)
+	bus.send(CAN_CMD_RGB_PALETTE << 8 | args.id, bytes([args.strip, args.depth]))		# selects the depth
+
+	framebuffer = [0] * len(frames[0])
+	for frame in frames:
+		start = time.monotonic()
+		for payload in payloads(args.strip, encode(framebuffer, frame, args.depth)):
+			bus.send(CAN_CMD_RGB_PIXELS << 8 | args.id, payload)
+		framebuffer = list(frame)
+		time.sleep(max(0.0, 1 / args.fps - (time.monotonic() - start)))
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Encode indexed frames as RGB Pixels messages and check them")
+	parser.add_argument("files", nargs="*", help="frame sequences, one frame per line")
+	parser.add_argument("--depth", type=int, choices=(2, 4, 8), default=8, help="bits per LED")
+	parser.add_argument("--leds", type=int, default=36, help="LEDs per frame for --demo")
+	parser.add_argument("--demo", action="store_true", help="check synthetic sequences")
+	parser.add_argument("-i", "--interface", help="SocketCAN interface to send the frames on")
+	parser.add_argument("--id", type=lambda x: int(x, 0), default=0xA3, help="node id")
+	parser.add_argument("--strip", type=int, default=0, help="strip number")
+	parser.add_argument("--fps", type=float, default=30.0, help="frames per second sent")
+	args = parser.parse_args()
+
+	sequences = demo(args.leds, args.depth) if args.demo else {}
+	for path in args.files:
+		sequences[path] = load(path, args.depth)
+
+	if args.interface:
+		for frames in sequences.values():
+			send(args, frames)
+		return
+
+	print(f"{'sequence':<12}{'frames':>7}{'leds':>6}{'grb':>8}{'packed':>8}{'rle':>8}{'xor':>8}{'best':>8}{'ratio':>9}")
+	ok = all([check(name, frames, args.depth) for name, frames in sequences.items() if frames])
+	sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+	try:
+		main()
+	except KeyboardInterrupt:
+		pass